@@ -77,6 +77,23 @@ struct rvgpu_ctx_arguments {
 	uint16_t scanout_num;
 	/* Rendering id for rvgpu compositor */
 	char *rvgpu_surface_id;
+	/* Keep a shadow copy of 2D resources and send only changed tiles */
+	bool res_shadow;
+	/* Compress resource patches for hosts that support it */
+	bool patch_lz;
+	/* Pack scanout updates lossy when the links can't keep up */
+	bool lossy;
+	/* Send cached resource patches as references to the renderer cache */
+	bool chunks;
+	/* Replay repeated 3D command buffers from the renderer cache */
+	bool cmd_cache;
+	/* Pace the command stream by the credits granted by the renderer */
+	bool credits;
+	/*
+	 * Skip scanout updates for hosts with more than this many ms of
+	 * data queued, 0 to send everything
+	 */
+	unsigned int latency_ms;
 };
 
 struct rvgpu_scanout;
@@ -101,6 +118,14 @@ struct rvgpu_res_info {
 	uint32_t bpp;
 };
 
+/*
+ * Rectangle in pixels
+ */
+struct rvgpu_res_rect {
+	uint32_t x, y;
+	uint32_t w, h;
+};
+
 /*
  * RVGPU resource
  */
@@ -109,8 +134,32 @@ struct rvgpu_res {
 	struct iovec *backing;
 	unsigned int nbacking;
 	struct rvgpu_res_info info;
+	/*
+	 * Bumped by the proxy when the remote copy of the backing is changed
+	 * by something else than a transfer to host, e.g. attach or readback
+	 */
+	uint32_t generation;
+};
 
-	LIST_ENTRY(rvgpu_res) entry;
+/*
+ * Statistics of the send queue of a host
+ */
+struct rvgpu_send_stats {
+	uint64_t direct; /**< bytes written to the host without queueing */
+	uint64_t queued; /**< bytes queued while the host was busy */
+	uint64_t stalls; /**< times a sender waited for the queue */
+	uint64_t credit_waits; /**< times the queue ran out of credits */
+	size_t backlog; /**< bytes queued now */
+	size_t peak; /**< most bytes queued at once */
+};
+
+/*
+ * Flags of a transfer to host
+ */
+enum rvgpu_transfer_flags {
+	RVGPU_TRANSFER_LOSSLESS = 1 << 0, /**< resend the box in full quality */
+	RVGPU_TRANSFER_CATCHUP = 1 << 1, /**< only hosts behind need the box */
+	RVGPU_TRANSFER_SCANOUT = 1 << 2, /**< resource is shown on a scanout */
 };
 
 /*
@@ -123,6 +172,18 @@ struct rvgpu_res_transfer {
 	uint32_t stride;
 	uint32_t layer_stride;
 	uint64_t offset;
+	uint32_t flags; /**< see enum rvgpu_transfer_flags */
+	/*
+	 * Mask of hosts left out of the transfer. Boxes they miss are
+	 * resent once they catch up, like for late hosts.
+	 */
+	uint32_t skip_hosts;
+	/*
+	 * Box of the resource each host shows, indexed by host, NULL if
+	 * all hosts show all of it. Hosts only get the parts of the
+	 * transfer inside their box.
+	 */
+	const struct rvgpu_res_rect *clip;
 };
 
 struct rvgpu_rendering_ctx_ops {
@@ -145,12 +206,38 @@ struct rvgpu_rendering_ctx_ops {
 						uint32_t resource_id);
 	int (*rvgpu_ctx_transfer_to_host)(struct rvgpu_ctx *ctx,
 					  const struct rvgpu_res_transfer *t,
-					  const struct rvgpu_res *res);
+					  struct rvgpu_res *res);
 	int (*rvgpu_ctx_res_create)(struct rvgpu_ctx *ctx,
 				    const struct rvgpu_res_info *res,
 				    uint32_t resource_id);
 	void (*rvgpu_ctx_res_destroy)(struct rvgpu_ctx *ctx,
 				      uint32_t resource_id);
+	uint32_t (*rvgpu_ctx_features)(struct rvgpu_ctx *ctx, uint32_t *gen);
+	uint32_t (*rvgpu_ctx_late_hosts)(struct rvgpu_ctx *ctx);
+	int (*rvgpu_ctx_send_stats)(struct rvgpu_ctx *ctx, unsigned int host,
+				    struct rvgpu_send_stats *stats);
+	void (*rvgpu_ctx_credit)(struct rvgpu_ctx *ctx, unsigned int host,
+				 uint64_t limit);
+	void (*rvgpu_ctx_chunk_miss)(struct rvgpu_ctx *ctx,
+				     uint32_t resource_id);
+	int (*rvgpu_ctx_sendv)(struct rvgpu_ctx *ctx, const struct iovec *iov,
+			       int iovcnt);
+	int (*rvgpu_ctx_sendv_hosts)(struct rvgpu_ctx *ctx,
+				     const struct iovec *iov, int iovcnt,
+				     uint32_t hosts);
+	struct rvgpu_res *(*rvgpu_ctx_res_get)(struct rvgpu_ctx *ctx,
+					       uint32_t resource_id);
+	void (*rvgpu_ctx_res_put)(struct rvgpu_ctx *ctx,
+				  struct rvgpu_res *res);
+	void (*rvgpu_ctx_res_lossy)(struct rvgpu_ctx *ctx,
+				    const struct rvgpu_res *res,
+				    struct rvgpu_res_rect *box);
+	uint32_t (*rvgpu_ctx_res_behind)(struct rvgpu_ctx *ctx,
+					 const struct rvgpu_res *res,
+					 struct rvgpu_res_rect *box);
+	void (*rvgpu_ctx_res_set_behind)(struct rvgpu_ctx *ctx,
+					 struct rvgpu_res *res,
+					 uint32_t hosts);
 };
 
 struct rvgpu_rendering_backend_ops {
@@ -36,8 +36,22 @@
 enum rvgpu_flags {
 	RVGPU_IDX = 1 << 0, /**< header.idx field is valid */
 	RVGPU_CURSOR = 1 << 4, /**< cursor command */
+	RVGPU_CMD_STORE = 1 << 5, /**< keep command buffer in slot idx */
+	RVGPU_CMD_REPLAY = 1 << 6, /**< command buffer is the one in slot idx */
 };
 
+/*
+ * Command buffers of SUBMIT_3D commands are cached by rvgpu-renderer in
+ * RVGPU_CMD_CACHE_SLOTS slots chosen by rvgpu-proxy. A command with the
+ * RVGPU_CMD_STORE flag is executed as usual and its command buffer is kept
+ * in slot header.idx, replacing the previous one. A command with the
+ * RVGPU_CMD_REPLAY flag ends after struct virtio_gpu_cmd_submit, its
+ * command buffer is the one in slot header.idx. Only command buffers of
+ * up to RVGPU_CMD_CACHE_MAX_SIZE bytes are stored.
+ */
+#define RVGPU_CMD_CACHE_SLOTS 512u
+#define RVGPU_CMD_CACHE_MAX_SIZE (64u << 10)
+
 /**
  * @brief Header of every command
  */
@@ -54,6 +68,11 @@ struct rvgpu_header {
  */
 enum rvgpu_patch_type {
 	RVGPU_PATCH_RES = 1 << 0, /**< patch contains resource */
+	RVGPU_PATCH_RECT = 1 << 1, /**< patch contains packed rectangle */
+	RVGPU_PATCH_LZ = 1 << 2, /**< payload is compressed, with another type */
+	RVGPU_PATCH_LOSSY = 1 << 3, /**< patch contains lossy packed pixels */
+	RVGPU_PATCH_STORE = 1 << 4, /**< payload is kept in the chunk cache */
+	RVGPU_PATCH_REF = 1 << 5, /**< payload is taken from the chunk cache */
 };
 
 /**
@@ -65,6 +84,97 @@ struct rvgpu_patch {
 	uint32_t len; /**< length of the patch */
 };
 
+/**
+ * @brief Layout of RVGPU_PATCH_RECT patches
+ *
+ * Follows the patch header and is followed by height rows of width bytes
+ * each. The rows are unpacked to patch offset + row * stride, the patch
+ * length covers this structure and the rows.
+ */
+struct rvgpu_patch_rect {
+	uint32_t width; /**< bytes per row */
+	uint32_t height; /**< number of rows */
+	uint32_t stride; /**< distance between rows in the resource */
+};
+
+/**
+ * @brief Layout of RVGPU_PATCH_LZ patches
+ *
+ * Follows the patch header and is followed by the payload compressed in
+ * LZ4 block format. The payload decompresses to what would follow the
+ * header if the patch was not compressed, the patch length covers this
+ * structure and the compressed payload.
+ */
+struct rvgpu_patch_lz {
+	uint32_t size; /**< size of the decompressed payload */
+};
+
+/**
+ * @brief Layout of RVGPU_PATCH_LOSSY patches
+ *
+ * Follows the patch header and is followed by height rows of width 32 bit
+ * pixels packed at the given level: 1 for 5/6/5 bits per colour channel,
+ * 2 for 3/3/2 bits. Only formats with a padding byte are packed, it is
+ * not sent and unpacks as 0xff. Rows are unpacked to patch offset + row *
+ * stride, the patch length covers this structure and the packed rows.
+ */
+struct rvgpu_patch_lossy {
+	uint32_t width; /**< pixels per row */
+	uint32_t height; /**< number of rows */
+	uint32_t stride; /**< distance between rows in the resource */
+	uint8_t level; /**< packing level */
+	uint8_t alpha; /**< byte of the pixel holding padding, 0 or 3 */
+};
+
+/* Payload bytes held by the chunk cache of each side */
+#define RVGPU_CHUNK_CACHE_SIZE (64u << 20)
+/* Smallest payload kept in the chunk cache, sizes the chunk hash tables */
+#define RVGPU_CHUNK_MIN_SIZE 4096u
+
+/**
+ * @brief Chunk of RVGPU_PATCH_STORE and RVGPU_PATCH_REF patches
+ *
+ * Follows the patch header. A store patch continues as if it had no STORE
+ * flag and its payload, after decompression, is kept in the chunk cache.
+ * A ref patch ends here, its payload is the cached chunk. Both sides cache
+ * up to RVGPU_CHUNK_CACHE_SIZE bytes and evict the least recently used
+ * chunks, stores and refs count as uses. The caches start empty on every
+ * connection. rvgpu-renderer answers a ref it doesn't hold with
+ * RVGPU_CHUNK_MISS, both sides drop their chunks then and rvgpu-proxy
+ * sends the resource again in full.
+ */
+struct rvgpu_patch_chunk {
+	uint64_t hash; /**< XXH64 of the payload */
+	uint32_t size; /**< size of the payload */
+};
+
+/**
+ * @brief Optional protocol features
+ *
+ * rvgpu-proxy asks for the features it wants to use with a struct
+ * rvgpu_features_req placed after the terminating NUL of the surface id,
+ * where renderers without features ignore it. rvgpu-renderer answers a
+ * request with the subset it supports as uint32_t. Without a request no
+ * answer is sent and no feature is used.
+ */
+enum rvgpu_features {
+	RVGPU_FEATURE_LZ = 1 << 0, /**< RVGPU_PATCH_LZ patches */
+	RVGPU_FEATURE_LOSSY = 1 << 1, /**< RVGPU_PATCH_LOSSY patches */
+	RVGPU_FEATURE_CHUNKS = 1 << 2, /**< chunk cache patches */
+	RVGPU_FEATURE_CMD_CACHE = 1 << 3, /**< command buffer cache */
+	RVGPU_FEATURE_CREDITS = 1 << 4, /**< RVGPU_CREDIT flow control */
+};
+
+#define RVGPU_FEATURES_MAGIC 0x54414546u /* "FEAT" */
+
+/**
+ * @brief Features request, follows the surface id
+ */
+struct rvgpu_features_req {
+	uint32_t magic; /**< RVGPU_FEATURES_MAGIC */
+	uint32_t features; /**< mask of enum rvgpu_features wanted */
+};
+
 /*
  * rvgpu-proxy -> rvgpu-renderer protocol (input events transfer)
  */
@@ -107,6 +217,8 @@ enum rvgpu_res_message_type {
 	RVGPU_RES_NOT = 1 << 2, /**< notification that resource is not needed */
 	RVGPU_FENCE = 1 << 3, /**< fence completion notification */
 	RVGPU_RES_TRANSFER = 1 << 4, /**< response of TRANSFER_FROM_HOST3D */
+	RVGPU_CREDIT = 1 << 5, /**< command stream credit */
+	RVGPU_CHUNK_MISS = 1 << 6, /**< chunk reference missed the cache */
 };
 
 /**
@@ -117,4 +229,26 @@ struct rvgpu_res_message_header {
 	uint32_t fence_id; /**< fence identificator */
 };
 
+/*
+ * With RVGPU_FEATURE_CREDITS rvgpu-proxy only sends the command stream up
+ * to the limit granted by rvgpu-renderer, counted in bytes from the first
+ * one after the features reply. The first RVGPU_CREDIT_WINDOW bytes are
+ * granted up front, higher limits follow in RVGPU_CREDIT messages.
+ */
+#define RVGPU_CREDIT_WINDOW (4u << 20)
+
+/**
+ * @brief Payload of RVGPU_CREDIT messages, follows the header
+ */
+struct rvgpu_credit {
+	uint64_t limit; /**< stream bytes rvgpu-proxy may have sent */
+};
+
+/**
+ * @brief Payload of RVGPU_CHUNK_MISS messages, follows the header
+ */
+struct rvgpu_chunk_miss {
+	uint32_t resid; /**< resource left with stale contents */
+};
+
 #endif /* RVGPU_PROTOCOL_H */
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RVGPU_SEND_QUEUE_H
+#define RVGPU_SEND_QUEUE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <librvgpu/rvgpu-plugin.h>
+
+/* Bytes a host may have queued before senders have to wait for it */
+#define SEND_QUEUE_SIZE (8 * 1024 * 1024)
+
+/* Longest a sender waits for a host that writes nothing out */
+#define SEND_QUEUE_STALL_MS 5000
+
+/**
+ * @brief Bounded queue of the bytes to write to the pipe of one host
+ *
+ * Data is written to the pipe right away while nothing is queued and the
+ * pipe has room. The rest is copied to a ring buffer which a thread of
+ * the queue writes out, so a host that can't keep up doesn't hold back
+ * the others.
+ */
+struct send_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t data; /**< bytes queued or stop requested */
+	pthread_cond_t space; /**< bytes written out */
+	uint8_t *buf; /**< ring buffer */
+	size_t cap; /**< size of the ring buffer */
+	size_t head; /**< offset of the first queued byte */
+	size_t len; /**< number of queued bytes */
+	int fd; /**< pipe to the host, non-blocking */
+	int error; /**< errno of the last failed write, 0 if none */
+	uint64_t written; /**< bytes written to the pipe */
+	uint64_t limit; /**< bytes that may be written, UINT64_MAX if any */
+	uint64_t epoch; /**< bumped when written starts over */
+	uint64_t drops; /**< bumped when the queued bytes are dropped */
+	bool drop; /**< bytes are dropped until the next restart */
+	bool stop;
+	pthread_t tid;
+	struct rvgpu_send_stats stats;
+};
+
+/**
+ * @brief Start a queue writing to a pipe
+ * @param q - queue to init
+ * @param fd - write end of the pipe, made non-blocking
+ * @param cap - size of the ring buffer
+ * @retval 0 on success, -1 on error
+ */
+int send_queue_init(struct send_queue *q, int fd, size_t cap);
+
+/**
+ * @brief Stop the queue thread and drop the bytes still queued
+ * @param q - queue
+ */
+void send_queue_destroy(struct send_queue *q);
+
+/**
+ * @brief Queue a part of a vector of buffers
+ * @param q - queue
+ * @param iov - buffers to send
+ * @param iovcnt - number of buffers
+ * @param done - bytes of the buffers already queued by previous calls
+ * @param wait - wait for room until all bytes are queued
+ * @return bytes of the buffers queued including done, -1 on error
+ *
+ * A queue which writes nothing out for SEND_QUEUE_STALL_MS while a
+ * sender waits is dropped, errno is ETIMEDOUT then. A dropped queue takes
+ * all bytes without sending them.
+ */
+ssize_t send_queue_put(struct send_queue *q, const struct iovec *iov,
+		       int iovcnt, size_t done, bool wait);
+
+/**
+ * @brief Start counting written bytes over for a new connection
+ * @param q - queue
+ * @param limit - bytes that may be written on the new connection,
+ *		  UINT64_MAX to write without limit
+ *
+ * A dropped queue sends again.
+ */
+void send_queue_restart(struct send_queue *q, uint64_t limit);
+
+/**
+ * @brief Drop the queued bytes and all bytes put until the next restart
+ * @param q - queue
+ *
+ * Senders waiting for room return right away.
+ */
+void send_queue_drop(struct send_queue *q);
+
+/**
+ * @brief Check if the queue drops its bytes
+ * @param q - queue
+ * @return true if dropped since the last restart
+ */
+bool send_queue_dropped(struct send_queue *q);
+
+/**
+ * @brief Raise the number of bytes that may be written to the pipe
+ * @param q - queue
+ * @param limit - new limit, ignored if not above the current one
+ */
+void send_queue_credit(struct send_queue *q, uint64_t limit);
+
+/**
+ * @brief Get the number of queued bytes
+ * @param q - queue
+ * @return bytes not written to the pipe yet
+ */
+size_t send_queue_len(struct send_queue *q);
+
+/**
+ * @brief Get the statistics of the queue
+ * @param q - queue
+ * @param stats - filled with the statistics
+ */
+void send_queue_stats(struct send_queue *q, struct rvgpu_send_stats *stats);
+
+#endif /* RVGPU_SEND_QUEUE_H */
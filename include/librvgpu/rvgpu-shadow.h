@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RVGPU_SHADOW_H
+#define RVGPU_SHADOW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Transfers are compared in tiles of SHADOW_TILE x SHADOW_TILE pixels */
+#define SHADOW_TILE 64u
+/* Widest box handled by the tile compare, in tiles */
+#define SHADOW_MAX_COLS 256u
+
+/**
+ * @brief Copy of the resource backing as last sent to the remote targets
+ *
+ * The remote side keeps its own copy of the backing which is only
+ * changed by patches. The shadow mirrors it byte by byte, so that a part
+ * of the backing equal to the shadow does not need to be sent again.
+ */
+struct res_shadow {
+	uint8_t *data; /**< copy of the backing */
+	size_t size; /**< size of the backing */
+	uint32_t generation; /**< rvgpu_res generation of the copy */
+	uint32_t reset_gen; /**< connection generation of the copy */
+	bool valid; /**< copy matches the remote side */
+};
+
+/**
+ * @brief Allocate an invalid shadow
+ * @return pointer to the shadow or NULL on error
+ */
+struct res_shadow *res_shadow_alloc(void);
+
+/**
+ * @brief Free the shadow and its copy
+ * @param s - shadow, may be NULL
+ */
+void res_shadow_free(struct res_shadow *s);
+
+/**
+ * @brief Resize the copy, contents become invalid
+ * @param s - shadow
+ * @param size - size of the backing
+ * @retval 0 on success, -1 on error
+ */
+int res_shadow_resize(struct res_shadow *s, size_t size);
+
+/**
+ * @brief Update the shadow with the source bytes
+ * @param dst - shadow bytes
+ * @param src - backing bytes
+ * @param len - number of bytes
+ * @retval true if the bytes differed and were copied
+ */
+bool shadow_sync(void *dst, const void *src, size_t len);
+
+#endif /* RVGPU_SHADOW_H */
@@ -18,11 +18,16 @@
 #ifndef RVGPU_H
 #define RVGPU_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/queue.h>
 
 #include <librvgpu/rvgpu-plugin.h>
+#include <librvgpu/rvgpu-send-queue.h>
+#include <rvgpu-utils/rvgpu-chunk.h>
 
 #define MAX_HOSTS 16
 
@@ -51,6 +56,18 @@ enum host_state {
 	HOST_RECONNECTED,
 };
 
+/*
+ * Drain rate of a command link, estimated from the bytes written to it
+ * and the bytes still queued in its pipe and socket.
+ */
+struct link_rate {
+	uint64_t sent; /**< bytes written to the pipe */
+	uint64_t sent_mark; /**< sent at the last sample */
+	size_t backlog; /**< bytes queued at the last sample */
+	struct timespec ts; /**< time of the last sample */
+	uint64_t bps; /**< bytes per second, 0 while unknown */
+};
+
 struct vgpu_host {
 	struct tcp_host *tcp;
 	struct pollfd *pfd;
@@ -58,6 +75,56 @@ struct vgpu_host {
 	int vpgu_p[2];
 	int sock;
 	enum host_state state;
+	struct link_rate rate;
+	struct send_queue *queue; /**< queue of a command link, else NULL */
+};
+
+/*
+ * Resource registry: open addressing hash table with linear probing,
+ * keyed by resource id. Lookups may come from the resource thread of the
+ * frontend, so the table is guarded by a rwlock.
+ */
+struct res_table {
+	struct rvgpu_res **slots;
+	uint32_t nslots; /**< always power of two */
+	uint32_t count;
+	pthread_rwlock_t lock;
+};
+
+struct res_shadow;
+
+/*
+ * Resource as kept by the library, the public part comes first. The
+ * table holds one reference, rvgpu_ctx_res_get() callers hold the others,
+ * so a resource destroyed while another thread uses it is freed later.
+ */
+struct res_entry {
+	struct rvgpu_res res;
+	_Atomic unsigned int refs;
+	struct res_shadow *shadow; /**< copy kept with -d, NULL if none */
+	_Atomic bool resend; /**< a renderer missed chunks of it */
+	/* Bounding box of the parts last sent lossy, empty if w is 0 */
+	struct rvgpu_res_rect lossy;
+	/* Bounding box of the parts skipped for late hosts, empty if w is 0 */
+	struct rvgpu_res_rect behind;
+	uint32_t behind_hosts; /**< mask of hosts missing the behind box */
+};
+
+static inline struct res_entry *res_entry_of(const struct rvgpu_res *res)
+{
+	return (struct res_entry *)res;
+}
+
+/*
+ * Compression of resource patches. After a patch that doesn't compress,
+ * compression is not tried for a growing number of patches.
+ */
+struct patch_lz {
+	uint8_t *in; /**< gathered payload */
+	uint8_t *out; /**< compressed payload */
+	size_t cap; /**< size of both buffers */
+	unsigned int skip; /**< patches left to send without trying */
+	unsigned int backoff; /**< patches to skip after next failure */
 };
 
 struct ctx_priv {
@@ -75,13 +142,34 @@ struct ctx_priv {
 	struct rvgpu_ctx_arguments args;
 	void (*gpu_reset_cb)(struct rvgpu_ctx *ctx,
 			     enum reset_state state); /**< reset callback */
-	LIST_HEAD(res_head, rvgpu_res) reslist;
+	struct res_table resources;
+	/* Bumped on reconnection, remote targets lose their resources */
+	_Atomic uint32_t reset_gen;
+	/* Mask of command hosts that accepted compressed patches */
+	_Atomic uint32_t lz_hosts;
+	struct patch_lz lz;
+	/* Mask of command hosts that accepted lossy patches */
+	_Atomic uint32_t lossy_hosts;
+	uint8_t *lossy_buf; /**< packed pixels of a lossy patch */
+	size_t lossy_cap;
+	/* Mask of command hosts that accepted the chunk cache */
+	_Atomic uint32_t chunk_hosts;
+	struct chunk_cache chunks; /**< mirror of the renderer caches */
+	uint32_t chunks_gen; /**< reset_gen the mirror belongs to */
+	_Atomic bool chunks_lost; /**< a renderer cache got out of sync */
+	/* Mask of command hosts that accepted the command buffer cache */
+	_Atomic uint32_t cmd_cache_hosts;
+	/* Mask of command hosts left out of the transfer being sent */
+	uint32_t xfer_skip;
+	_Atomic int ses_timer; /**< fires the hung session check, -1 if none */
 };
 
 struct sc_priv {
 	struct conn_pipes pipes[SOCKET_NUM];
 	struct rvgpu_scanout_arguments *args;
 	bool activated;
+	struct send_queue queue; /**< command stream to the host */
+	struct ctx_priv *ctx; /**< context of the scanout */
 };
 
 /** @brief Init a remote virtio gpu context
@@ -124,6 +212,14 @@ void rvgpu_ctx_wait(struct ctx_priv *ctx, enum reset_state state);
  */
 void rvgpu_ctx_wakeup(struct ctx_priv *ctx);
 
+/** @brief Have the hosts whose send queue was dropped reconnected
+ *
+ *  @param ctx pointer to the rvgpu context
+ *
+ *  @return void
+ */
+void rvgpu_ctx_stalled(struct ctx_priv *ctx);
+
 /** @brief Poll for ctx events
  *
  *  @param ctx pointer to the rvgpu context
@@ -148,6 +244,134 @@ int rvgpu_ctx_poll(struct rvgpu_ctx *ctx, enum pipe_type p, int timeo,
  */
 int rvgpu_ctx_send(struct rvgpu_ctx *ctx, const void *buf, size_t len);
 
+/** @brief Transfer a vector of buffers of the virtio stream to remote targets
+ *
+ *  Buffers are written with one writev() per host where possible.
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param iov buffers to send
+ *  @param iovcnt number of buffers
+ *
+ *  @return 0 on success
+ *  @return errno on error
+ */
+int rvgpu_ctx_sendv(struct rvgpu_ctx *ctx, const struct iovec *iov,
+		    int iovcnt);
+
+/** @brief Transfer a vector of buffers to some of the remote targets
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param iov buffers to send
+ *  @param iovcnt number of buffers
+ *  @param hosts mask of targets, bit n is the n-th target
+ *
+ *  @return 0 on success
+ *  @return errno on error
+ */
+int rvgpu_ctx_sendv_hosts(struct rvgpu_ctx *ctx, const struct iovec *iov,
+			  int iovcnt, uint32_t hosts);
+
+/** @brief Get the statistics of the send queue of a target
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param host index of the target
+ *  @param stats filled with the statistics
+ *
+ *  @return 0 on success
+ *  @return -1 if there is no such target
+ */
+int rvgpu_ctx_send_stats(struct rvgpu_ctx *ctx, unsigned int host,
+			 struct rvgpu_send_stats *stats);
+
+/** @brief Grant credits to the command stream of a target
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param host index of the target
+ *  @param limit stream bytes the target accepts in total
+ *
+ *  @return void
+ */
+void rvgpu_ctx_credit(struct rvgpu_ctx *ctx, unsigned int host,
+		      uint64_t limit);
+
+/** @brief Recover from a chunk reference a target didn't hold
+ *
+ *  The chunk cache mirror is dropped and the resource is sent in full
+ *  with its next transfer.
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param resource_id resource left with stale contents
+ *
+ *  @return void
+ */
+void rvgpu_ctx_chunk_miss(struct rvgpu_ctx *ctx, uint32_t resource_id);
+
+/** @brief Get the parts of a resource sent lossy
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param res resource
+ *  @param box bounding box of the parts last sent lossy, w is 0 if none
+ *
+ *  @return void
+ */
+void rvgpu_ctx_res_lossy(struct rvgpu_ctx *ctx, const struct rvgpu_res *res,
+			 struct rvgpu_res_rect *box);
+
+/** @brief Get the parts of a resource skipped for hosts that fell behind
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param res resource
+ *  @param box bounding box of the skipped parts, w is 0 if none
+ *
+ *  @return mask of hosts missing the box
+ */
+uint32_t rvgpu_ctx_res_behind(struct rvgpu_ctx *ctx,
+			      const struct rvgpu_res *res,
+			      struct rvgpu_res_rect *box);
+
+/** @brief Have hosts get all of a resource with the next catch up
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param res resource
+ *  @param hosts mask of hosts whose copy may be stale
+ *
+ *  @return void
+ */
+void rvgpu_ctx_res_set_behind(struct rvgpu_ctx *ctx, struct rvgpu_res *res,
+			      uint32_t hosts);
+
+/** @brief Sample the drain rate of the command links
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param bps drain rate of the slowest link, 0 if not known yet
+ *  @param backlog largest number of bytes queued for a link
+ *
+ *  @return void
+ */
+void rvgpu_ctx_link_rate(struct ctx_priv *ctx, uint64_t *bps,
+			 size_t *backlog);
+
+/** @brief Get the targets which fell behind
+ *
+ *  A target is late if the data queued for it takes longer than the
+ *  latency_ms argument of the context to drain.
+ *
+ *  @param ctx pointer to the rvgpu context
+ *
+ *  @return mask of late targets, 0 if latency_ms is 0
+ */
+uint32_t rvgpu_ctx_late_hosts(struct rvgpu_ctx *ctx);
+
+/** @brief Get the optional protocol features accepted by all targets
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param gen set to the connection generation, targets lose the state
+ *             of the features when it changes
+ *
+ *  @return mask of enum rvgpu_features
+ */
+uint32_t rvgpu_ctx_features(struct rvgpu_ctx *ctx, uint32_t *gen);
+
 /** @brief transfer a remote virtio gpu resource to target
  *
  *  @param ctx pointer to the rvgpu context
@@ -159,9 +383,12 @@ int rvgpu_ctx_send(struct rvgpu_ctx *ctx, const void *buf, size_t len);
  */
 int rvgpu_ctx_transfer_to_host(struct rvgpu_ctx *ctx,
 			       const struct rvgpu_res_transfer *t,
-			       const struct rvgpu_res *res);
+			       struct rvgpu_res *res);
 
 /** @brief Get a remote virtio gpu resource
+ *
+ *  The resource is not referenced, so only the thread that destroys
+ *  resources may use it. Other threads use rvgpu_ctx_res_get().
  *
  *  @param ctx pointer to the rvgpu context
  *  @param resource_id resource identificator
@@ -171,6 +398,26 @@ int rvgpu_ctx_transfer_to_host(struct rvgpu_ctx *ctx,
 struct rvgpu_res *rvgpu_ctx_res_find(struct rvgpu_ctx *ctx,
 				     uint32_t resource_id);
 
+/** @brief Get a reference to a remote virtio gpu resource
+ *
+ *  The resource stays valid until rvgpu_ctx_res_put(), even if it is
+ *  destroyed in the meantime.
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param resource_id resource identificator
+ *
+ *  @return pointer to resource or NULL if there is none
+ */
+struct rvgpu_res *rvgpu_ctx_res_get(struct rvgpu_ctx *ctx,
+				    uint32_t resource_id);
+
+/** @brief Drop a reference taken by rvgpu_ctx_res_get()
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param res resource
+ */
+void rvgpu_ctx_res_put(struct rvgpu_ctx *ctx, struct rvgpu_res *res);
+
 /** @brief Destroy a remote virtio gpu resource
  *
  *  @param ctx pointer to the rvgpu context
@@ -180,6 +427,28 @@ struct rvgpu_res *rvgpu_ctx_res_find(struct rvgpu_ctx *ctx,
  */
 void rvgpu_ctx_res_destroy(struct rvgpu_ctx *ctx, uint32_t resource_id);
 
+/** @brief Call a function for every remote virtio gpu resource
+ *
+ *  The callback must not create or destroy resources.
+ *
+ *  @param ctx pointer to the rvgpu context
+ *  @param cb function to call
+ *  @param opaque argument passed to the callback
+ *
+ *  @return void
+ */
+void rvgpu_ctx_res_foreach(struct rvgpu_ctx *ctx,
+			   void (*cb)(struct rvgpu_res *res, void *opaque),
+			   void *opaque);
+
+/** @brief Destroy all remote virtio gpu resources
+ *
+ *  @param ctx pointer to the rvgpu context
+ *
+ *  @return void
+ */
+void rvgpu_ctx_res_destroy_all(struct rvgpu_ctx *ctx);
+
 /** @brief Create a remote virtio gpu resource
  *
  *  @param ctx pointer to the rvgpu context
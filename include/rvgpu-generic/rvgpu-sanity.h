@@ -52,6 +52,31 @@
 #define VIRGL_MAX_TBUF_DWORDS 1024
 #define VIRGL_MAX_CMDBUF_DWORDS ((64 * 1024) + VIRGL_MAX_TBUF_DWORDS)
 
+/*
+ * Fixed-size part of the commands, without the variable-size payloads
+ * (backing entries, command buffers) that follow some of them. Enough to
+ * check and parse a command that is read in place.
+ */
+union virtio_gpu_cmd_head {
+	struct virtio_gpu_ctrl_hdr hdr;
+	struct virtio_gpu_resource_unref r_unref;
+	struct virtio_gpu_resource_create_2d r_c2d;
+	struct virtio_gpu_set_scanout s_set;
+	struct virtio_gpu_resource_flush r_flush;
+	struct virtio_gpu_transfer_to_host_2d t_2h2d;
+	struct virtio_gpu_resource_attach_backing r_att;
+	struct virtio_gpu_resource_detach_backing r_det;
+	struct virtio_gpu_transfer_host_3d t_h3d;
+	struct virtio_gpu_resource_create_3d r_c3d;
+	struct virtio_gpu_ctx_create c_create;
+	struct virtio_gpu_ctx_destroy c_destroy;
+	struct virtio_gpu_ctx_resource c_res;
+	struct virtio_gpu_cmd_submit c_submit;
+	struct virtio_gpu_get_capset capset;
+	struct virtio_gpu_get_capset_info capset_info;
+	struct virtio_gpu_update_cursor cursor;
+};
+
 union virtio_gpu_cmd {
 	struct virtio_gpu_ctrl_hdr hdr;
 	struct virtio_gpu_resource_unref r_unref;
@@ -119,6 +144,16 @@ signed long sanity_strtonum(const char *str, signed long min, signed long max,
 enum virtio_gpu_ctrl_type sanity_check_gpu_ctrl(const union virtio_gpu_cmd *cmd,
 						size_t size, bool strict);
 
+/**
+ * @brief Check sanity of gpu ctrl command read in place
+ * @param cmd - fixed-size part of the command to check
+ * @param size - size of the whole command
+ * @return VIRTIO_GPU_RESP_OK_NODATA if OK, valid err response otherwise
+ */
+enum virtio_gpu_ctrl_type
+sanity_check_gpu_ctrl_head(const union virtio_gpu_cmd_head *cmd, size_t size,
+			   bool strict);
+
 /**
  * @brief Check sanity of gpu cursor command
  * @param cmd - command to check
@@ -129,6 +164,16 @@ enum virtio_gpu_ctrl_type
 sanity_check_gpu_cursor(const union virtio_gpu_cmd *cmd, size_t size,
 			bool strict);
 
+/**
+ * @brief Check sanity of gpu cursor command read in place
+ * @param cmd - fixed-size part of the command to check
+ * @param size - size of the whole command
+ * @return VIRTIO_GPU_RESP_OK_NODATA if OK, valid err response otherwise
+ */
+enum virtio_gpu_ctrl_type
+sanity_check_gpu_cursor_head(const union virtio_gpu_cmd_head *cmd,
+			     size_t size, bool strict);
+
 /**
  * @brief Check if 3d box falls within width x height x depth
  * @param b - box to check
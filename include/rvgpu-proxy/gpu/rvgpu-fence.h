@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RVGPU_FENCE_H
+#define RVGPU_FENCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/virtio_gpu.h>
+
+#include <rvgpu-proxy/gpu/rvgpu-vqueue.h>
+
+/**
+ * @brief Request waiting for fence completion
+ */
+struct fence_entry {
+	struct virtio_gpu_ctrl_hdr hdr; /**< response to send */
+	struct vqueue_request *req; /**< request to respond to */
+};
+
+/**
+ * @brief Ring of fenced requests ordered by fence id
+ *
+ * Fence ids of a timeline grow monotonically, so new entries normally go
+ * to the tail and completion pops from the head. An out-of-order fence is
+ * moved back into place on insertion.
+ */
+struct fence_ring {
+	struct fence_entry *e; /**< entries */
+	size_t size; /**< capacity, always power of two */
+	size_t head; /**< free running index of the oldest entry */
+	size_t tail; /**< free running index past the newest entry */
+};
+
+/**
+ * @brief Initialize the ring
+ * @param r - ring to initialize
+ * @param size - initial capacity, rounded up to power of two
+ * @retval 0 on success, -1 on error
+ */
+int fence_ring_init(struct fence_ring *r, size_t size);
+
+/**
+ * @brief Free memory of the ring
+ * @param r - ring
+ */
+void fence_ring_free(struct fence_ring *r);
+
+/**
+ * @brief Add request waiting for the fence in hdr->fence_id
+ * @param r - ring
+ * @param hdr - response to send on completion
+ * @param req - request to respond to
+ * @retval 0 on success, -1 on error
+ */
+int fence_ring_push(struct fence_ring *r, const struct virtio_gpu_ctrl_hdr *hdr,
+		    struct vqueue_request *req);
+
+/**
+ * @brief Get the entry with the lowest fence id
+ * @param r - ring
+ * @return pointer to the entry or NULL if ring is empty
+ */
+static inline struct fence_entry *fence_ring_peek(struct fence_ring *r)
+{
+	if (r->head == r->tail)
+		return NULL;
+
+	return &r->e[r->head & (r->size - 1)];
+}
+
+/**
+ * @brief Remove the entry returned by fence_ring_peek
+ * @param r - ring
+ */
+static inline void fence_ring_pop(struct fence_ring *r)
+{
+	r->head++;
+}
+
+/**
+ * @brief Check if there are requests waiting for fences
+ * @param r - ring
+ * @retval true if ring is empty
+ */
+static inline bool fence_ring_empty(const struct fence_ring *r)
+{
+	return r->head == r->tail;
+}
+
+#endif /* RVGPU_FENCE_H */
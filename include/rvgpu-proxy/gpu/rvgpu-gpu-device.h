@@ -36,11 +36,30 @@
 
 struct gpu_device;
 
+/* Hosts a fence waits for before it is signalled to the guest */
+enum fence_policy {
+	FENCE_POLICY_ALL, /**< every host */
+	FENCE_POLICY_PRIMARY, /**< the first host */
+	FENCE_POLICY_QUORUM, /**< any fence_quorum hosts */
+};
+
 struct gpu_device_params {
 	bool split_resources;
 	unsigned int num_scanouts;
 	unsigned int mem_limit;
 	unsigned long framerate;
+	unsigned int queue_size; /**< virtqueue depth, power of two */
+	unsigned int poll_us; /**< busy poll budget after activity, 0 to disable */
+	unsigned int backing_policy; /**< MAP_GUEST_* flags */
+	bool fault_stats; /**< collect page faults taken during transfers */
+	/* Mask of scanouts shown by each host, 0 if it shows all of them */
+	uint32_t host_scanouts[MAX_HOSTS];
+	/* Part of the scanouts shown by each host, all if width is 0 */
+	struct virtio_gpu_rect host_regions[MAX_HOSTS];
+	unsigned int fence_policy; /**< enum fence_policy */
+	unsigned int fence_quorum; /**< hosts needed by FENCE_POLICY_QUORUM */
+	/* Fences a host may fall behind before it is not waited for, 0 never */
+	unsigned int fence_evict_lag;
 	struct virtio_gpu_display_one dpys[VIRTIO_GPU_MAX_SCANOUTS];
 };
 
@@ -97,6 +116,17 @@ void gpu_device_config(struct gpu_device *g);
  */
 void gpu_device_serve(struct gpu_device *g);
 
+/**
+ * @brief Spin on virtio-gpu queues for the configured busy poll budget
+ *
+ * Driver kicks are disabled while spinning and enabled again before
+ * giving up, so the caller can go back to sleep on the epoll descriptor.
+ *
+ * @param g - pointer to gpu device structure
+ * @retval true if there is work for gpu_device_serve
+ */
+bool gpu_device_poll(struct gpu_device *g);
+
 /**
  * @brief Frees resources allocated by gpu_device_init
  * @param g - pointer to gpu device structure
@@ -50,4 +50,40 @@ size_t copy_to_iov(struct iovec iov[], size_t n, void *buffer, size_t len);
  */
 size_t iov_size(const struct iovec iov[], size_t n);
 
+/**
+ * @brief Sequential reader over set of iovecs
+ */
+struct iov_cursor {
+	const struct iovec *iov; /**< set of iovecs */
+	size_t n; /**< number of iovecs */
+	size_t idx; /**< current iovec */
+	size_t off; /**< offset within current iovec */
+};
+
+/**
+ * @brief Initialize cursor at the beginning of iovecs set
+ * @param c - cursor to initialize
+ * @param iov - set of iovecs
+ * @param n - number of iovecs
+ */
+void iov_cursor_init(struct iov_cursor *c, const struct iovec iov[],
+		     size_t n);
+
+/**
+ * @brief Copy data at the cursor to buffer and advance the cursor
+ * @param c - cursor
+ * @param buffer - buffer to copy to
+ * @param len - number of bytes to copy
+ * @return number of bytes copied
+ */
+size_t iov_cursor_read(struct iov_cursor *c, void *buffer, size_t len);
+
+/**
+ * @brief Advance the cursor without copying
+ * @param c - cursor
+ * @param len - number of bytes to skip
+ * @return number of bytes skipped
+ */
+size_t iov_cursor_skip(struct iov_cursor *c, size_t len);
+
 #endif /* RVGPU_IOV_H */
@@ -21,6 +21,24 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/*
+ * Guest memory is mapped by the cache in windows of this size, aligned to
+ * the window size in guest physical address space.
+ */
+#define MAP_GUEST_WINDOW_SHIFT 21u
+#define MAP_GUEST_WINDOW_SIZE (1ull << MAP_GUEST_WINDOW_SHIFT)
+
+/*
+ * Backing mapping policy flags. By default guest pages are faulted in on
+ * first access, which for resource backing happens on the transfer path.
+ */
+#define MAP_GUEST_POPULATE (1u << 0) /**< populate windows on mapping */
+#define MAP_GUEST_PREFAULT (1u << 1) /**< touch backing pages on attach */
+#define MAP_GUEST_WILLNEED (1u << 2) /**< madvise(MADV_WILLNEED) backing */
+#define MAP_GUEST_HUGEPAGE (1u << 3) /**< madvise(MADV_HUGEPAGE) windows */
+
+struct map_guest_cache;
+
 /**
  * @brief Map memory referenced by guest physical address
  * @param fd - file descriptor to map on
@@ -38,4 +56,59 @@ void *map_guest(int fd, uint64_t gpa, int prot, size_t size);
  */
 void unmap_guest(void *addr, size_t size);
 
+/**
+ * @brief Create a cache of persistent guest memory mappings
+ * @param fd - file descriptor to map on
+ * @return pointer to the cache or NULL on error
+ */
+struct map_guest_cache *map_guest_cache_init(int fd);
+
+/**
+ * @brief Translate guest physical address through the mapping cache
+ *
+ * Guest memory is mapped once per window and protection and stays mapped
+ * until the cache is destroyed. Regions the window can't be mapped for
+ * get a mapping of their own, so every pointer returned must be handed
+ * back to map_guest_release once it is no longer used.
+ *
+ * @param c - mapping cache
+ * @param gpa - guest physical address
+ * @param size - size of the region to access
+ * @param prot - required protection (PROT_READ etc)
+ * @return pointer to mapped memory or NULL on error
+ */
+void *map_guest_cached(struct map_guest_cache *c, uint64_t gpa, size_t size,
+		       int prot);
+
+/**
+ * @brief Release a pointer returned by map_guest_cached
+ * @param c - mapping cache
+ * @param addr - address returned by map_guest_cached
+ */
+void map_guest_release(struct map_guest_cache *c, void *addr);
+
+/**
+ * @brief Set backing mapping policy of the cache
+ * @param c - mapping cache
+ * @param flags - MAP_GUEST_* policy flags
+ */
+void map_guest_cache_set_policy(struct map_guest_cache *c, unsigned int flags);
+
+/**
+ * @brief Apply backing mapping policy to a region returned by the cache
+ *
+ * Hints that the mapping does not support are silently ignored.
+ *
+ * @param c - mapping cache
+ * @param addr - address returned by map_guest_cached
+ * @param size - size of the region
+ */
+void map_guest_prepare(struct map_guest_cache *c, void *addr, size_t size);
+
+/**
+ * @brief Unmap all windows and destroy the mapping cache
+ * @param c - mapping cache
+ */
+void map_guest_cache_free(struct map_guest_cache *c);
+
 #endif /* RVGPU_MAP_GUEST_H */
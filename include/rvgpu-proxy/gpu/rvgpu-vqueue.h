@@ -21,34 +21,103 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/queue.h>
 #include <sys/uio.h>
 
 #include <linux/virtio_ring.h>
 
+#include <rvgpu-proxy/gpu/rvgpu-map-guest.h>
+
+struct vqueue_request;
+
 /**
  * @brief Virtqueue structure (device part)
  */
 struct vqueue {
 	struct vring vr; /**< actual vring in guest memory */
 	uint16_t last_avail_idx; /**< index of last read avail entry */
+	uint16_t used_idx; /**< index of next used entry, not yet published */
+	uint16_t used_published; /**< used index last seen by the guest */
+	bool event_idx; /**< VIRTIO_RING_F_EVENT_IDX is in use */
+
+	struct vqueue_request *pool; /**< preallocated requests */
+	SLIST_HEAD(, vqueue_request) free_reqs; /**< unused pool entries */
 };
 
 /**
  * @brief Virtqueue request (device part)
+ *
+ * Read and write iovecs share one array sized to the descriptor chain.
+ * Short chains use the inline array, longer ones use an external array
+ * rounded up to a power of two, which is kept when the request is recycled.
  */
 #define VQUEUE_REQUEST_IOVEC_LEN 1024
+#define VQUEUE_REQUEST_INLINE_IOVEC_LEN 8
+#define VQUEUE_REQUEST_MIN_EXT_IOVEC_LEN 32
 struct vqueue_request {
-	struct iovec r[VQUEUE_REQUEST_IOVEC_LEN]; /**< iovectors for reading */
-	struct iovec w[VQUEUE_REQUEST_IOVEC_LEN]; /**< iovectors for writing */
+	struct iovec *r; /**< iovectors for reading */
+	struct iovec *w; /**< iovectors for writing */
 	size_t nr; /**< number of read iovecs */
 	size_t nw; /**< number of write iovecs */
 	uint16_t idx; /**< index of first descriptior in the chain */
 	struct vqueue *q;
+	struct map_guest_cache *mc; /**< cache the iovecs are mapped through */
 
 	bool mapped;
 	unsigned int refcount;
+
+	bool pooled; /**< request belongs to the pool of its queue */
+	struct iovec *iov_ext; /**< external iovec storage */
+	size_t iov_ext_len; /**< number of entries in iov_ext */
+	struct iovec iov_inline[VQUEUE_REQUEST_INLINE_IOVEC_LEN];
+	SLIST_ENTRY(vqueue_request) free_entry;
 };
 
+/**
+ * @brief Preallocate requests for the queue, one per ring entry
+ * @param q - queue with initialized vring
+ * @retval 0 on success, -1 on error
+ */
+int vqueue_init_pool(struct vqueue *q);
+
+/**
+ * @brief Free the preallocated requests of the queue
+ * @param q - queue
+ */
+void vqueue_free_pool(struct vqueue *q);
+
+/**
+ * @brief Initialize the device state of the queue
+ * @param q - queue with mapped vring
+ * @param event_idx - use used_event/avail_event for notifications
+ */
+void vqueue_init_state(struct vqueue *q, bool event_idx);
+
+/**
+ * @brief Ask the driver not to kick while the queue is being drained
+ * @param q - queue
+ */
+void vqueue_disable_notify(struct vqueue *q);
+
+/**
+ * @brief Ask the driver to kick on new requests
+ *
+ * Requests that arrived before notifications were enabled again would not
+ * produce a kick, so the caller must drain the queue again if this
+ * returns true.
+ *
+ * @param q - queue
+ * @retval true if requests are available
+ */
+bool vqueue_enable_notify(struct vqueue *q);
+
+/**
+ * @brief Publish responses sent since the last call to the driver
+ * @param q - queue
+ * @retval true if the driver asked to be interrupted
+ */
+bool vqueue_flush_used(struct vqueue *q);
+
 /**
  * @brief Check if the queue has new requests
  * @retval yes it does
@@ -78,14 +147,19 @@ void vqueue_request_unref(struct vqueue_request *req);
 
 /**
  * @brief Get next request from the vqueue
- * @param vilo - descriptor needed for memory mapping
+ * @param mc - guest memory mapping cache
  * @param q - queue to get requests from
  * @retval a new request
  */
-struct vqueue_request *vqueue_get_request(int vilo, struct vqueue *q);
+struct vqueue_request *vqueue_get_request(struct map_guest_cache *mc,
+					  struct vqueue *q);
 
 /**
  * @brief Send response to certain request
+ *
+ * The used entry is written right away, but it only becomes visible to
+ * the driver on the next vqueue_flush_used.
+ *
  * @param req - request to send reply to
  * @param resp - response buffer
  * @param resp_len - size of response buffer
@@ -39,6 +39,20 @@
 #define FRAMERATE_MIN 1u
 #define FRAMERATE_MAX 120u
 
+#define QUEUE_SIZE_MIN 64u
+#define QUEUE_SIZE_DEFAULT 1024u
+#define QUEUE_SIZE_MAX 32768u
+
+#define POLL_US_MIN 0u
+#define POLL_US_MAX 100000u
+#define POLL_ROUNDS_MAX 64u
+
+#define LATENCY_MS_MIN 1u
+#define LATENCY_MS_MAX 1000u
+
+#define FENCE_LAG_MIN 0u
+#define FENCE_LAG_MAX 100000u
+
 #define RVGPU_DEFAULT_HOSTNAME "127.0.0.1"
 #define RVGPU_DEFAULT_PORT "55667"
 
@@ -59,6 +73,13 @@ struct host_conn {
 	unsigned int reconn_intv_ms;
 	bool active;
 	char *rvgpu_surface_id;
+	bool res_shadow;
+	bool patch_lz;
+	bool lossy;
+	bool chunks;
+	bool cmd_cache;
+	bool credits;
+	unsigned int latency_ms;
 };
 
 #endif /* RVGPU_PROXY_H */
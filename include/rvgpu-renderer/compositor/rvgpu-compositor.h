@@ -156,6 +156,7 @@ struct render_params {
 	struct rvgpu_layout_params layout_params;
 	struct rvgpu_domain_sock_params domain_params;
 	char *capset_file;
+	uint32_t features;
 };
 
 bool check_in_rvgpu_surface(json_t *rvgpu_json_obj, double x, double y);
@@ -46,6 +46,7 @@ struct rvgpu_pr_params {
 	FILE *capset; /**< file for capset dumping */
 	const struct rvgpu_scanout_params *sp; /**< scanout params */
 	size_t nsp; /**< number of scanouts */
+	uint32_t features; /**< protocol features accepted from the proxy */
 };
 
 /**
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RVGPU_CHUNK_H
+#define RVGPU_CHUNK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/*
+ * Cache of content addressed chunks. The sender of a stream and its
+ * receiver keep one each and apply the same inserts and lookups in the
+ * same order, so both hold the same chunks. The sender keeps the data as
+ * well, to tell a hash collision from a cached chunk.
+ */
+
+/**
+ * @brief Compute 64 bit hash of data (XXH64 with seed 0)
+ * @param data - data to hash
+ * @param len - size of data
+ * @return hash of data
+ */
+uint64_t chunk_hash(const void *data, size_t len);
+
+struct chunk {
+	LIST_ENTRY(chunk) hash_link;
+	TAILQ_ENTRY(chunk) lru_link;
+	uint64_t hash;
+	uint32_t size;
+	void *data; /**< contents */
+};
+
+LIST_HEAD(chunk_bucket, chunk);
+
+struct chunk_cache {
+	struct chunk_bucket *buckets;
+	uint32_t nbuckets; /**< always power of two */
+	TAILQ_HEAD(chunk_lru, chunk) lru; /**< most recently used first */
+	size_t cap; /**< limit of the summed chunk sizes */
+	size_t used;
+};
+
+/**
+ * @brief Init an empty cache
+ * @param c - cache
+ * @param cap - limit of the summed chunk sizes
+ * @param min_size - size of the smallest chunk, sizes the hash table
+ * @retval 0 on success, -1 on error
+ */
+int chunk_cache_init(struct chunk_cache *c, size_t cap, size_t min_size);
+
+/**
+ * @brief Drop all chunks and free the cache
+ * @param c - cache
+ */
+void chunk_cache_free(struct chunk_cache *c);
+
+/**
+ * @brief Drop all chunks
+ * @param c - cache
+ */
+void chunk_cache_clear(struct chunk_cache *c);
+
+/**
+ * @brief Look up a chunk and mark it as most recently used
+ * @param c - cache
+ * @param hash - hash of the contents
+ * @param size - size of the contents
+ * @return chunk or NULL if it is not in the cache
+ */
+struct chunk *chunk_cache_find(struct chunk_cache *c, uint64_t hash,
+			       uint32_t size);
+
+/**
+ * @brief Add a chunk as most recently used, evicting least recently used
+ *	  chunks to stay within the limit
+ * @param c - cache
+ * @param hash - hash of the contents
+ * @param size - size of the contents, not larger than the limit
+ * @param data - contents owned by the cache from now on, or NULL
+ * @retval 0 on success, -1 on error, data is freed then
+ */
+int chunk_cache_insert(struct chunk_cache *c, uint64_t hash, uint32_t size,
+		       void *data);
+
+#endif /* RVGPU_CHUNK_H */
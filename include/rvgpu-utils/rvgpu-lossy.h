@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RVGPU_LOSSY_H
+#define RVGPU_LOSSY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lossy packing of 32 bit pixels with three 8 bit colour channels and one
+ * padding byte. At level 1 the colour channels are quantized to 5, 6 and
+ * 5 bits (2 bytes per pixel), at level 2 to 3, 3 and 2 bits (1 byte per
+ * pixel), in memory order of the channels. The padding byte is not sent
+ * and unpacks as 0xff. Level 0 keeps the pixels as they are.
+ */
+
+/* Bytes of an unpacked pixel */
+#define LOSSY_PIXEL_SIZE 4u
+/* Highest packing level */
+#define LOSSY_LEVEL_MAX 2u
+
+/**
+ * @brief Get size of a packed row
+ * @param width - pixels in the row
+ * @param level - packing level
+ * @return size of the packed row in bytes
+ */
+static inline size_t lossy_row_size(uint32_t width, unsigned int level)
+{
+	return (size_t)width * (LOSSY_PIXEL_SIZE >> level);
+}
+
+/**
+ * @brief Pack a row of pixels
+ * @param dst - output, lossy_row_size() bytes
+ * @param src - pixels
+ * @param width - number of pixels
+ * @param level - packing level
+ * @param alpha - byte of the pixel holding padding, 0 or 3
+ */
+void lossy_pack_row(void *dst, const void *src, uint32_t width,
+		    unsigned int level, unsigned int alpha);
+
+/**
+ * @brief Unpack a row of pixels
+ * @param dst - pixels
+ * @param src - packed row
+ * @param width - number of pixels
+ * @param level - packing level
+ * @param alpha - byte of the pixel holding padding, 0 or 3
+ */
+void lossy_unpack_row(void *dst, const void *src, uint32_t width,
+		      unsigned int level, unsigned int alpha);
+
+#endif /* RVGPU_LOSSY_H */
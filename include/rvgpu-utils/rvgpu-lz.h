@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RVGPU_LZ_H
+#define RVGPU_LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Fast LZ77 codec producing the LZ4 block format: sequences of literals
+ * and matches with 16 bit offsets, the block ends with literals.
+ */
+
+/**
+ * @brief Compress a block
+ * @param src - data to compress
+ * @param len - size of data
+ * @param dst - output buffer
+ * @param cap - size of output buffer
+ * @return size of compressed data or 0 if it does not fit into cap
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * @brief Decompress a block
+ * @param src - compressed data
+ * @param len - size of compressed data
+ * @param dst - output buffer
+ * @param cap - size of output buffer
+ * @return size of decompressed data or -1 if the block is malformed or
+ *	   does not fit into cap
+ */
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* RVGPU_LZ_H */
@@ -24,12 +24,15 @@
 #define ARRAY_SIZE(a) (sizeof((a)) / sizeof((a)[0]))
 #endif
 
+#include <stdint.h>
 #include <sys/types.h>
 
 int recv_int(int fd, int *value);
 int send_int(int fd, int value);
 void send_str_with_size(int client_fd, const char *str);
+void send_buf_with_size(int client_fd, const void *buf, uint32_t size);
 char *recv_str_all(int client_fd);
+char *recv_buf_all(int client_fd, uint32_t *size);
 ssize_t write_all(int fd, const void *buf, size_t count);
 ssize_t read_all(int fd, void *buf, size_t count);
 
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,8 +30,13 @@
 #include <librvgpu/rvgpu-plugin.h>
 #include <librvgpu/rvgpu-protocol.h>
 #include <librvgpu/rvgpu.h>
+#include <librvgpu/rvgpu-shadow.h>
 #include <librvgpu/rvgpu-virgl-format.h>
 
+#include <rvgpu-utils/rvgpu-chunk.h>
+#include <rvgpu-utils/rvgpu-lossy.h>
+#include <rvgpu-utils/rvgpu-lz.h>
+
 static inline bool virgl_format_is_yuv(uint32_t format)
 {
 	switch (format) {
@@ -46,64 +52,342 @@ static inline bool virgl_format_is_yuv(uint32_t format)
 	}
 }
 
+/*
+ * Size of a pixel block of a format: compressed formats store blocks of
+ * several pixels, other formats are treated as 1x1 blocks.
+ */
+struct format_block {
+	uint32_t format;
+	uint8_t w; /**< block width in pixels */
+	uint8_t h; /**< block height in pixels */
+	uint8_t bytes; /**< bytes per block */
+};
+
+static const struct format_block compressed_formats[] = {
+	{ VIRGL_FORMAT_DXT1_RGB, 4, 4, 8 },
+	{ VIRGL_FORMAT_DXT1_RGBA, 4, 4, 8 },
+	{ VIRGL_FORMAT_DXT1_SRGB, 4, 4, 8 },
+	{ VIRGL_FORMAT_DXT1_SRGBA, 4, 4, 8 },
+	{ VIRGL_FORMAT_DXT3_RGBA, 4, 4, 16 },
+	{ VIRGL_FORMAT_DXT5_RGBA, 4, 4, 16 },
+	{ VIRGL_FORMAT_DXT3_SRGBA, 4, 4, 16 },
+	{ VIRGL_FORMAT_DXT5_SRGBA, 4, 4, 16 },
+	{ VIRGL_FORMAT_RGTC1_UNORM, 4, 4, 8 },
+	{ VIRGL_FORMAT_RGTC1_SNORM, 4, 4, 8 },
+	{ VIRGL_FORMAT_RGTC2_UNORM, 4, 4, 16 },
+	{ VIRGL_FORMAT_RGTC2_SNORM, 4, 4, 16 },
+	{ VIRGL_FORMAT_ETC1_RGB8, 4, 4, 8 },
+	{ VIRGL_FORMAT_ETC2_RGB8, 4, 4, 8 },
+	{ VIRGL_FORMAT_ETC2_SRGB8, 4, 4, 8 },
+	{ VIRGL_FORMAT_ETC2_RGB8A1, 4, 4, 8 },
+	{ VIRGL_FORMAT_ETC2_SRGB8A1, 4, 4, 8 },
+	{ VIRGL_FORMAT_ETC2_R11_UNORM, 4, 4, 8 },
+	{ VIRGL_FORMAT_ETC2_R11_SNORM, 4, 4, 8 },
+	{ VIRGL_FORMAT_ETC2_RGBA8, 4, 4, 16 },
+	{ VIRGL_FORMAT_ETC2_SRGBA8, 4, 4, 16 },
+	{ VIRGL_FORMAT_ETC2_RG11_UNORM, 4, 4, 16 },
+	{ VIRGL_FORMAT_ETC2_RG11_SNORM, 4, 4, 16 },
+	{ VIRGL_FORMAT_ASTC_4x4, 4, 4, 16 },
+	{ VIRGL_FORMAT_ASTC_4x4_SRGB, 4, 4, 16 },
+	{ VIRGL_FORMAT_ASTC_5x4, 5, 4, 16 },
+	{ VIRGL_FORMAT_ASTC_5x4_SRGB, 5, 4, 16 },
+	{ VIRGL_FORMAT_ASTC_5x5, 5, 5, 16 },
+	{ VIRGL_FORMAT_ASTC_5x5_SRGB, 5, 5, 16 },
+	{ VIRGL_FORMAT_ASTC_6x5, 6, 5, 16 },
+	{ VIRGL_FORMAT_ASTC_6x5_SRGB, 6, 5, 16 },
+	{ VIRGL_FORMAT_ASTC_6x6, 6, 6, 16 },
+	{ VIRGL_FORMAT_ASTC_6x6_SRGB, 6, 6, 16 },
+	{ VIRGL_FORMAT_ASTC_8x5, 8, 5, 16 },
+	{ VIRGL_FORMAT_ASTC_8x5_SRGB, 8, 5, 16 },
+	{ VIRGL_FORMAT_ASTC_8x6, 8, 6, 16 },
+	{ VIRGL_FORMAT_ASTC_8x6_SRGB, 8, 6, 16 },
+	{ VIRGL_FORMAT_ASTC_8x8, 8, 8, 16 },
+	{ VIRGL_FORMAT_ASTC_8x8_SRGB, 8, 8, 16 },
+	{ VIRGL_FORMAT_ASTC_10x5, 10, 5, 16 },
+	{ VIRGL_FORMAT_ASTC_10x5_SRGB, 10, 5, 16 },
+	{ VIRGL_FORMAT_ASTC_10x6, 10, 6, 16 },
+	{ VIRGL_FORMAT_ASTC_10x6_SRGB, 10, 6, 16 },
+	{ VIRGL_FORMAT_ASTC_10x8, 10, 8, 16 },
+	{ VIRGL_FORMAT_ASTC_10x8_SRGB, 10, 8, 16 },
+	{ VIRGL_FORMAT_ASTC_10x10, 10, 10, 16 },
+	{ VIRGL_FORMAT_ASTC_10x10_SRGB, 10, 10, 16 },
+	{ VIRGL_FORMAT_ASTC_12x10, 12, 10, 16 },
+	{ VIRGL_FORMAT_ASTC_12x10_SRGB, 12, 10, 16 },
+	{ VIRGL_FORMAT_ASTC_12x12, 12, 12, 16 },
+	{ VIRGL_FORMAT_ASTC_12x12_SRGB, 12, 12, 16 },
+};
+
+static const struct format_block *compressed_format_block(uint32_t format)
+{
+	for (size_t i = 0;
+	     i < sizeof(compressed_formats) / sizeof(compressed_formats[0]);
+	     i++) {
+		if (compressed_formats[i].format == format)
+			return &compressed_formats[i];
+	}
+	return NULL;
+}
+
 static inline bool virgl_format_is_compressed(uint32_t format)
 {
-	switch (format) {
-	case VIRGL_FORMAT_DXT1_RGB:
-	case VIRGL_FORMAT_DXT1_RGBA:
-	case VIRGL_FORMAT_DXT3_RGBA:
-	case VIRGL_FORMAT_DXT5_RGBA:
-	case VIRGL_FORMAT_DXT1_SRGB:
-	case VIRGL_FORMAT_DXT1_SRGBA:
-	case VIRGL_FORMAT_DXT3_SRGBA:
-	case VIRGL_FORMAT_DXT5_SRGBA:
-	case VIRGL_FORMAT_RGTC1_UNORM:
-	case VIRGL_FORMAT_RGTC1_SNORM:
-	case VIRGL_FORMAT_RGTC2_UNORM:
-	case VIRGL_FORMAT_RGTC2_SNORM:
-	case VIRGL_FORMAT_ETC1_RGB8:
-	case VIRGL_FORMAT_ETC2_RGB8:
-	case VIRGL_FORMAT_ETC2_SRGB8:
-	case VIRGL_FORMAT_ETC2_RGB8A1:
-	case VIRGL_FORMAT_ETC2_SRGB8A1:
-	case VIRGL_FORMAT_ETC2_RGBA8:
-	case VIRGL_FORMAT_ETC2_SRGBA8:
-	case VIRGL_FORMAT_ETC2_R11_UNORM:
-	case VIRGL_FORMAT_ETC2_R11_SNORM:
-	case VIRGL_FORMAT_ETC2_RG11_UNORM:
-	case VIRGL_FORMAT_ETC2_RG11_SNORM:
-	case VIRGL_FORMAT_ASTC_4x4:
-	case VIRGL_FORMAT_ASTC_5x4:
-	case VIRGL_FORMAT_ASTC_5x5:
-	case VIRGL_FORMAT_ASTC_6x5:
-	case VIRGL_FORMAT_ASTC_6x6:
-	case VIRGL_FORMAT_ASTC_8x5:
-	case VIRGL_FORMAT_ASTC_8x6:
-	case VIRGL_FORMAT_ASTC_8x8:
-	case VIRGL_FORMAT_ASTC_10x5:
-	case VIRGL_FORMAT_ASTC_10x6:
-	case VIRGL_FORMAT_ASTC_10x8:
-	case VIRGL_FORMAT_ASTC_10x10:
-	case VIRGL_FORMAT_ASTC_12x10:
-	case VIRGL_FORMAT_ASTC_12x12:
-	case VIRGL_FORMAT_ASTC_4x4_SRGB:
-	case VIRGL_FORMAT_ASTC_5x4_SRGB:
-	case VIRGL_FORMAT_ASTC_5x5_SRGB:
-	case VIRGL_FORMAT_ASTC_6x5_SRGB:
-	case VIRGL_FORMAT_ASTC_6x6_SRGB:
-	case VIRGL_FORMAT_ASTC_8x5_SRGB:
-	case VIRGL_FORMAT_ASTC_8x6_SRGB:
-	case VIRGL_FORMAT_ASTC_8x8_SRGB:
-	case VIRGL_FORMAT_ASTC_10x5_SRGB:
-	case VIRGL_FORMAT_ASTC_10x6_SRGB:
-	case VIRGL_FORMAT_ASTC_10x8_SRGB:
-	case VIRGL_FORMAT_ASTC_10x10_SRGB:
-	case VIRGL_FORMAT_ASTC_12x10_SRGB:
-	case VIRGL_FORMAT_ASTC_12x12_SRGB:
+	return compressed_format_block(format) != NULL;
+}
+
+/**
+ * @brief Get block size of the format
+ * @param format - virgl format
+ * @param b - block size to fill
+ * @retval false if the format size is unknown
+ */
+static bool format_block_info(uint32_t format, struct format_block *b)
+{
+	const struct format_block *cb = compressed_format_block(format);
+	int bpp;
+
+	if (cb) {
+		*b = *cb;
 		return true;
-	default:
+	}
+
+	bpp = get_format_bpp(format);
+	if (bpp <= 0)
 		return false;
+
+	b->format = format;
+	b->w = 1u;
+	b->h = 1u;
+	b->bytes = (uint8_t)bpp;
+	return true;
+}
+
+/* Smaller patches are not worth compressing */
+#define PATCH_LZ_MIN 4096u
+/* Larger patches are sent as is to bound the scratch buffers */
+#define PATCH_LZ_MAX (32u << 20)
+/* Limit of patches skipped after incompressible ones */
+#define PATCH_LZ_BACKOFF_MAX 64u
+/* Resource patches are cached in chunks aligned to this size */
+#define PATCH_CHUNK_SIZE (64u << 10)
+/* Larger patches of other types are not cached */
+#define PATCH_CHUNK_MAX (1u << 20)
+
+static bool all_hosts(const struct ctx_priv *ctx_priv, uint32_t mask)
+{
+	uint32_t hosts = (1u << ctx_priv->cmd_count) - 1u;
+
+	return hosts != 0u && (mask & hosts) == hosts;
+}
+
+/*
+ * Gather the payload of a patch, iov[0] being the header, to the scratch
+ * buffers. Returns NULL if they can't hold it.
+ */
+static const uint8_t *patch_gather(struct patch_lz *lz, const struct iovec *iov,
+				   int niov, size_t len)
+{
+	size_t pos = 0u;
+
+	if (len > lz->cap) {
+		uint8_t *in = realloc(lz->in, len);
+		uint8_t *out;
+
+		if (!in)
+			return NULL;
+		lz->in = in;
+		out = realloc(lz->out, len);
+		if (!out)
+			return NULL;
+		lz->out = out;
+		lz->cap = len;
+	}
+
+	for (int i = 1; i < niov; i++) {
+		memcpy(lz->in + pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	return lz->in;
+}
+
+/*
+ * Compress a gathered payload to lz->out. Returns the size of the
+ * compressed payload or 0 if the patch should be sent as is.
+ */
+static size_t patch_compress(struct patch_lz *lz, const uint8_t *data,
+			     size_t len)
+{
+	size_t clen;
+
+	if (len < PATCH_LZ_MIN || len > PATCH_LZ_MAX)
+		return 0;
+
+	if (lz->skip > 0u) {
+		lz->skip--;
+		return 0;
+	}
+
+	/* Compression has to save at least 1/8 to pay off */
+	clen = lz_compress(data, len, lz->out, len - len / 8u);
+	if (clen == 0u) {
+		lz->skip = lz->backoff;
+		lz->backoff = lz->backoff ? lz->backoff * 2u : 1u;
+		if (lz->backoff > PATCH_LZ_BACKOFF_MAX)
+			lz->backoff = PATCH_LZ_BACKOFF_MAX;
+		return 0;
 	}
+
+	lz->backoff = 0u;
+	return clen;
+}
+
+/*
+ * Send a gathered payload as a patch. A cached one goes out as a
+ * reference to the renderer caches, an uncached one is stored there if it
+ * fits. A cached chunk with the same hash but other bytes is replaced.
+ * Hosts which negotiated it get the payload compressed.
+ */
+static int send_payload(struct rvgpu_ctx *ctx, uint8_t type, size_t offset,
+			const uint8_t *data, size_t len, bool cache)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	uint32_t hosts = ~ctx_priv->xfer_skip;
+	uint32_t lz_hosts = atomic_load(&ctx_priv->lz_hosts) & hosts;
+	struct rvgpu_patch hdr = { .type = type };
+	struct rvgpu_patch_chunk chunk = { 0 };
+	struct rvgpu_patch_lz lzh;
+	struct iovec iov[4];
+	struct chunk *ch;
+	uint8_t *copy;
+	size_t clen = 0u, prefix = 0u;
+	int n = 1, ret;
+
+	assert(offset < UINT32_MAX);
+	hdr.offset = (uint32_t)offset;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+
+	if (cache && len >= RVGPU_CHUNK_MIN_SIZE) {
+		chunk.hash = chunk_hash(data, len);
+		chunk.size = (uint32_t)len;
+		iov[1].iov_base = &chunk;
+		iov[1].iov_len = sizeof(chunk);
+
+		ch = chunk_cache_find(&ctx_priv->chunks, chunk.hash,
+				      chunk.size);
+		if (ch && memcmp(ch->data, data, len) == 0) {
+			hdr.type |= RVGPU_PATCH_REF;
+			hdr.len = sizeof(chunk);
+			return rvgpu_ctx_sendv_hosts(ctx, iov, 2, hosts);
+		}
+		/* Renderers store what the mirror manages to store */
+		copy = malloc(len);
+		if (copy)
+			memcpy(copy, data, len);
+		if (copy && chunk_cache_insert(&ctx_priv->chunks, chunk.hash,
+					       chunk.size, copy) == 0) {
+			hdr.type |= RVGPU_PATCH_STORE;
+			prefix = sizeof(chunk);
+			n = 2;
+		}
+	}
+
+	if (lz_hosts)
+		clen = patch_compress(&ctx_priv->lz, data, len);
+	if (clen == 0u)
+		lz_hosts = 0u;
+
+	/* A failure on one kind of host must not keep the others waiting */
+	hdr.len = (uint32_t)(prefix + len);
+	iov[n].iov_base = (void *)data;
+	iov[n].iov_len = len;
+	ret = rvgpu_ctx_sendv_hosts(ctx, iov, n + 1, hosts & ~lz_hosts);
+
+	if (lz_hosts) {
+		hdr.type |= RVGPU_PATCH_LZ;
+		hdr.len = (uint32_t)(prefix + sizeof(lzh) + clen);
+		lzh.size = (uint32_t)len;
+		iov[n].iov_base = &lzh;
+		iov[n].iov_len = sizeof(lzh);
+		iov[n + 1].iov_base = ctx_priv->lz.out;
+		iov[n + 1].iov_len = clen;
+		if (rvgpu_ctx_sendv_hosts(ctx, iov, n + 2, lz_hosts))
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Send a patch, iov[0] being the header. With the chunk cache, resource
+ * patches are split into chunks aligned to the resource offset, so that
+ * the same contents uploaded again map to the same chunks.
+ */
+static int send_patch(struct rvgpu_ctx *ctx, const struct iovec *iov,
+		      int niov)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	uint32_t hosts = ~ctx_priv->xfer_skip;
+	/* Renderer caches only stay in sync if all of them get the patch */
+	bool chunks = all_hosts(ctx_priv,
+				atomic_load(&ctx_priv->chunk_hosts) & hosts);
+	uint32_t reset_gen = atomic_load(&ctx_priv->reset_gen);
+	struct rvgpu_patch hdr;
+	const uint8_t *data;
+	size_t len = 0u, pos = 0u;
+	int ret = 0;
+
+	/* Nobody to send to, e.g. every host fell behind */
+	if (all_hosts(ctx_priv, ctx_priv->xfer_skip))
+		return 0;
+
+	for (int i = 1; i < niov; i++)
+		len += iov[i].iov_len;
+
+	if ((!chunks && !(atomic_load(&ctx_priv->lz_hosts) & hosts)) ||
+	    len < PATCH_LZ_MIN || len > PATCH_LZ_MAX)
+		return rvgpu_ctx_sendv_hosts(ctx, iov, niov, hosts);
+
+	/* Don't gather payloads which are not going to be compressed */
+	if (!chunks && ctx_priv->lz.skip > 0u) {
+		ctx_priv->lz.skip--;
+		return rvgpu_ctx_sendv_hosts(ctx, iov, niov, hosts);
+	}
+
+	data = patch_gather(&ctx_priv->lz, iov, niov, len);
+	if (!data)
+		return rvgpu_ctx_sendv_hosts(ctx, iov, niov, hosts);
+
+	memcpy(&hdr, iov[0].iov_base, sizeof(hdr));
+	if (!chunks)
+		return send_payload(ctx, hdr.type, hdr.offset, data, len,
+				    false);
+
+	if (!ctx_priv->chunks.buckets &&
+	    chunk_cache_init(&ctx_priv->chunks, RVGPU_CHUNK_CACHE_SIZE,
+			     RVGPU_CHUNK_MIN_SIZE))
+		return send_payload(ctx, hdr.type, hdr.offset, data, len,
+				    false);
+	/* Renderers lose their caches on reconnection and on a miss */
+	if (ctx_priv->chunks_gen != reset_gen ||
+	    atomic_exchange(&ctx_priv->chunks_lost, false)) {
+		chunk_cache_clear(&ctx_priv->chunks);
+		ctx_priv->chunks_gen = reset_gen;
+	}
+
+	if (hdr.type != RVGPU_PATCH_RES)
+		return send_payload(ctx, hdr.type, hdr.offset, data, len,
+				    len <= PATCH_CHUNK_MAX);
+
+	while (pos < len && ret == 0) {
+		size_t n = PATCH_CHUNK_SIZE -
+			   (hdr.offset + pos) % PATCH_CHUNK_SIZE;
+
+		if (n > len - pos)
+			n = len - pos;
+		ret = send_payload(ctx, hdr.type, hdr.offset + pos, data + pos,
+				   n, true);
+		pos += n;
+	}
+	return ret;
 }
 
 struct patch_data {
@@ -119,12 +403,8 @@ static void write_patch(struct rvgpu_ctx *ctx, struct patch_data *d)
 	d->iov[0].iov_base = &d->hdr;
 	d->iov[0].iov_len = sizeof(d->hdr);
 
-	for (unsigned int i = 0; i < d->niov; i++) {
-		if (rvgpu_ctx_send(ctx, d->iov[i].iov_base,
-				   d->iov[i].iov_len)) {
-			warn("short write");
-		}
-	}
+	if (send_patch(ctx, d->iov, (int)d->niov))
+		warn("short write");
 }
 
 static void init_patch(struct patch_data *d)
@@ -182,172 +462,1135 @@ static void gpu_device_send_data(struct rvgpu_ctx *ctx,
 	write_patch(ctx, &d);
 }
 
+struct rect_patch_data {
+	struct rvgpu_patch hdr;
+	struct rvgpu_patch_rect rect;
+	unsigned int niov;
+	struct iovec iov[__IOV_MAX];
+};
+
+static void init_rect_patch(struct rect_patch_data *d, size_t offset)
+{
+	assert(offset < UINT32_MAX);
+	d->hdr.type = RVGPU_PATCH_RECT;
+	d->hdr.offset = (uint32_t)offset;
+	d->rect.height = 0u;
+	/* iov[0] and iov[1] are reserved for headers */
+	d->niov = 2u;
+}
+
+static void write_rect_patch(struct rvgpu_ctx *ctx, struct rect_patch_data *d)
+{
+	if (d->rect.height == 0u)
+		return;
+
+	d->hdr.len = (uint32_t)(sizeof(d->rect) +
+				(size_t)d->rect.width * d->rect.height);
+	d->iov[0].iov_base = &d->hdr;
+	d->iov[0].iov_len = sizeof(d->hdr);
+	d->iov[1].iov_base = &d->rect;
+	d->iov[1].iov_len = sizeof(d->rect);
+
+	if (send_patch(ctx, d->iov, (int)d->niov))
+		warn("short write");
+}
+
+/*
+ * Send only the bytes of each row of a rectangle, packed. Rows are gathered
+ * straight from the backing, a patch is split into several self-contained
+ * rectangles when it runs out of iovecs.
+ */
+static void gpu_device_send_rect(struct rvgpu_ctx *ctx,
+				 const struct iovec iovs[], size_t niov,
+				 size_t offset, uint32_t width,
+				 uint32_t height, uint32_t stride)
+{
+	struct rect_patch_data d;
+	size_t i = 0u, base = 0u;
+	uint32_t row = 0u;
+
+	d.rect.width = width;
+	d.rect.stride = stride;
+	init_rect_patch(&d, offset);
+
+	while (row < height) {
+		size_t pos = offset + (size_t)row * stride;
+		size_t left = width;
+		unsigned int row_niov = d.niov;
+		size_t row_i, row_base;
+
+		while (i < niov && pos >= base + iovs[i].iov_len) {
+			base += iovs[i].iov_len;
+			i++;
+		}
+		row_i = i;
+		row_base = base;
+
+		while (left > 0u && i < niov && d.niov < __IOV_MAX) {
+			size_t off = pos - base;
+			size_t chunk = iovs[i].iov_len - off;
+
+			if (chunk > left)
+				chunk = left;
+			d.iov[d.niov].iov_base = (char *)iovs[i].iov_base + off;
+			d.iov[d.niov].iov_len = chunk;
+			d.niov++;
+			pos += chunk;
+			left -= chunk;
+			if (off + chunk == iovs[i].iov_len) {
+				base += iovs[i].iov_len;
+				i++;
+			}
+		}
+
+		if (left == 0u) {
+			d.rect.height++;
+			row++;
+			continue;
+		}
+
+		/* Roll back the partial row */
+		d.niov = row_niov;
+		i = row_i;
+		base = row_base;
+		if (i == niov)
+			break; /* backing is too small */
+
+		write_rect_patch(ctx, &d);
+		if (d.rect.height == 0u) {
+			/* Row alone does not fit into a patch */
+			gpu_device_send_data(ctx, iovs, niov,
+					     offset + (size_t)row * stride,
+					     width);
+			row++;
+		}
+		init_rect_patch(&d, offset + (size_t)row * stride);
+	}
+	write_rect_patch(ctx, &d);
+}
+
+#define RES_TABLE_INITIAL_SLOTS 64u
+
+static inline uint32_t res_table_hash(uint32_t resource_id, uint32_t nslots)
+{
+	return (resource_id * 2654435761u) & (nslots - 1);
+}
+
+/*
+ * Find the slot holding resource_id, or the empty slot where it would be
+ * inserted. The table always has free slots, so probing terminates.
+ */
+static uint32_t res_table_slot(struct rvgpu_res **slots, uint32_t nslots,
+			       uint32_t resource_id)
+{
+	uint32_t i = res_table_hash(resource_id, nslots);
+
+	while (slots[i] != NULL && slots[i]->resid != resource_id)
+		i = (i + 1) & (nslots - 1);
+
+	return i;
+}
+
+static int res_table_grow(struct res_table *t)
+{
+	uint32_t nslots = t->nslots ? t->nslots * 2 : RES_TABLE_INITIAL_SLOTS;
+	struct rvgpu_res **slots;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots)
+		return -1;
+
+	for (uint32_t i = 0; i < t->nslots; i++) {
+		struct rvgpu_res *res = t->slots[i];
+
+		if (res)
+			slots[res_table_slot(slots, nslots, res->resid)] = res;
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->nslots = nslots;
+	return 0;
+}
+
+static int res_table_insert(struct res_table *t, struct rvgpu_res *res)
+{
+	uint32_t i;
+
+	/* Keep load factor below 3/4 */
+	if ((t->count + 1) * 4 > t->nslots * 3 && res_table_grow(t))
+		return -1;
+
+	i = res_table_slot(t->slots, t->nslots, res->resid);
+	if (t->slots[i] != NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+	t->slots[i] = res;
+	t->count++;
+	return 0;
+}
+
+static struct rvgpu_res *res_table_find(struct res_table *t,
+					uint32_t resource_id)
+{
+	if (t->count == 0)
+		return NULL;
+
+	return t->slots[res_table_slot(t->slots, t->nslots, resource_id)];
+}
+
+static struct rvgpu_res *res_table_remove(struct res_table *t,
+					  uint32_t resource_id)
+{
+	uint32_t mask = t->nslots - 1;
+	uint32_t i, j;
+	struct rvgpu_res *res;
+
+	if (t->count == 0)
+		return NULL;
+
+	i = res_table_slot(t->slots, t->nslots, resource_id);
+	res = t->slots[i];
+	if (!res)
+		return NULL;
+
+	/*
+	 * Backward shift deletion: move up entries of the probe sequence
+	 * that would become unreachable, so no tombstones are needed.
+	 */
+	t->slots[i] = NULL;
+	for (j = (i + 1) & mask; t->slots[j] != NULL; j = (j + 1) & mask) {
+		uint32_t k = res_table_hash(t->slots[j]->resid, t->nslots);
+
+		if (((j - k) & mask) >= ((j - i) & mask)) {
+			t->slots[i] = t->slots[j];
+			t->slots[j] = NULL;
+			i = j;
+		}
+	}
+	t->count--;
+	return res;
+}
+
+/* Look up a resource and take a reference while the table is locked */
 static struct rvgpu_res *gpu_device_get_res(struct ctx_priv *ctx_priv,
 					    uint32_t resource_id)
 {
+	struct res_table *t = &ctx_priv->resources;
 	struct rvgpu_res *res;
 
-	LIST_FOREACH(res, &ctx_priv->reslist, entry)
-	{
-		if (res->resid == resource_id)
-			return res;
-	}
-	return NULL;
+	pthread_rwlock_rdlock(&t->lock);
+	res = res_table_find(t, resource_id);
+	if (res)
+		atomic_fetch_add(&res_entry_of(res)->refs, 1u);
+	pthread_rwlock_unlock(&t->lock);
+
+	return res;
 }
 
+static void res_free(struct rvgpu_res *res)
+{
+	res_shadow_free(res_entry_of(res)->shadow);
+	free(res->backing);
+	free(res_entry_of(res));
+}
+
+static void gpu_device_put_res(struct rvgpu_res *res)
+{
+	if (atomic_fetch_sub(&res_entry_of(res)->refs, 1u) == 1u)
+		res_free(res);
+}
 
 static inline uint32_t align_up_power_of_2(uint32_t n, uint32_t a)
 {
 	return (n + (a - 1)) & ~(a - 1);
 }
 
-size_t yuv_data_size(uint32_t format, uint32_t width, uint32_t height,
-		     uint32_t stride)
+/**
+ * @brief Plane of a planar YUV frame
+ */
+struct yuv_plane {
+	size_t offset; /**< offset from the start of the frame */
+	uint32_t stride; /**< bytes per row */
+	uint32_t height; /**< number of rows */
+	uint32_t sub; /**< horizontal and vertical subsampling */
+	uint32_t cpp; /**< bytes per subsampled pixel */
+};
+
+struct yuv_layout {
+	unsigned int nplanes;
+	struct yuv_plane planes[3];
+};
+
+/**
+ * @brief Compute plane layout of a YUV frame
+ * @param format - virgl YUV format
+ * @param width - frame width
+ * @param height - frame height
+ * @param stride - stride of luma plane, 0 for default
+ * @param l - layout to fill
+ * @retval false if format is not supported
+ */
+static bool yuv_layout(uint32_t format, uint32_t width, uint32_t height,
+		       uint32_t stride, struct yuv_layout *l)
 {
 	uint32_t bpp = (format == VIRGL_FORMAT_P010) ? 2 : 1;
 	uint32_t y_align = (format == VIRGL_FORMAT_YV12) ? 32 : 16;
-	uint32_t y_stride = (stride != 0) ?
-				    stride :
-				    align_up_power_of_2(width, y_align) * bpp;
-	uint32_t y_size = y_stride * height;
-
-	uint32_t uv_width;
-	uint32_t uv_plane_count;
-	uint32_t uv_height = height / 2;
+	uint32_t uv_align = 16;
+	uint32_t uv_width, uv_stride;
 
 	switch (format) {
 	case VIRGL_FORMAT_NV12:
 	case VIRGL_FORMAT_P010:
+		/* Interleaved UV plane */
 		uv_width = width;
-		uv_plane_count = 1;
+		l->nplanes = 2;
 		break;
 	case VIRGL_FORMAT_YV12:
+		/* Separate V and U planes */
 		uv_width = width / 2;
-		uv_plane_count = 2;
+		l->nplanes = 3;
 		break;
 	default:
 		fprintf(stderr, "Unknown yuv virgl format: %s\n",
 			get_virgl_format_string(format));
+		return false;
+	}
+
+	l->planes[0].offset = 0;
+	l->planes[0].stride = (stride != 0) ?
+				      stride :
+				      align_up_power_of_2(width, y_align) * bpp;
+	l->planes[0].height = height;
+	l->planes[0].sub = 1;
+	l->planes[0].cpp = bpp;
+
+	uv_stride = align_up_power_of_2(uv_width, uv_align) * bpp;
+	for (unsigned int i = 1; i < l->nplanes; i++) {
+		struct yuv_plane *prev = &l->planes[i - 1];
+
+		l->planes[i].offset =
+			prev->offset + (size_t)prev->stride * prev->height;
+		l->planes[i].stride = uv_stride;
+		l->planes[i].height = height / 2;
+		l->planes[i].sub = 2;
+		l->planes[i].cpp = (l->nplanes == 2) ? 2 * bpp : bpp;
+	}
+	return true;
+}
+
+size_t yuv_data_size(uint32_t format, uint32_t width, uint32_t height,
+		     uint32_t stride)
+{
+	struct yuv_layout l;
+	const struct yuv_plane *last;
+
+	if (!yuv_layout(format, width, height, stride, &l))
 		return 0;
+
+	last = &l.planes[l.nplanes - 1];
+	return last->offset + (size_t)last->stride * last->height;
+}
+
+/**
+ * @brief Byte layout of a transfer box in the resource backing
+ *
+ * The box consists of slices (depth slices, array layers or cube faces)
+ * layer_stride bytes apart, each of rows rows of pixel blocks stride bytes
+ * apart, each row_bytes long.
+ */
+struct transfer_layout {
+	uint32_t row_bytes;
+	uint32_t rows;
+	uint32_t slices;
+	uint32_t stride;
+	uint32_t layer_stride;
+};
+
+/**
+ * @brief Compute layout of the box transferred by TRANSFER_TO_HOST
+ * @param res - resource
+ * @param t - transfer
+ * @param l - layout to fill
+ * @retval false if layout of the resource is not known
+ */
+static bool transfer_layout(const struct rvgpu_res *res,
+			    const struct rvgpu_res_transfer *t,
+			    struct transfer_layout *l)
+{
+	uint32_t width = res->info.width >> t->level;
+	uint32_t height = res->info.height >> t->level;
+	struct format_block b;
+
+	if (!format_block_info(res->info.format, &b))
+		return false;
+
+	if (width == 0u)
+		width = 1u;
+	if (height == 0u)
+		height = 1u;
+
+	l->row_bytes = (t->w + b.w - 1u) / b.w * b.bytes;
+	l->rows = (t->h + b.h - 1u) / b.h;
+	l->slices = 1u;
+
+	switch (res->info.target) {
+	case PIPE_TEXTURE_1D:
+		l->rows = 1u;
+		break;
+	case PIPE_TEXTURE_1D_ARRAY:
+		/* Layers are addressed as rows */
+		height = res->info.array_size;
+		l->rows = t->h;
+		break;
+	case PIPE_TEXTURE_2D:
+	case PIPE_TEXTURE_RECT:
+		break;
+	case PIPE_TEXTURE_3D:
+	case PIPE_TEXTURE_CUBE:
+	case PIPE_TEXTURE_2D_ARRAY:
+	case PIPE_TEXTURE_CUBE_ARRAY:
+		l->slices = t->d;
+		break;
+	default:
+		return false;
 	}
 
-	uint32_t uv_align = 16;
-	uint32_t uv_stride = align_up_power_of_2(uv_width, uv_align) * bpp;
-	uint32_t uv_size = uv_stride * uv_height * uv_plane_count;
+	l->stride = (t->stride != 0u) ? t->stride :
+					(width + b.w - 1u) / b.w * b.bytes;
+	l->layer_stride = (t->layer_stride != 0u) ?
+				  t->layer_stride :
+				  l->stride * ((height + b.h - 1u) / b.h);
+	return true;
+}
+
+/*
+ * Send exactly the bytes of the box: contiguous runs as plain patches,
+ * strided rows as packed rectangles.
+ */
+static void gpu_device_send_box(struct rvgpu_ctx *ctx,
+				const struct rvgpu_res *res,
+				uint64_t offset,
+				const struct transfer_layout *l)
+{
+	size_t slice_size;
+
+	if (l->row_bytes == 0u || l->rows == 0u || l->slices == 0u)
+		return;
+
+	if (l->rows > 1u && l->row_bytes < l->stride) {
+		for (uint32_t i = 0; i < l->slices; i++)
+			gpu_device_send_rect(ctx, res->backing, res->nbacking,
+					     offset + (size_t)i * l->layer_stride,
+					     l->row_bytes, l->rows, l->stride);
+		return;
+	}
+
+	/* Every slice is contiguous */
+	slice_size = (size_t)(l->rows - 1u) * l->stride + l->row_bytes;
+	if (l->slices == 1u || slice_size >= l->layer_stride) {
+		gpu_device_send_data(ctx, res->backing, res->nbacking, offset,
+				     (size_t)(l->slices - 1u) * l->layer_stride +
+					     slice_size);
+	} else if (slice_size <= UINT32_MAX) {
+		gpu_device_send_rect(ctx, res->backing, res->nbacking, offset,
+				     (uint32_t)slice_size, l->slices,
+				     l->layer_stride);
+	}
+}
+
+/*
+ * Send the part of every plane of a YUV frame covered by the box. The
+ * transfer offset points at the box in the luma plane. Returns false if
+ * the offset does not match the box, so the frame can't be located.
+ */
+static bool gpu_device_send_yuv(struct rvgpu_ctx *ctx,
+				const struct rvgpu_res *res,
+				const struct rvgpu_res_transfer *t)
+{
+	struct yuv_layout yl;
+	uint64_t base, box;
+
+	if (!yuv_layout(res->info.format, res->info.width, res->info.height,
+			t->stride, &yl))
+		return true; /* unknown layout, nothing to send */
+
+	box = (uint64_t)t->y * yl.planes[0].stride +
+	      (uint64_t)t->x * yl.planes[0].cpp;
+	if (t->offset < box)
+		return false;
+	base = t->offset - box;
+
+	for (unsigned int i = 0; i < yl.nplanes; i++) {
+		const struct yuv_plane *pl = &yl.planes[i];
+		uint32_t x0 = t->x / pl->sub;
+		uint32_t x1 = (t->x + t->w + pl->sub - 1) / pl->sub;
+		uint32_t y0 = t->y / pl->sub;
+		uint32_t y1 = (t->y + t->h + pl->sub - 1) / pl->sub;
+		struct transfer_layout l;
 
-	size_t total_size = y_size + uv_size;
-	return total_size;
+		if (y1 > pl->height)
+			y1 = pl->height;
+		if (y0 >= y1 || x0 >= x1)
+			continue;
+
+		l.row_bytes = (x1 - x0) * pl->cpp;
+		l.rows = y1 - y0;
+		l.slices = 1;
+		l.stride = pl->stride;
+		l.layer_stride = 0;
+		gpu_device_send_box(ctx, res,
+				    base + pl->offset +
+					    (uint64_t)y0 * pl->stride +
+					    (uint64_t)x0 * pl->cpp,
+				    &l);
+	}
+	return true;
+}
+
+/**
+ * @brief Check if changed tiles of the resource can be tracked
+ * @param res - resource
+ * @retval true for plain single level 2D textures
+ */
+static bool res_shadow_eligible(const struct rvgpu_res *res)
+{
+	return res->info.target == PIPE_TEXTURE_2D && res->info.depth <= 1 &&
+	       res->info.array_size <= 1 && res->info.last_level == 0 &&
+	       !virgl_format_is_compressed(res->info.format) &&
+	       !virgl_format_is_yuv(res->info.format) &&
+	       (uint64_t)res->info.width * res->info.height >=
+		       SHADOW_TILE * SHADOW_TILE;
 }
 
-static size_t compressed_data_size(uint32_t format, uint32_t width,
-				   uint32_t height)
+/*
+ * Sync bytes [pos, pos + len) of the shadow with the backing. The iovec
+ * cursor i/base only moves forward, so positions must not decrease
+ * between calls.
+ */
+static bool shadow_sync_iov(struct res_shadow *s, const struct iovec iovs[],
+			    size_t niov, size_t *i, size_t *base, size_t pos,
+			    size_t len)
+{
+	bool changed = false;
+
+	while (*i < niov && pos >= *base + iovs[*i].iov_len) {
+		*base += iovs[*i].iov_len;
+		(*i)++;
+	}
+
+	while (len > 0u && *i < niov) {
+		size_t off = pos - *base;
+		size_t chunk = iovs[*i].iov_len - off;
+
+		if (chunk > len)
+			chunk = len;
+		if (shadow_sync(s->data + pos, (char *)iovs[*i].iov_base + off,
+				chunk))
+			changed = true;
+		pos += chunk;
+		len -= chunk;
+		if (off + chunk == iovs[*i].iov_len) {
+			*base += iovs[*i].iov_len;
+			(*i)++;
+		}
+	}
+	return changed;
+}
+
+/*
+ * Copy the whole backing to the shadow and send it, so that the remote
+ * copy is known again.
+ */
+static bool shadow_refill(struct rvgpu_ctx *ctx, const struct rvgpu_res *res,
+			  struct res_shadow *s, uint32_t reset_gen)
+{
+	struct iovec siov;
+	size_t size = 0u, pos = 0u;
+
+	for (unsigned int i = 0; i < res->nbacking; i++)
+		size += res->backing[i].iov_len;
+
+	if (size == 0u || res_shadow_resize(s, size))
+		return false;
+
+	for (unsigned int i = 0; i < res->nbacking; i++) {
+		memcpy(s->data + pos, res->backing[i].iov_base,
+		       res->backing[i].iov_len);
+		pos += res->backing[i].iov_len;
+	}
+
+	siov.iov_base = s->data;
+	siov.iov_len = size;
+	gpu_device_send_data(ctx, &siov, 1, 0, size);
+
+	s->generation = res->generation;
+	s->reset_gen = reset_gen;
+	s->valid = true;
+	return true;
+}
+
+/* Scanout updates are packed harder when they queue for longer than this */
+#define LOSSY_LATENCY_MS 33u
+
+/*
+ * Quality control of a transfer. pending follows the bytes queued for the
+ * links, tiles are packed harder while it exceeds what the slowest link
+ * drains within LOSSY_LATENCY_MS.
+ */
+struct lossy_ctl {
+	uint64_t budget; /**< bytes drained within the latency target */
+	uint64_t pending; /**< bytes queued, including the transfer so far */
+	unsigned int alpha; /**< byte of the pixel holding alpha */
+};
+
+/**
+ * @brief Check if the format can be packed lossy
+ *
+ * Packing drops the fourth byte of the pixel, so formats whose alpha
+ * carries content are always sent lossless.
+ *
+ * @param format - virgl format
+ * @param alpha - byte of the pixel holding padding
+ * @retval true for 32 bit formats with 8 bit colour channels and padding
+ */
+static bool lossy_format(uint32_t format, unsigned int *alpha)
 {
 	switch (format) {
-	case VIRGL_FORMAT_DXT1_RGB:
-	case VIRGL_FORMAT_DXT1_RGBA:
-	case VIRGL_FORMAT_DXT1_SRGB:
-	case VIRGL_FORMAT_DXT1_SRGBA:
-		// DXT1 block size is 8 bytes for a 4x4 pixel block
-		return ((width + 3) / 4) * ((height + 3) / 4) * 8;
-	case VIRGL_FORMAT_DXT3_RGBA:
-	case VIRGL_FORMAT_DXT5_RGBA:
-	case VIRGL_FORMAT_DXT3_SRGBA:
-	case VIRGL_FORMAT_DXT5_SRGBA:
-		// DXT3/DXT5 block size is 16 bytes for a 4x4 pixel block
-		return ((width + 3) / 4) * ((height + 3) / 4) * 16;
-	case VIRGL_FORMAT_RGTC1_UNORM:
-	case VIRGL_FORMAT_RGTC1_SNORM:
-		// RGTC1 block size is 8 bytes for a 4x4 pixel block
-		return ((width + 3) / 4) * ((height + 3) / 4) * 8;
-	case VIRGL_FORMAT_RGTC2_UNORM:
-	case VIRGL_FORMAT_RGTC2_SNORM:
-		// RGTC2 block size is 16 bytes for a 4x4 pixel block
-		return ((width + 3) / 4) * ((height + 3) / 4) * 16;
-	case VIRGL_FORMAT_ETC1_RGB8:
-	case VIRGL_FORMAT_ETC2_RGB8:
-	case VIRGL_FORMAT_ETC2_SRGB8:
-	case VIRGL_FORMAT_ETC2_RGB8A1:
-	case VIRGL_FORMAT_ETC2_SRGB8A1:
-  case VIRGL_FORMAT_ETC2_R11_UNORM:
-  case VIRGL_FORMAT_ETC2_R11_SNORM:
-		// ETC1/ETC2/EAC R11 block size is 8 bytes for a 4x4 pixel block
-		return ((width + 3) / 4) * ((height + 3) / 4) * 8;
-	case VIRGL_FORMAT_ETC2_RGBA8:
-	case VIRGL_FORMAT_ETC2_SRGBA8:
-  case VIRGL_FORMAT_ETC2_RG11_UNORM:
-  case VIRGL_FORMAT_ETC2_RG11_SNORM:
-		// ETC2 RGBA and EAC RG11 block size is 16 bytes for a 4x4 pixel block
-		return ((width + 3) / 4) * ((height + 3) / 4) * 16;
-	case VIRGL_FORMAT_ASTC_4x4:
-	case VIRGL_FORMAT_ASTC_4x4_SRGB:
-		// ASTC 4x4 block size is 16 bytes for a 4x4 pixel block
-		return ((width + 3) / 4) * ((height + 3) / 4) * 16;
-	case VIRGL_FORMAT_ASTC_5x4:
-	case VIRGL_FORMAT_ASTC_5x4_SRGB:
-		// ASTC 5x4 block size is 16 bytes for a 5x4 pixel block
-		return ((width + 4) / 5) * ((height + 3) / 4) * 16;
-	case VIRGL_FORMAT_ASTC_5x5:
-	case VIRGL_FORMAT_ASTC_5x5_SRGB:
-		// ASTC 5x5 block size is 16 bytes for a 5x5 pixel block
-		return ((width + 4) / 5) * ((height + 4) / 5) * 16;
-	case VIRGL_FORMAT_ASTC_6x5:
-	case VIRGL_FORMAT_ASTC_6x5_SRGB:
-		// ASTC 6x5 block size is 16 bytes for a 6x5 pixel block
-		return ((width + 5) / 6) * ((height + 4) / 5) * 16;
-	case VIRGL_FORMAT_ASTC_6x6:
-	case VIRGL_FORMAT_ASTC_6x6_SRGB:
-		// ASTC 6x6 block size is 16 bytes for a 6x6 pixel block
-		return ((width + 5) / 6) * ((height + 5) / 6) * 16;
-	case VIRGL_FORMAT_ASTC_8x5:
-	case VIRGL_FORMAT_ASTC_8x5_SRGB:
-		// ASTC 8x5 block size is 16 bytes for a 8x5 pixel block
-		return ((width + 7) / 8) * ((height + 4) / 5) * 16;
-	case VIRGL_FORMAT_ASTC_8x6:
-	case VIRGL_FORMAT_ASTC_8x6_SRGB:
-		// ASTC 8x6 block size is 16 bytes for a 8x6 pixel block
-		return ((width + 7) / 8) * ((height + 5) / 6) * 16;
-	case VIRGL_FORMAT_ASTC_8x8:
-	case VIRGL_FORMAT_ASTC_8x8_SRGB:
-		// ASTC 8x8 block size is 16 bytes for a 8x8 pixel block
-		return ((width + 7) / 8) * ((height + 7) / 8) * 16;
-	case VIRGL_FORMAT_ASTC_10x5:
-	case VIRGL_FORMAT_ASTC_10x5_SRGB:
-		// ASTC 10x5 block size is 16 bytes for a 10x5 pixel block
-		return ((width + 9) / 10) * ((height + 4) / 5) * 16;
-	case VIRGL_FORMAT_ASTC_10x6:
-	case VIRGL_FORMAT_ASTC_10x6_SRGB:
-		// ASTC 10x6 block size is 16 bytes for a 10x6 pixel block
-		return ((width + 9) / 10) * ((height + 5) / 6) * 16;
-	case VIRGL_FORMAT_ASTC_10x8:
-	case VIRGL_FORMAT_ASTC_10x8_SRGB:
-		// ASTC 10x8 block size is 16 bytes for a 10x8 pixel block
-		return ((width + 9) / 10) * ((height + 7) / 8) * 16;
-	case VIRGL_FORMAT_ASTC_10x10:
-	case VIRGL_FORMAT_ASTC_10x10_SRGB:
-		// ASTC 10x10 block size is 16 bytes for a 10x10 pixel block
-		return ((width + 9) / 10) * ((height + 9) / 10) * 16;
-	case VIRGL_FORMAT_ASTC_12x10:
-	case VIRGL_FORMAT_ASTC_12x10_SRGB:
-		// ASTC 12x10 block size is 16 bytes for a 12x10 pixel block
-		return ((width + 11) / 12) * ((height + 9) / 10) * 16;
-	case VIRGL_FORMAT_ASTC_12x12:
-	case VIRGL_FORMAT_ASTC_12x12_SRGB:
-		// ASTC 12x12 block size is 16 bytes for a 12x12 pixel block
-		return ((width + 11) / 12) * ((height + 11) / 12) * 16;
+	case VIRGL_FORMAT_B8G8R8X8_UNORM:
+	case VIRGL_FORMAT_R8G8B8X8_UNORM:
+		*alpha = 3u;
+		return true;
+	case VIRGL_FORMAT_X8R8G8B8_UNORM:
+	case VIRGL_FORMAT_X8B8G8R8_UNORM:
+		*alpha = 0u;
+		return true;
 	default:
-		fprintf(stderr, "Unknown compressed format: %s\n",
-			get_virgl_format_string(format));
-		return 0;
+		return false;
 	}
 }
 
+/*
+ * Set up quality control for a transfer to a scanout. Returns false if the
+ * transfer has to be lossless: lossy mode is off, some host can't unpack
+ * lossy patches or the link rate is not known yet.
+ */
+static bool lossy_ctl_init(struct ctx_priv *ctx_priv,
+			   const struct rvgpu_res *res,
+			   const struct rvgpu_res_transfer *t,
+			   struct lossy_ctl *ctl)
+{
+	uint64_t bps;
+	size_t backlog;
+
+	if (!ctx_priv->args.lossy || t->level != 0u ||
+	    !(t->flags & RVGPU_TRANSFER_SCANOUT) ||
+	    (t->flags & RVGPU_TRANSFER_LOSSLESS) ||
+	    !lossy_format(res->info.format, &ctl->alpha))
+		return false;
+
+	/* All hosts get the same patches */
+	if (!all_hosts(ctx_priv, atomic_load(&ctx_priv->lossy_hosts)))
+		return false;
+
+	rvgpu_ctx_link_rate(ctx_priv, &bps, &backlog);
+	if (bps == 0u)
+		return false;
+
+	ctl->budget = bps * LOSSY_LATENCY_MS / 1000u;
+	ctl->pending = backlog;
+	return true;
+}
+
+/*
+ * Pick the packing level of a tile of raw bytes: full quality while the
+ * links keep up, half or quarter size as they fall behind.
+ */
+static unsigned int lossy_level(struct lossy_ctl *ctl, size_t raw)
+{
+	unsigned int level = 0u;
+
+	while (level < LOSSY_LEVEL_MAX &&
+	       ctl->pending + (raw >> level) > ctl->budget << level)
+		level++;
+
+	ctl->pending += raw >> level;
+	return level;
+}
+
+static void rect_union(struct rvgpu_res_rect *r, uint32_t x, uint32_t y,
+		       uint32_t w, uint32_t h)
+{
+	uint32_t x1 = x + w, y1 = y + h;
+
+	if (r->w != 0u) {
+		if (r->x < x)
+			x = r->x;
+		if (r->y < y)
+			y = r->y;
+		if (r->x + r->w > x1)
+			x1 = r->x + r->w;
+		if (r->y + r->h > y1)
+			y1 = r->y + r->h;
+	}
+	r->x = x;
+	r->y = y;
+	r->w = x1 - x;
+	r->h = y1 - y;
+}
+
+static bool rect_contains(const struct rvgpu_res_rect *r, uint32_t x,
+			  uint32_t y, uint32_t w, uint32_t h)
+{
+	return x <= r->x && y <= r->y && x + w >= r->x + r->w &&
+	       y + h >= r->y + r->h;
+}
+
+/*
+ * Get len bytes at pos of the iovecs, copied to buf if they span several
+ * iovecs. The iovec cursor i/base only moves forward. Returns NULL if the
+ * iovecs are too short.
+ */
+static const uint8_t *iov_span(const struct iovec iovs[], size_t niov,
+			       size_t *i, size_t *base, size_t pos,
+			       size_t len, uint8_t *buf)
+{
+	size_t done = 0u;
+
+	while (done < len) {
+		size_t off, chunk;
+
+		while (*i < niov && pos >= *base + iovs[*i].iov_len) {
+			*base += iovs[*i].iov_len;
+			(*i)++;
+		}
+		if (*i == niov)
+			return NULL;
+
+		off = pos - *base;
+		chunk = iovs[*i].iov_len - off;
+		if (done == 0u && chunk >= len)
+			return (const uint8_t *)iovs[*i].iov_base + off;
+		if (chunk > len - done)
+			chunk = len - done;
+		memcpy(buf + done, (const uint8_t *)iovs[*i].iov_base + off,
+		       chunk);
+		done += chunk;
+		pos += chunk;
+	}
+	return buf;
+}
+
+/*
+ * Pack a rectangle of 32 bit pixels at level and send it as a lossy patch.
+ */
+static void gpu_device_send_lossy(struct rvgpu_ctx *ctx,
+				  const struct iovec iovs[], size_t niov,
+				  size_t offset, uint32_t width,
+				  uint32_t height, uint32_t stride,
+				  unsigned int level, unsigned int alpha)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	size_t row_bytes = (size_t)width * LOSSY_PIXEL_SIZE;
+	size_t packed = lossy_row_size(width, level);
+	size_t size = row_bytes + packed * height;
+	struct rvgpu_patch hdr = { .type = RVGPU_PATCH_LOSSY };
+	struct rvgpu_patch_lossy q = {
+		.width = width,
+		.stride = stride,
+		.level = (uint8_t)level,
+		.alpha = (uint8_t)alpha,
+	};
+	struct iovec iov[3];
+	size_t i = 0u, base = 0u;
+	uint8_t *out;
+
+	if (size > ctx_priv->lossy_cap) {
+		uint8_t *buf = realloc(ctx_priv->lossy_buf, size);
+
+		if (!buf) {
+			gpu_device_send_rect(ctx, iovs, niov, offset,
+					     (uint32_t)row_bytes, height,
+					     stride);
+			return;
+		}
+		ctx_priv->lossy_buf = buf;
+		ctx_priv->lossy_cap = size;
+	}
+
+	/* Rows spanning several iovecs are gathered in front of the output */
+	out = ctx_priv->lossy_buf + row_bytes;
+	for (q.height = 0u; q.height < height; q.height++) {
+		const uint8_t *row =
+			iov_span(iovs, niov, &i, &base,
+				 offset + (size_t)q.height * stride, row_bytes,
+				 ctx_priv->lossy_buf);
+
+		if (!row)
+			break; /* backing is too small */
+		lossy_pack_row(out + q.height * packed, row, width, level,
+			       alpha);
+	}
+	if (q.height == 0u)
+		return;
+
+	assert(offset < UINT32_MAX);
+	hdr.offset = (uint32_t)offset;
+	hdr.len = (uint32_t)(sizeof(q) + packed * q.height);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = &q;
+	iov[1].iov_len = sizeof(q);
+	iov[2].iov_base = out;
+	iov[2].iov_len = packed * q.height;
+
+	if (send_patch(ctx, iov, 3))
+		warn("short write");
+}
+
+/*
+ * Send the box in tiles of SHADOW_TILE x SHADOW_TILE pixels. With a shadow
+ * only the tiles that differ from it are sent, unless all is set, and they
+ * are read from the shadow, which is what the remote copy becomes. Runs
+ * of tiles of a tile row go out as one rectangle, split where the lossy
+ * control picks different levels. Rows are walked in memory order.
+ */
+static void gpu_device_send_tiles(struct rvgpu_ctx *ctx,
+				  struct rvgpu_res *res, struct res_shadow *s,
+				  const struct rvgpu_res_transfer *t,
+				  const struct transfer_layout *l,
+				  uint32_t cpp, struct lossy_ctl *ctl, bool all)
+{
+	struct iovec siov;
+	const struct iovec *src = res->backing;
+	size_t nsrc = res->nbacking;
+	size_t tile_bytes = (size_t)SHADOW_TILE * cpp;
+	uint32_t ncols = (uint32_t)((l->row_bytes + tile_bytes - 1u) /
+				    tile_bytes);
+	/* 0 for unchanged tiles, packing level + 1 for the others */
+	uint8_t tiles[SHADOW_MAX_COLS];
+	size_t i = 0u, base = 0u;
+
+	if (s) {
+		siov.iov_base = s->data;
+		siov.iov_len = s->size;
+		src = &siov;
+		nsrc = 1u;
+	}
+
+	for (uint32_t y = 0; y < l->rows; y += SHADOW_TILE) {
+		uint32_t h = l->rows - y;
+		uint32_t c = 0;
+
+		if (h > SHADOW_TILE)
+			h = SHADOW_TILE;
+
+		memset(tiles, all ? 1 : 0, ncols);
+		for (uint32_t r = y; s && r < y + h; r++) {
+			size_t row = t->offset + (size_t)r * l->stride;
+
+			for (c = 0; c < ncols; c++) {
+				size_t x = c * tile_bytes;
+				size_t len = l->row_bytes - x;
+
+				if (len > tile_bytes)
+					len = tile_bytes;
+				if (shadow_sync_iov(s, res->backing,
+						    res->nbacking, &i, &base,
+						    row + x, len))
+					tiles[c] = 1u;
+			}
+		}
+
+		for (c = 0; ctl && c < ncols; c++) {
+			size_t len = l->row_bytes - c * tile_bytes;
+
+			if (len > tile_bytes)
+				len = tile_bytes;
+			if (tiles[c])
+				tiles[c] = (uint8_t)(1u + lossy_level(ctl,
+								      len * h));
+		}
+
+		for (c = 0; c < ncols; c++) {
+			uint32_t first = c;
+			unsigned int level = tiles[c] - 1u;
+			size_t x, width, pos;
+
+			if (!tiles[c])
+				continue;
+			while (c + 1 < ncols && tiles[c + 1] == tiles[first])
+				c++;
+
+			x = first * tile_bytes;
+			width = (c + 1 - first) * tile_bytes;
+			if (width > l->row_bytes - x)
+				width = l->row_bytes - x;
+			pos = t->offset + (size_t)y * l->stride + x;
+
+			if (level == 0u) {
+				gpu_device_send_rect(ctx, src, nsrc, pos,
+						     (uint32_t)width, h,
+						     l->stride);
+				continue;
+			}
+			gpu_device_send_lossy(ctx, src, nsrc, pos,
+					      (uint32_t)(width / cpp), h,
+					      l->stride, level, ctl->alpha);
+			rect_union(&res_entry_of(res)->lossy,
+				   t->x + (uint32_t)(x / cpp), t->y + y,
+				   (uint32_t)(width / cpp), h);
+		}
+	}
+}
+
+/* The whole backing is sent the next time if the shadow is out of date */
+static bool shadow_stale(const struct rvgpu_res *res, uint32_t reset_gen)
+{
+	const struct res_shadow *s = res_entry_of(res)->shadow;
+
+	return s && (!s->valid || s->generation != res->generation ||
+		     s->reset_gen != reset_gen);
+}
+
+/*
+ * Send the box of a resource with a shadow or of a scanout sent lossy.
+ * Returns false if the box can't be sent in tiles, it must be sent as is
+ * then.
+ */
+static bool gpu_device_send_tiled(struct rvgpu_ctx *ctx,
+				  struct rvgpu_res *res,
+				  const struct rvgpu_res_transfer *t,
+				  const struct transfer_layout *l)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	struct res_shadow *s = res_entry_of(res)->shadow;
+	uint32_t reset_gen = atomic_load(&ctx_priv->reset_gen);
+	struct lossy_ctl ctl;
+	bool lossy = lossy_ctl_init(ctx_priv, res, t, &ctl);
+	struct format_block b;
+	size_t end;
+
+	if (!s && !lossy)
+		return false;
+
+	if (shadow_stale(res, reset_gen)) {
+		if (!shadow_refill(ctx, res, s, reset_gen))
+			return false;
+		res_entry_of(res)->lossy.w = 0u;
+		return true;
+	}
+
+	end = t->offset + (size_t)(l->rows - 1u) * l->stride + l->row_bytes;
+	if (l->slices != 1u || l->rows == 0u || l->row_bytes == 0u ||
+	    l->row_bytes > l->stride || (s && end > s->size) ||
+	    !format_block_info(res->info.format, &b) ||
+	    l->row_bytes > (size_t)SHADOW_MAX_COLS * SHADOW_TILE * b.bytes) {
+		/* Remote copy is going to differ from the shadow */
+		if (s)
+			s->valid = false;
+		return false;
+	}
+
+	gpu_device_send_tiles(ctx, res, s, t, l, b.bytes,
+			      lossy ? &ctl : NULL,
+			      !s || (t->flags & RVGPU_TRANSFER_LOSSLESS));
+	return true;
+}
+
+/*
+ * Send the box to the hosts not in skip. Hosts which caught up get all of
+ * it, the others what changed since their last transfer.
+ */
+static void gpu_device_send_part(struct rvgpu_ctx *ctx, struct rvgpu_res *res,
+				 const struct rvgpu_res_transfer *t,
+				 const struct transfer_layout *l,
+				 uint32_t skip, uint32_t caught_up)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+
+	caught_up &= ~skip;
+	if (caught_up) {
+		/* The shadow does not tell what these hosts have */
+		ctx_priv->xfer_skip = ~caught_up;
+		gpu_device_send_box(ctx, res, t->offset, l);
+	}
+
+	/*
+	 * Without a shadow, hosts that are up to date need no catch up
+	 * transfer unless it replaces parts sent lossy. With a shadow they
+	 * get what changed since their last transfer, as usual.
+	 */
+	ctx_priv->xfer_skip = skip | caught_up;
+	if ((t->flags & RVGPU_TRANSFER_CATCHUP) &&
+	    !res_entry_of(res)->shadow && res_entry_of(res)->lossy.w == 0u)
+		ctx_priv->xfer_skip = UINT32_MAX;
+	if (!gpu_device_send_tiled(ctx, res, t, l))
+		gpu_device_send_box(ctx, res, t->offset, l);
+}
+
+/* Insert an edge strictly inside (lo, hi) into the sorted edges */
+static unsigned int add_edge(uint32_t *edges, unsigned int n, uint32_t e,
+			     uint32_t lo, uint32_t hi)
+{
+	unsigned int i;
+
+	if (e <= lo || e >= hi)
+		return n;
+	for (i = 0; i < n; i++) {
+		if (edges[i] == e)
+			return n;
+	}
+	for (i = n; i > 0u && edges[i - 1u] > e; i--)
+		edges[i] = edges[i - 1u];
+	edges[i] = e;
+	return n + 1u;
+}
+
+static bool rect_covers(const struct rvgpu_res_rect *r, uint32_t x,
+			uint32_t y, uint32_t w, uint32_t h)
+{
+	return r->w != 0u && x >= r->x && y >= r->y &&
+	       (uint64_t)x + w <= (uint64_t)r->x + r->w &&
+	       (uint64_t)y + h <= (uint64_t)r->y + r->h;
+}
+
+/*
+ * Split the box along the edges of the host clip boxes, so that each part
+ * is either inside or outside each clip box, and send every part only to
+ * the hosts showing it. The parts don't overlap, so the shadow of each
+ * part still matches the copies of the hosts showing it. A host whose
+ * clip box changes is marked behind for the whole resource by the proxy.
+ */
+static bool gpu_device_send_clipped(struct rvgpu_ctx *ctx,
+				    struct rvgpu_res *res,
+				    const struct rvgpu_res_transfer *t,
+				    const struct transfer_layout *l,
+				    uint32_t skip, uint32_t caught_up)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	uint32_t xs[2u * MAX_HOSTS + 2u], ys[2u * MAX_HOSTS + 2u];
+	unsigned int nx = 1u, ny = 1u;
+	struct format_block b;
+
+	/* Parts are addressed in pixels */
+	if (l->slices != 1u || !format_block_info(res->info.format, &b) ||
+	    b.w != 1u || b.h != 1u)
+		return false;
+
+	xs[0] = t->x;
+	ys[0] = t->y;
+	for (unsigned int h = 0; h < ctx_priv->cmd_count; h++) {
+		const struct rvgpu_res_rect *c = &t->clip[h];
+
+		if (c->w == 0u)
+			continue;
+		nx = add_edge(xs, nx, c->x, t->x, t->x + t->w);
+		nx = add_edge(xs, nx, c->x + c->w, t->x, t->x + t->w);
+		ny = add_edge(ys, ny, c->y, t->y, t->y + t->h);
+		ny = add_edge(ys, ny, c->y + c->h, t->y, t->y + t->h);
+	}
+	xs[nx] = t->x + t->w;
+	ys[ny] = t->y + t->h;
+
+	for (unsigned int j = 0; j < ny; j++) {
+		for (unsigned int i = 0; i < nx; i++) {
+			struct rvgpu_res_transfer pt = *t;
+			struct transfer_layout pl;
+			uint32_t out = 0u;
+
+			pt.x = xs[i];
+			pt.y = ys[j];
+			pt.w = xs[i + 1u] - xs[i];
+			pt.h = ys[j + 1u] - ys[j];
+			for (unsigned int h = 0; h < ctx_priv->cmd_count; h++) {
+				if (!rect_covers(&t->clip[h], pt.x, pt.y, pt.w,
+						 pt.h))
+					out |= 1u << h;
+			}
+			if (all_hosts(ctx_priv, skip | out))
+				continue;
+
+			pt.offset = t->offset +
+				    (uint64_t)(pt.y - t->y) * l->stride +
+				    (uint64_t)(pt.x - t->x) * b.bytes;
+			if (!transfer_layout(res, &pt, &pl))
+				continue;
+			gpu_device_send_part(ctx, res, &pt, &pl, skip | out,
+					     caught_up);
+		}
+	}
+	return true;
+}
+
+/*
+ * Send the box of a resource. Scanout updates are not sent to hosts which
+ * fell behind or which the caller left out: the skipped boxes are
+ * collected in the behind box of the entry and sent in full once the
+ * hosts catch up, so they only get the latest contents.
+ */
+static void gpu_device_send_latest(struct rvgpu_ctx *ctx,
+				   struct rvgpu_res *res,
+				   const struct rvgpu_res_transfer *t,
+				   const struct transfer_layout *l)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	struct res_entry *e = res_entry_of(res);
+	uint32_t reset_gen = atomic_load(&ctx_priv->reset_gen);
+	bool stale = shadow_stale(res, reset_gen);
+	uint32_t late = t->skip_hosts, caught_up;
+	struct rvgpu_res_rect missed = { t->x, t->y, t->w, t->h };
+
+	if (stale) {
+		/* Everybody else gets the whole backing */
+		e->behind_hosts &= late;
+		missed = (struct rvgpu_res_rect){ 0u, 0u, res->info.width,
+						  res->info.height };
+	} else if ((t->flags & RVGPU_TRANSFER_SCANOUT) && t->level == 0u &&
+		   t->d == 1u) {
+		late |= rvgpu_ctx_late_hosts(ctx);
+	}
+	caught_up = e->behind_hosts & ~late;
+
+	/* A refill of the shadow is sent to all hosts, clipped or not */
+	if (stale || !t->clip ||
+	    !gpu_device_send_clipped(ctx, res, t, l, late, caught_up))
+		gpu_device_send_part(ctx, res, t, l, late, caught_up);
+	ctx_priv->xfer_skip = t->skip_hosts;
+
+	if (caught_up && rect_contains(&e->behind, t->x, t->y, t->w, t->h))
+		e->behind_hosts &= ~caught_up;
+	if (late) {
+		rect_union(&e->behind, missed.x, missed.y, missed.w, missed.h);
+		e->behind_hosts |= late;
+	}
+	if (e->behind_hosts == 0u)
+		e->behind.w = 0u;
+}
+
 int rvgpu_ctx_transfer_to_host(struct rvgpu_ctx *ctx,
 			       const struct rvgpu_res_transfer *t,
-			       const struct rvgpu_res *res)
+			       struct rvgpu_res *res)
 {
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
 	struct rvgpu_patch p = { .len = 0 };
+	struct iovec end = { .iov_base = &p, .iov_len = sizeof(p) };
+	struct transfer_layout l;
 	size_t size = 0;
-	if (res->info.target == 0) {
+	int ret;
+
+	ctx_priv->xfer_skip = t->skip_hosts;
+
+	/* A renderer missed chunks of it, the remote copy is unknown */
+	if (atomic_exchange(&res_entry_of(res)->resend, false)) {
+		if (res_entry_of(res)->shadow)
+			res_entry_of(res)->shadow->valid = false;
+		else
+			gpu_device_send_data(ctx, res->backing, res->nbacking,
+					     0, SIZE_MAX);
+	}
+
+	if (res->info.target == PIPE_BUFFER) {
 		if (t->stride > 0) {
 			if (t->d > 1 && t->h > 1) {
 				// Transfer h rows, each of stride bytes, for d slices
@@ -366,47 +1609,29 @@ int rvgpu_ctx_transfer_to_host(struct rvgpu_ctx *ctx,
 		if (size > 0)
 			gpu_device_send_data(ctx, res->backing, res->nbacking,
 					     t->offset, size);
-	} else if (res->info.target == 2) {
-		if (virgl_format_is_compressed(res->info.format)) {
-			size_t compressed_size = compressed_data_size(
-				res->info.format, t->w, t->h);
-			gpu_device_send_data(ctx, res->backing, res->nbacking,
-					     t->offset, compressed_size);
-		} else if (virgl_format_is_yuv(res->info.format)) {
+	} else if (virgl_format_is_yuv(res->info.format)) {
+		if (!gpu_device_send_yuv(ctx, res, t)) {
 			size_t yuv_size = yuv_data_size(res->info.format, t->w,
 							t->h, t->stride);
 			gpu_device_send_data(ctx, res->backing, res->nbacking,
 					     t->offset, yuv_size);
-		} else {
-			unsigned int bpp = get_format_bpp(res->info.format);
-			uint32_t stride = (t->stride != 0) ?
-						  t->stride :
-						  bpp * res->info.width;
-			size_t size = (t->h - 1U) * stride + t->w * bpp;
-			gpu_device_send_data(ctx, res->backing, res->nbacking,
-					     t->offset, size);
 		}
-	} else if ( res->info.target == 3)
-	{
-		// 3D texture
-		unsigned int bpp = get_format_bpp(res->info.format);
-		uint32_t width = res->info.width >> t->level; // calculate width at level
-		uint32_t height = res->info.height >> t->level; // calculate height at level
-		uint32_t stride = (t->stride != 0) ?
-						t->stride :
-						bpp * width;
-		uint32_t layer_stride = (t->layer_stride != 0) ?
-						t->layer_stride :
-						stride * height;
-		size_t size = (t->h - 1U) * stride + t->w * bpp + layer_stride * (t->d - 1U);
-		gpu_device_send_data(ctx, res->backing, res->nbacking,
-					t->offset, size);
+	} else if (transfer_layout(res, t, &l)) {
+		struct rvgpu_res_rect *lossy = &res_entry_of(res)->lossy;
+
+		gpu_device_send_latest(ctx, res, t, &l);
+		/* Lossless resend of the parts sent lossy */
+		if ((t->flags & RVGPU_TRANSFER_LOSSLESS) &&
+		    rect_contains(lossy, t->x, t->y, t->w, t->h))
+			lossy->w = 0u;
 	} else {
 		gpu_device_send_data(ctx, res->backing, res->nbacking,
 				     t->offset, SIZE_MAX);
 	}
 
-	if (rvgpu_ctx_send(ctx, &p, sizeof(p))) {
+	ret = rvgpu_ctx_sendv_hosts(ctx, &end, 1, ~t->skip_hosts);
+	ctx_priv->xfer_skip = 0u;
+	if (ret) {
 		warn("short write");
 		return -1;
 	}
@@ -417,20 +1642,91 @@ struct rvgpu_res *rvgpu_ctx_res_find(struct rvgpu_ctx *ctx,
 				     uint32_t resource_id)
 {
 	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	struct res_table *t = &ctx_priv->resources;
+	struct rvgpu_res *res;
+
+	pthread_rwlock_rdlock(&t->lock);
+	res = res_table_find(t, resource_id);
+	pthread_rwlock_unlock(&t->lock);
+
+	return res;
+}
+
+struct rvgpu_res *rvgpu_ctx_res_get(struct rvgpu_ctx *ctx,
+				    uint32_t resource_id)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
 
 	return gpu_device_get_res(ctx_priv, resource_id);
 }
 
-void rvgpu_ctx_res_destroy(struct rvgpu_ctx *ctx, uint32_t resource_id)
+void rvgpu_ctx_res_put(struct rvgpu_ctx *ctx, struct rvgpu_res *res)
+{
+	(void)ctx;
+
+	gpu_device_put_res(res);
+}
+
+void rvgpu_ctx_chunk_miss(struct rvgpu_ctx *ctx, uint32_t resource_id)
 {
 	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
 	struct rvgpu_res *res;
 
+	atomic_store(&ctx_priv->chunks_lost, true);
+
 	res = gpu_device_get_res(ctx_priv, resource_id);
 	if (res) {
-		LIST_REMOVE(res, entry);
-		free(res->backing);
-		free(res);
+		atomic_store(&res_entry_of(res)->resend, true);
+		gpu_device_put_res(res);
+	}
+}
+
+void rvgpu_ctx_res_lossy(struct rvgpu_ctx *ctx, const struct rvgpu_res *res,
+			 struct rvgpu_res_rect *box)
+{
+	(void)ctx;
+
+	*box = res_entry_of(res)->lossy;
+}
+
+uint32_t rvgpu_ctx_res_behind(struct rvgpu_ctx *ctx,
+			      const struct rvgpu_res *res,
+			      struct rvgpu_res_rect *box)
+{
+	struct res_entry *e = res_entry_of(res);
+
+	(void)ctx;
+
+	*box = e->behind;
+	return e->behind_hosts;
+}
+
+void rvgpu_ctx_res_set_behind(struct rvgpu_ctx *ctx, struct rvgpu_res *res,
+			      uint32_t hosts)
+{
+	struct res_entry *e = res_entry_of(res);
+
+	(void)ctx;
+
+	if (hosts == 0u)
+		return;
+	e->behind = (struct rvgpu_res_rect){ 0u, 0u, res->info.width,
+					     res->info.height };
+	e->behind_hosts |= hosts;
+}
+
+void rvgpu_ctx_res_destroy(struct rvgpu_ctx *ctx, uint32_t resource_id)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	struct res_table *t = &ctx_priv->resources;
+	struct rvgpu_res *res;
+
+	pthread_rwlock_wrlock(&t->lock);
+	res = res_table_remove(t, resource_id);
+	pthread_rwlock_unlock(&t->lock);
+
+	if (res) {
+		gpu_device_put_res(res);
 	} else {
 		warnx("%s can't destroy resource. Res %u doesn't exist",
 		      __func__, resource_id);
@@ -442,15 +1738,65 @@ int rvgpu_ctx_res_create(struct rvgpu_ctx *ctx,
 			 uint32_t resource_id)
 {
 	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	struct res_table *t = &ctx_priv->resources;
+	struct res_entry *e;
 	struct rvgpu_res *res;
+	int ret;
 
-	res = calloc(1, sizeof(*res));
-	if (res == NULL)
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
 		return -1;
+	atomic_init(&e->refs, 1u);
+	res = &e->res;
 	res->resid = resource_id;
 	memcpy(&res->info, info, sizeof(*info));
 	res->info.bpp = 4u;
-	LIST_INSERT_HEAD(&ctx_priv->reslist, res, entry);
+	if (ctx_priv->args.res_shadow && res_shadow_eligible(res))
+		e->shadow = res_shadow_alloc();
+
+	pthread_rwlock_wrlock(&t->lock);
+	ret = res_table_insert(t, res);
+	pthread_rwlock_unlock(&t->lock);
+
+	if (ret) {
+		if (errno == EEXIST)
+			warnx("%s can't create resource. Res %u already exists",
+			      __func__, resource_id);
+		res_free(res);
+		return -1;
+	}
 
 	return 0;
 }
+
+void rvgpu_ctx_res_foreach(struct rvgpu_ctx *ctx,
+			   void (*cb)(struct rvgpu_res *res, void *opaque),
+			   void *opaque)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	struct res_table *t = &ctx_priv->resources;
+
+	pthread_rwlock_rdlock(&t->lock);
+	for (uint32_t i = 0; i < t->nslots; i++) {
+		if (t->slots[i])
+			cb(t->slots[i], opaque);
+	}
+	pthread_rwlock_unlock(&t->lock);
+}
+
+void rvgpu_ctx_res_destroy_all(struct rvgpu_ctx *ctx)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	struct res_table *t = &ctx_priv->resources;
+
+	pthread_rwlock_wrlock(&t->lock);
+	for (uint32_t i = 0; i < t->nslots; i++) {
+		if (t->slots[i])
+			gpu_device_put_res(t->slots[i]);
+	}
+	free(t->slots);
+	t->slots = NULL;
+	t->nslots = 0;
+	t->count = 0;
+	pthread_rwlock_unlock(&t->lock);
+}
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <librvgpu/rvgpu-shadow.h>
+
+/*
+ * Each variant returns the length of the equal prefix rounded down to its
+ * block size, so the caller only has to copy from there on.
+ */
+static size_t match_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t x, y;
+
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		if (x != y)
+			return i;
+	}
+	for (; i < len; i++) {
+		if (a[i] != b[i])
+			return i;
+	}
+	return len;
+}
+
+#if defined(__x86_64__)
+static size_t match_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m128i e0 = _mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(a + i)),
+			_mm_loadu_si128((const __m128i *)(b + i)));
+		__m128i e1 = _mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(a + i + 16)),
+			_mm_loadu_si128((const __m128i *)(b + i + 16)));
+		__m128i e2 = _mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(a + i + 32)),
+			_mm_loadu_si128((const __m128i *)(b + i + 32)));
+		__m128i e3 = _mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(a + i + 48)),
+			_mm_loadu_si128((const __m128i *)(b + i + 48)));
+		__m128i e = _mm_and_si128(_mm_and_si128(e0, e1),
+					  _mm_and_si128(e2, e3));
+
+		if (_mm_movemask_epi8(e) != 0xffff)
+			return i;
+	}
+	return i + match_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+match_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m256i e0 = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(a + i)),
+			_mm256_loadu_si256((const __m256i *)(b + i)));
+		__m256i e1 = _mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+			_mm256_loadu_si256((const __m256i *)(b + i + 32)));
+
+		if (_mm256_movemask_epi8(_mm256_and_si256(e0, e1)) != -1)
+			return i;
+	}
+	return i + match_scalar(a + i, b + i, len - i);
+}
+#elif defined(__aarch64__)
+static size_t match_neon(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		uint8x16_t e0 = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		uint8x16_t e1 =
+			vceqq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+		uint8x16_t e2 =
+			vceqq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32));
+		uint8x16_t e3 =
+			vceqq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48));
+		uint8x16_t e = vandq_u8(vandq_u8(e0, e1), vandq_u8(e2, e3));
+
+		if (vminvq_u8(e) != 0xff)
+			return i;
+	}
+	return i + match_scalar(a + i, b + i, len - i);
+}
+#endif
+
+static size_t (*match)(const uint8_t *a, const uint8_t *b,
+		       size_t len) = match_scalar;
+
+__attribute__((constructor)) static void shadow_select_match(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		match = match_avx2;
+	else
+		match = match_sse2;
+#elif defined(__aarch64__)
+	match = match_neon;
+#endif
+}
+
+bool shadow_sync(void *dst, const void *src, size_t len)
+{
+	size_t n = match(dst, src, len);
+
+	if (n == len)
+		return false;
+
+	memcpy((uint8_t *)dst + n, (const uint8_t *)src + n, len - n);
+	return true;
+}
+
+struct res_shadow *res_shadow_alloc(void)
+{
+	return calloc(1, sizeof(struct res_shadow));
+}
+
+void res_shadow_free(struct res_shadow *s)
+{
+	if (s) {
+		free(s->data);
+		free(s);
+	}
+}
+
+int res_shadow_resize(struct res_shadow *s, size_t size)
+{
+	s->valid = false;
+	if (size == s->size)
+		return 0;
+
+	free(s->data);
+	s->data = malloc(size);
+	if (!s->data) {
+		s->size = 0;
+		return -1;
+	}
+	s->size = size;
+	return 0;
+}
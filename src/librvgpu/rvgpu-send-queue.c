@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/poll.h>
+
+#include <librvgpu/rvgpu-send-queue.h>
+
+/* Longest wait for the pipe before the thread checks for stop */
+#define SEND_QUEUE_POLL_MS 100
+
+static void *send_queue_thread(void *arg)
+{
+	struct send_queue *q = arg;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		const uint8_t *p;
+		size_t n;
+		ssize_t written;
+		uint64_t epoch, drops;
+		int error = 0;
+
+		if (q->len > 0 && q->written >= q->limit)
+			q->stats.credit_waits++;
+		while ((q->len == 0 || q->written >= q->limit) && !q->stop)
+			pthread_cond_wait(&q->data, &q->lock);
+		if (q->stop)
+			break;
+
+		/* Senders only append, the bytes being written stay put */
+		n = q->cap - q->head;
+		if (n > q->len)
+			n = q->len;
+		if (n > q->limit - q->written)
+			n = (size_t)(q->limit - q->written);
+		p = q->buf + q->head;
+		epoch = q->epoch;
+		drops = q->drops;
+		pthread_mutex_unlock(&q->lock);
+
+		written = write(q->fd, p, n);
+		if (written < 0)
+			error = errno;
+		if (error == EAGAIN) {
+			struct pollfd pfd = { .fd = q->fd, .events = POLLOUT };
+
+			poll(&pfd, 1, SEND_QUEUE_POLL_MS);
+		} else if (error != 0 && error != EINTR) {
+			warnx("Error while writing to socket: %s",
+			      strerror(error));
+		}
+
+		pthread_mutex_lock(&q->lock);
+		/* The bytes were dropped while they were written */
+		if (drops != q->drops)
+			continue;
+		if (written < 0) {
+			if (error == EAGAIN || error == EINTR)
+				continue;
+			/* The stream is broken, drop it */
+			q->error = error;
+			q->head = 0;
+			q->len = 0;
+		} else {
+			q->head = (q->head + (size_t)written) % q->cap;
+			q->len -= (size_t)written;
+			/* Bytes of a write begun before a restart don't count */
+			if (epoch == q->epoch)
+				q->written += (size_t)written;
+		}
+		q->stats.backlog = q->len;
+		pthread_cond_broadcast(&q->space);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+int send_queue_init(struct send_queue *q, int fd, size_t cap)
+{
+	int flags = fcntl(fd, F_GETFL);
+	pthread_condattr_t attr;
+
+	memset(q, 0, sizeof(*q));
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+
+	q->buf = malloc(cap);
+	if (!q->buf)
+		return -1;
+	q->cap = cap;
+	q->fd = fd;
+	q->limit = UINT64_MAX;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->data, NULL);
+	/* Waits for room are bounded, see send_queue_put() */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->space, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&q->tid, NULL, send_queue_thread, q)) {
+		free(q->buf);
+		q->buf = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void send_queue_destroy(struct send_queue *q)
+{
+	if (!q->buf)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->stop = true;
+	pthread_cond_signal(&q->data);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->tid, NULL);
+
+	pthread_cond_destroy(&q->space);
+	pthread_cond_destroy(&q->data);
+	pthread_mutex_destroy(&q->lock);
+	free(q->buf);
+	q->buf = NULL;
+}
+
+/* Write as much as the pipe and the limit take without blocking */
+static size_t send_queue_write(struct send_queue *q, const struct iovec *iov,
+			       int iovcnt, size_t done)
+{
+	struct iovec v[IOV_MAX];
+	uint64_t budget = q->limit - q->written;
+	int n = 0;
+	ssize_t written;
+
+	for (int i = 0; i < iovcnt && n < IOV_MAX && budget > 0; i++) {
+		if (done >= iov[i].iov_len) {
+			done -= iov[i].iov_len;
+			continue;
+		}
+		v[n].iov_base = (uint8_t *)iov[i].iov_base + done;
+		v[n].iov_len = iov[i].iov_len - done;
+		if (v[n].iov_len > budget)
+			v[n].iov_len = (size_t)budget;
+		budget -= v[n].iov_len;
+		done = 0;
+		n++;
+	}
+	if (n == 0)
+		return 0;
+
+	do {
+		written = writev(q->fd, v, n);
+	} while (written < 0 && errno == EINTR);
+
+	if (written <= 0)
+		return 0;
+	q->written += (uint64_t)written;
+	return (size_t)written;
+}
+
+/*
+ * Drop the queued bytes, the caller holds the lock. Bytes queued later
+ * start at the old tail, away from a write the thread may be doing.
+ */
+static void send_queue_drop_locked(struct send_queue *q)
+{
+	q->drop = true;
+	q->drops++;
+	q->head = (q->head + q->len) % q->cap;
+	q->len = 0;
+	q->stats.backlog = 0;
+	pthread_cond_broadcast(&q->space);
+}
+
+/* Copy as much as fits into the ring buffer */
+static size_t send_queue_copy(struct send_queue *q, const struct iovec *iov,
+			      int iovcnt, size_t done)
+{
+	size_t copied = 0;
+
+	for (int i = 0; i < iovcnt && q->len < q->cap; i++) {
+		const uint8_t *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		if (done >= left) {
+			done -= left;
+			continue;
+		}
+		p += done;
+		left -= done;
+		done = 0;
+
+		while (left > 0 && q->len < q->cap) {
+			size_t tail = (q->head + q->len) % q->cap;
+			size_t n = q->cap - tail;
+
+			if (n > q->cap - q->len)
+				n = q->cap - q->len;
+			if (n > left)
+				n = left;
+			memcpy(q->buf + tail, p, n);
+			q->len += n;
+			p += n;
+			left -= n;
+			copied += n;
+		}
+	}
+
+	return copied;
+}
+
+ssize_t send_queue_put(struct send_queue *q, const struct iovec *iov,
+		       int iovcnt, size_t done, bool wait)
+{
+	size_t total = 0;
+	struct timespec deadline;
+
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		if (q->error) {
+			errno = q->error;
+			q->error = 0;
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		if (q->drop) {
+			done = total;
+			break;
+		}
+
+		if (q->len == 0 && done < total) {
+			size_t n = send_queue_write(q, iov, iovcnt, done);
+
+			q->stats.direct += n;
+			done += n;
+		}
+		if (done < total) {
+			size_t n = send_queue_copy(q, iov, iovcnt, done);
+
+			q->stats.queued += n;
+			done += n;
+			if (q->len > q->stats.peak)
+				q->stats.peak = q->len;
+			q->stats.backlog = q->len;
+			if (n > 0)
+				pthread_cond_signal(&q->data);
+		}
+		if (done == total || !wait)
+			break;
+
+		q->stats.stalls++;
+		/* Every byte written out restarts the wait */
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += SEND_QUEUE_STALL_MS / 1000;
+		deadline.tv_nsec += (SEND_QUEUE_STALL_MS % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		if (pthread_cond_timedwait(&q->space, &q->lock, &deadline) ==
+		    ETIMEDOUT) {
+			/* Part of the bytes may be out, the stream is broken */
+			send_queue_drop_locked(q);
+			pthread_mutex_unlock(&q->lock);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return (ssize_t)done;
+}
+
+void send_queue_restart(struct send_queue *q, uint64_t limit)
+{
+	pthread_mutex_lock(&q->lock);
+	q->epoch++;
+	q->written = 0;
+	q->limit = limit;
+	q->drop = false;
+	pthread_cond_signal(&q->data);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void send_queue_drop(struct send_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	send_queue_drop_locked(q);
+	pthread_mutex_unlock(&q->lock);
+}
+
+bool send_queue_dropped(struct send_queue *q)
+{
+	bool drop;
+
+	pthread_mutex_lock(&q->lock);
+	drop = q->drop;
+	pthread_mutex_unlock(&q->lock);
+
+	return drop;
+}
+
+void send_queue_credit(struct send_queue *q, uint64_t limit)
+{
+	pthread_mutex_lock(&q->lock);
+	if (limit > q->limit) {
+		q->limit = limit;
+		pthread_cond_signal(&q->data);
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+void send_queue_stats(struct send_queue *q, struct rvgpu_send_stats *stats)
+{
+	pthread_mutex_lock(&q->lock);
+	*stats = q->stats;
+	pthread_mutex_unlock(&q->lock);
+}
+
+size_t send_queue_len(struct send_queue *q)
+{
+	size_t len;
+
+	pthread_mutex_lock(&q->lock);
+	len = q->len;
+	pthread_mutex_unlock(&q->lock);
+
+	return len;
+}
@@ -19,17 +19,22 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <linux/sockios.h>
 
 #include <pthread.h>
 
 #include <librvgpu/rvgpu-plugin.h>
+#include <librvgpu/rvgpu-protocol.h>
 #include <librvgpu/rvgpu.h>
 
 const uint32_t rvgpu_backend_version = 1;
@@ -79,6 +84,12 @@ static int init_tcp_scanout(struct rvgpu_ctx *ctx, struct rvgpu_scanout *scanout
 	cmd->host_p[PIPE_READ] = sc_priv->pipes[COMMAND].snd_pipe[PIPE_READ];
 	cmd->vpgu_p[PIPE_WRITE] = sc_priv->pipes[COMMAND].snd_pipe[PIPE_WRITE];
 	cmd->vpgu_p[PIPE_READ] = sc_priv->pipes[COMMAND].rcv_pipe[PIPE_READ];
+	if (send_queue_init(&sc_priv->queue, cmd->vpgu_p[PIPE_WRITE],
+			    SEND_QUEUE_SIZE)) {
+		perror("send queue creation error");
+		return -1;
+	}
+	cmd->queue = &sc_priv->queue;
 	ctx_priv->cmd_count++;
 
 	res->tcp = &args->tcp;
@@ -91,34 +102,221 @@ static int init_tcp_scanout(struct rvgpu_ctx *ctx, struct rvgpu_scanout *scanout
 	return 0;
 }
 
-int rvgpu_ctx_send(struct rvgpu_ctx *ctx, const void *buf, size_t len)
+int rvgpu_ctx_sendv_hosts(struct rvgpu_ctx *ctx, const struct iovec *iov,
+			  int iovcnt, uint32_t hosts)
 {
 	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	size_t done[MAX_HOSTS];
+	size_t len = 0;
+	int ret = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 
+	/*
+	 * Hand the buffers to every host that has room first, then wait
+	 * for the ones that don't. A slow host only holds back the caller,
+	 * never the delivery to the other hosts. A host that doesn't take
+	 * anything for too long is dropped and reconnected, and a failing
+	 * host doesn't keep the others from getting the buffers.
+	 */
 	for (unsigned int i = 0; i < ctx_priv->cmd_count; i++) {
-		struct sc_priv *sc_priv =
-			(struct sc_priv *)ctx_priv->sc[i]->priv;
-		size_t offset = 0;
+		struct sc_priv *sc_priv;
+		ssize_t n;
 
+		done[i] = len;
+		if (!(hosts & (1u << i)))
+			continue;
+
+		sc_priv = (struct sc_priv *)ctx_priv->sc[i]->priv;
 		if (!sc_priv->activated)
 			return -EBUSY;
 
-		while (offset < len) {
-			ssize_t written = write(
-				sc_priv->pipes[COMMAND].snd_pipe[PIPE_WRITE],
-				(const char *)buf + offset, len - offset);
-			if (written >= 0) {
-				offset += (size_t)written;
-			} else if (errno != EAGAIN) {
-				warn("Error while writing to socket");
-				return errno;
-			}
+		n = send_queue_put(&sc_priv->queue, iov, iovcnt, 0, false);
+		if (n < 0) {
+			warn("Error while writing to socket");
+			ret = errno;
+			continue;
 		}
+		done[i] = (size_t)n;
+		ctx_priv->cmd[i].rate.sent += len;
 	}
 
+	for (unsigned int i = 0; i < ctx_priv->cmd_count; i++) {
+		struct sc_priv *sc_priv;
+
+		if (done[i] == len)
+			continue;
+
+		sc_priv = (struct sc_priv *)ctx_priv->sc[i]->priv;
+		if (send_queue_put(&sc_priv->queue, iov, iovcnt, done[i],
+				   true) < 0) {
+			warn("Error while writing to host %u", i);
+			if (errno == ETIMEDOUT)
+				rvgpu_ctx_stalled(ctx_priv);
+			ret = errno;
+		}
+	}
+
+	return ret;
+}
+
+int rvgpu_ctx_send_stats(struct rvgpu_ctx *ctx, unsigned int host,
+			 struct rvgpu_send_stats *stats)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+
+	if (host >= ctx_priv->cmd_count || ctx_priv->cmd[host].queue == NULL)
+		return -1;
+
+	send_queue_stats(ctx_priv->cmd[host].queue, stats);
 	return 0;
 }
 
+void rvgpu_ctx_credit(struct rvgpu_ctx *ctx, unsigned int host,
+		      uint64_t limit)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+
+	if (host < ctx_priv->cmd_count && ctx_priv->cmd[host].queue)
+		send_queue_credit(ctx_priv->cmd[host].queue, limit);
+}
+
+/* Shorter intervals between rate samples are too noisy */
+#define LINK_SAMPLE_MIN_NS 10000000ll
+
+static size_t link_backlog(const struct vgpu_host *host)
+{
+	int fd = host->pfd ? host->pfd->fd : host->sock;
+	int piped = 0, queued = 0;
+
+	if (ioctl(host->host_p[PIPE_READ], FIONREAD, &piped) || piped < 0)
+		piped = 0;
+	if (fd < 0 || ioctl(fd, SIOCOUTQ, &queued) || queued < 0)
+		queued = 0;
+
+	/* Bytes still in the send queue are as good as in the pipe */
+	return (size_t)piped + (size_t)queued +
+	       (host->queue ? send_queue_len(host->queue) : 0);
+}
+
+static void link_sample(struct vgpu_host *host, const struct timespec *now)
+{
+	struct link_rate *r = &host->rate;
+	size_t backlog = link_backlog(host);
+	long long ns = (now->tv_sec - r->ts.tv_sec) * 1000000000ll +
+		       (now->tv_nsec - r->ts.tv_nsec);
+	uint64_t in, drained, bps;
+
+	if (r->ts.tv_sec != 0 && ns < LINK_SAMPLE_MIN_NS)
+		return;
+
+	in = r->backlog + (r->sent - r->sent_mark);
+	drained = (in > backlog) ? in - backlog : 0;
+
+	if (r->ts.tv_sec != 0 && ns > 0) {
+		bps = drained * 1000000000ull / (uint64_t)ns;
+		if (r->backlog > 0 || backlog > 0) {
+			/* Link was busy, the rate shows its capacity */
+			r->bps = r->bps ? (3 * r->bps + bps) / 4 : bps;
+		} else if (bps > r->bps) {
+			/* Idle link drains at least what it got */
+			r->bps = bps;
+		}
+	}
+
+	r->ts = *now;
+	r->backlog = backlog;
+	r->sent_mark = r->sent;
+}
+
+void rvgpu_ctx_link_rate(struct ctx_priv *ctx, uint64_t *bps,
+			 size_t *backlog)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	*bps = UINT64_MAX;
+	*backlog = 0;
+
+	for (unsigned int i = 0; i < ctx->cmd_count; i++) {
+		struct link_rate *r = &ctx->cmd[i].rate;
+		size_t queued;
+
+		link_sample(&ctx->cmd[i], &now);
+		if (r->bps < *bps)
+			*bps = r->bps;
+		/* Bytes sent since the sample are queued as far as known */
+		queued = r->backlog + (size_t)(r->sent - r->sent_mark);
+		if (queued > *backlog)
+			*backlog = queued;
+	}
+	if (*bps == UINT64_MAX)
+		*bps = 0;
+}
+
+uint32_t rvgpu_ctx_late_hosts(struct rvgpu_ctx *ctx)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	uint64_t ms = ctx_priv->args.latency_ms;
+	struct timespec now;
+	uint32_t late = 0;
+
+	if (ms == 0u)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (unsigned int i = 0; i < ctx_priv->cmd_count; i++) {
+		struct link_rate *r = &ctx_priv->cmd[i].rate;
+		uint64_t queued;
+
+		link_sample(&ctx_priv->cmd[i], &now);
+		queued = r->backlog + (r->sent - r->sent_mark);
+		/* Rate is not known before the link has been busy */
+		if (r->bps != 0u && queued * 1000u > r->bps * ms)
+			late |= 1u << i;
+	}
+	return late;
+}
+
+uint32_t rvgpu_ctx_features(struct rvgpu_ctx *ctx, uint32_t *gen)
+{
+	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
+	uint32_t hosts = (1u << ctx_priv->cmd_count) - 1u;
+	uint32_t features = 0;
+
+	*gen = atomic_load(&ctx_priv->reset_gen);
+	if (hosts == 0u)
+		return 0;
+
+	if ((atomic_load(&ctx_priv->lz_hosts) & hosts) == hosts)
+		features |= RVGPU_FEATURE_LZ;
+	if ((atomic_load(&ctx_priv->lossy_hosts) & hosts) == hosts)
+		features |= RVGPU_FEATURE_LOSSY;
+	if ((atomic_load(&ctx_priv->chunk_hosts) & hosts) == hosts)
+		features |= RVGPU_FEATURE_CHUNKS;
+	if ((atomic_load(&ctx_priv->cmd_cache_hosts) & hosts) == hosts)
+		features |= RVGPU_FEATURE_CMD_CACHE;
+
+	return features;
+}
+
+int rvgpu_ctx_sendv(struct rvgpu_ctx *ctx, const struct iovec *iov,
+		    int iovcnt)
+{
+	return rvgpu_ctx_sendv_hosts(ctx, iov, iovcnt, UINT32_MAX);
+}
+
+int rvgpu_ctx_send(struct rvgpu_ctx *ctx, const void *buf, size_t len)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = len,
+	};
+
+	return rvgpu_ctx_sendv(ctx, &iov, 1);
+}
+
 int rvgpu_recv_all(struct rvgpu_scanout *scanout, enum pipe_type p, void *buf,
 		   size_t len)
 {
@@ -164,6 +362,20 @@ int rvgpu_send(struct rvgpu_scanout *scanout, enum pipe_type p, const void *buf,
 	if (!sc_priv->activated)
 		return -EBUSY;
 
+	if (p == COMMAND) {
+		/*
+		 * Keep the order with the queued command stream. The queue is
+		 * dropped while a reset is pending, so this doesn't block the
+		 * reset.
+		 */
+		struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+		ssize_t n = send_queue_put(&sc_priv->queue, &iov, 1, 0, true);
+
+		if (n < 0 && errno == ETIMEDOUT)
+			rvgpu_ctx_stalled(sc_priv->ctx);
+		return (int)n;
+	}
+
 	int rc = write(sc_priv->pipes[p].snd_pipe[PIPE_WRITE], buf, len);
 	/*
 	 * During reset gpu procedure pipe may be full and since it's in
@@ -185,6 +397,7 @@ int rvgpu_init(struct rvgpu_ctx *ctx, struct rvgpu_scanout *scanout,
 
 	sc_priv->args = calloc(1, sizeof(args));
 	memcpy(sc_priv->args, &args, sizeof(args));
+	sc_priv->ctx = ctx_priv;
 	scanout->priv = sc_priv;
 	ctx_priv->sc[ctx_priv->inited_scanout_num] = scanout;
 
@@ -220,6 +433,9 @@ void rvgpu_destroy(struct rvgpu_ctx *ctx, struct rvgpu_scanout *scanout)
 {
 	(void)ctx;
 	if (scanout) {
+		struct sc_priv *sc_priv = (struct sc_priv *)scanout->priv;
+
+		send_queue_destroy(&sc_priv->queue);
 		free_communic_pipes(scanout);
 		free(scanout->priv);
 		scanout->priv = NULL;
@@ -304,12 +520,17 @@ int rvgpu_ctx_init(struct rvgpu_ctx *ctx, struct rvgpu_ctx_arguments args,
 		perror("pthread_mutex_init");
 		return -1;
 	}
+	if (pthread_rwlock_init(&ctx_priv->resources.lock, NULL)) {
+		perror("pthread_rwlock_init");
+		return -1;
+	}
 
 	ctx->priv = ctx_priv;
 	ctx->scanout_num = args.scanout_num;
 	ctx_priv->scanout_num = args.scanout_num;
 	ctx_priv->gpu_reset_cb = gpu_reset_cb;
 	memcpy(&ctx_priv->args, &args, sizeof(args));
+	atomic_init(&ctx_priv->ses_timer, -1);
 
 	if (pthread_create(&ctx_priv->tid, NULL, thread_conn_tcp, ctx)) {
 		perror("TCP thread creation error");
@@ -337,5 +558,12 @@ void rvgpu_ctx_destroy(struct rvgpu_ctx *ctx)
 		pthread_join(ctx_priv->tid, NULL);
 	}
 
+	rvgpu_ctx_res_destroy_all(ctx);
+	pthread_rwlock_destroy(&ctx_priv->resources.lock);
+	free(ctx_priv->lz.in);
+	free(ctx_priv->lz.out);
+	free(ctx_priv->lossy_buf);
+	chunk_cache_free(&ctx_priv->chunks);
+
 	/* Note: ctx_priv is freed by the caller (destroy_backend_rvgpu) */
 }
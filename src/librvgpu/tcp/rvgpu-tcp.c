@@ -37,6 +37,7 @@
 #include <pthread.h>
 
 #include <librvgpu/rvgpu-plugin.h>
+#include <librvgpu/rvgpu-protocol.h>
 #include <librvgpu/rvgpu.h>
 
 #include <rvgpu-utils/rvgpu-utils.h>
@@ -324,6 +325,14 @@ void rvgpu_ctx_wakeup(struct ctx_priv *ctx)
 	pthread_mutex_unlock(&ctx->reset.lock);
 }
 
+void rvgpu_ctx_stalled(struct ctx_priv *ctx)
+{
+	int fd = atomic_load(&ctx->ses_timer);
+
+	if (fd != -1)
+		set_timer(fd, 1);
+}
+
 static void disconnect(struct vgpu_host *vhost[], unsigned int cmd_cnt,
 		unsigned int res_cnt, unsigned int idx)
 {
@@ -341,6 +350,17 @@ static void disconnect(struct vgpu_host *vhost[], unsigned int cmd_cnt,
 	}
 }
 
+/*
+ * Nothing is sent until the hosts are reconnected, so senders must not
+ * wait for them: the proxy acknowledges the reset only once it is done
+ * sending.
+ */
+static void drop_queues(struct ctx_priv *ctx)
+{
+	for (unsigned int i = 0; i < ctx->cmd_count; i++)
+		send_queue_drop(ctx->cmd[i].queue);
+}
+
 static void process_reset_backend(struct rvgpu_ctx *ctx, enum reset_state state)
 {
 	struct ctx_priv *ctx_priv = (struct ctx_priv *)ctx->priv;
@@ -349,6 +369,97 @@ static void process_reset_backend(struct rvgpu_ctx *ctx, enum reset_state state)
 		ctx_priv->gpu_reset_cb(ctx, state);
 }
 
+/*
+ * Send the surface id and ask the renderer for the optional protocol
+ * features, if any are wanted. Returns the features accepted by the
+ * renderer.
+ */
+static uint32_t negotiate_features(int sock, const char *surface_id,
+				   uint32_t wanted, uint16_t timeo_s)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	struct rvgpu_features_req req = {
+		.magic = RVGPU_FEATURES_MAGIC,
+		.features = wanted,
+	};
+	size_t len = strlen(surface_id) + 1;
+	uint32_t accepted = 0;
+	char *buf;
+
+	if (wanted == 0) {
+		send_str_with_size(sock, surface_id);
+		return 0;
+	}
+
+	buf = malloc(len + sizeof(req));
+	if (buf == NULL)
+		err(1, "Failed to allocate features request");
+	memcpy(buf, surface_id, len);
+	memcpy(buf + len, &req, sizeof(req));
+	send_buf_with_size(sock, buf, (uint32_t)(len + sizeof(req)));
+	free(buf);
+
+	/* Renderers without features ignore the request and never answer */
+	if (poll(&pfd, 1, timeo_s * 1000) != 1 || !(pfd.revents & POLLIN)) {
+		warnx("No features reply from rvgpu-renderer");
+		return 0;
+	}
+
+	if (read_all(sock, &accepted, sizeof(accepted)) != sizeof(accepted))
+		return 0;
+
+	return accepted & wanted;
+}
+
+/*
+ * Introduce the proxy to the renderer serving a command connection: send
+ * the surface id and negotiate the protocol features. Done on every
+ * connection, the renderer forks a new process for each.
+ */
+static void handshake_host(struct ctx_priv *ctx_priv, unsigned int i)
+{
+	struct rvgpu_ctx_arguments *conn_args = &ctx_priv->args;
+	struct vgpu_host *host = &ctx_priv->cmd[i];
+	int sock = host->pfd ? host->pfd->fd : host->sock;
+	uint32_t bit = 1u << i, wanted = 0, features;
+
+	if (conn_args->patch_lz)
+		wanted |= RVGPU_FEATURE_LZ;
+	if (conn_args->lossy)
+		wanted |= RVGPU_FEATURE_LOSSY;
+	if (conn_args->chunks)
+		wanted |= RVGPU_FEATURE_CHUNKS;
+	if (conn_args->cmd_cache)
+		wanted |= RVGPU_FEATURE_CMD_CACHE;
+	if (conn_args->credits)
+		wanted |= RVGPU_FEATURE_CREDITS;
+
+	features = 0;
+	if (sock >= 0)
+		features = negotiate_features(sock, conn_args->rvgpu_surface_id,
+					      wanted, conn_args->conn_tmt_s);
+
+	if (features & RVGPU_FEATURE_LZ)
+		atomic_fetch_or(&ctx_priv->lz_hosts, bit);
+	else
+		atomic_fetch_and(&ctx_priv->lz_hosts, ~bit);
+	if (features & RVGPU_FEATURE_LOSSY)
+		atomic_fetch_or(&ctx_priv->lossy_hosts, bit);
+	else
+		atomic_fetch_and(&ctx_priv->lossy_hosts, ~bit);
+	if (features & RVGPU_FEATURE_CHUNKS)
+		atomic_fetch_or(&ctx_priv->chunk_hosts, bit);
+	else
+		atomic_fetch_and(&ctx_priv->chunk_hosts, ~bit);
+	if (features & RVGPU_FEATURE_CMD_CACHE)
+		atomic_fetch_or(&ctx_priv->cmd_cache_hosts, bit);
+	else
+		atomic_fetch_and(&ctx_priv->cmd_cache_hosts, ~bit);
+	send_queue_restart(host->queue, (features & RVGPU_FEATURE_CREDITS) ?
+						RVGPU_CREDIT_WINDOW :
+						UINT64_MAX);
+}
+
 static void handle_reset(struct rvgpu_ctx *ctx, struct vgpu_host *vhost[],
 		  unsigned int host_count)
 {
@@ -357,6 +468,10 @@ static void handle_reset(struct rvgpu_ctx *ctx, struct vgpu_host *vhost[],
 	rvgpu_ctx_wait(ctx_priv, GPU_RESET_INITIATED);
 
 	reconnect_all(vhost, host_count);
+	atomic_fetch_add(&ctx_priv->reset_gen, 1);
+	/* A new renderer process serves each connection */
+	for (unsigned int i = 0; i < ctx_priv->cmd_count; i++)
+		handshake_host(ctx_priv, i);
 
 	ctx_priv->reset.state = GPU_RESET_NONE;
 	if (ctx_priv->gpu_reset_cb)
@@ -384,7 +499,10 @@ static bool sessions_hung(struct ctx_priv *ctx, struct vgpu_host *vhost[],
 		if (vhost[i]->pfd) {
 			struct pollfd *host_pfd = vhost[i]->pfd;
 
-			if ((host_pfd->events & POLLOUT) &&
+			/* Stalled hosts have their send queue dropped */
+			if (((host_pfd->events & POLLOUT) ||
+			     (vhost[i]->queue &&
+			      send_queue_dropped(vhost[i]->queue))) &&
 			    (host_pfd->fd > 0)) {
 				disconnect(vhost, ctx->cmd_count,
 					   ctx->res_count, i);
@@ -467,6 +585,7 @@ static unsigned int set_pfd(struct ctx_priv *ctx, struct vgpu_host *vhost[],
 	/* Timer to detect hung sessions */
 	p_entry->ses_timer->fd = init_timer();
 	p_entry->ses_timer->events = POLLIN;
+	atomic_store(&ctx->ses_timer, p_entry->ses_timer->fd);
 
 	/* Timer to do the reconnection attempts */
 	p_entry->recon_timer->fd = init_timer();
@@ -640,10 +759,8 @@ void *thread_conn_tcp(void *arg)
 	connect_hosts(ctx_priv->res, ctx_priv->res_count,
 		      conn_args->conn_tmt_s);
 
-	for (int i = 0; i < ctx_priv->cmd_count; i++) {
-		send_str_with_size(ctx_priv->cmd[i].sock,
-				   conn_args->rvgpu_surface_id);
-	}
+	for (unsigned int i = 0; i < ctx_priv->cmd_count; i++)
+		handshake_host(ctx_priv, i);
 
 	pfd_count = set_pfd(ctx_priv, vhost, pfd, &p_entry);
 	assert(pfd_count < MAX_HOSTS * SOCKET_NUM);
@@ -671,6 +788,7 @@ void *thread_conn_tcp(void *arg)
 		if (p_entry.ses_timer->revents == POLLIN) {
 			if (sessions_hung(ctx_priv, vhost, &act_ses,
 					  host_count)) {
+				drop_queues(ctx_priv);
 				process_reset_backend(ctx, GPU_RESET_TRUE);
 				set_timer(p_entry.recon_timer->fd,
 					  conn_args->reconn_intv_ms);
@@ -698,6 +816,7 @@ void *thread_conn_tcp(void *arg)
 	for (unsigned int i = 0; i < ctx_priv->res_count; i++)
 		close(ctx_priv->res[i].sock);
 	close(p_entry.recon_timer->fd);
+	atomic_store(&ctx_priv->ses_timer, -1);
 	close(p_entry.ses_timer->fd);
 	close(devnull);
 	return NULL;
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <rvgpu-proxy/gpu/rvgpu-fence.h>
+
+int fence_ring_init(struct fence_ring *r, size_t size)
+{
+	size_t n = 1;
+
+	while (n < size)
+		n *= 2;
+
+	r->e = calloc(n, sizeof(*r->e));
+	if (!r->e)
+		return -1;
+
+	r->size = n;
+	r->head = r->tail = 0;
+	return 0;
+}
+
+void fence_ring_free(struct fence_ring *r)
+{
+	free(r->e);
+	r->e = NULL;
+	r->size = 0;
+	r->head = r->tail = 0;
+}
+
+static int fence_ring_grow(struct fence_ring *r)
+{
+	size_t len = r->tail - r->head;
+	struct fence_entry *e;
+
+	e = calloc(r->size * 2, sizeof(*e));
+	if (!e)
+		return -1;
+
+	for (size_t i = 0; i < len; i++)
+		e[i] = r->e[(r->head + i) & (r->size - 1)];
+
+	free(r->e);
+	r->e = e;
+	r->size *= 2;
+	r->head = 0;
+	r->tail = len;
+	return 0;
+}
+
+int fence_ring_push(struct fence_ring *r, const struct virtio_gpu_ctrl_hdr *hdr,
+		    struct vqueue_request *req)
+{
+	size_t mask, i;
+
+	if (r->tail - r->head == r->size && fence_ring_grow(r))
+		return -1;
+
+	mask = r->size - 1;
+	for (i = r->tail; i != r->head; i--) {
+		struct fence_entry *prev = &r->e[(i - 1) & mask];
+
+		if (prev->hdr.fence_id <= hdr->fence_id)
+			break;
+
+		r->e[i & mask] = *prev;
+	}
+	memcpy(&r->e[i & mask].hdr, hdr, sizeof(*hdr));
+	r->e[i & mask].req = req;
+	r->tail++;
+	return 0;
+}
@@ -20,6 +20,7 @@
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,7 @@
 #include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/timerfd.h>
 #include <sys/utsname.h>
 
@@ -49,7 +51,9 @@
 #include <rvgpu-generic/rvgpu-capset.h>
 #include <rvgpu-generic/rvgpu-sanity.h>
 #include <rvgpu-proxy/gpu/rvgpu-gpu-device.h>
+#include <rvgpu-utils/rvgpu-chunk.h>
 #include <rvgpu-utils/rvgpu-utils.h>
+#include <rvgpu-proxy/gpu/rvgpu-fence.h>
 #include <rvgpu-proxy/gpu/rvgpu-iov.h>
 #include <rvgpu-proxy/gpu/rvgpu-map-guest.h>
 #include <rvgpu-proxy/gpu/rvgpu-vqueue.h>
@@ -138,13 +142,129 @@ struct cmd {
 	TAILQ_ENTRY(cmd) cmds;
 };
 
+/*
+ * Fenced requests are kept in a ring ordered by fence id, so completion
+ * only looks at the head. The resource thread publishes the completed
+ * fence id and wakes the main loop through an eventfd.
+ */
 struct async_resp {
-	TAILQ_HEAD(, cmd) async_cmds;
-	int fence_pipe[2];
+	struct fence_ring fences; /**< requests waiting for fences */
+	TAILQ_HEAD(, cmd) async_cmds; /**< requests waiting for vsync */
+	TAILQ_HEAD(, cmd) free_cmds; /**< recycled entries for add_resp */
+	int fence_fd; /**< eventfd signalled on fence completion */
+	_Atomic uint32_t completed_fence; /**< fence id completed by hosts */
+	uint32_t served_fence; /**< completed fence id last processed */
+};
+
+/*
+ * Commands of several virtqueue requests are collected and written to the
+ * hosts with a single vectored send. Responses to requests whose data is
+ * still referenced by the batch are held back until the batch is sent.
+ */
+#define GPU_BATCH_MAX_REQS 64u
+#define GPU_BATCH_MAX_IOVS 1024u
+
+struct gpu_batch {
+	struct rvgpu_header hdrs[GPU_BATCH_MAX_REQS];
+	/* Commands of replayed command buffers, indexed like hdrs */
+	struct virtio_gpu_cmd_submit submits[GPU_BATCH_MAX_REQS];
+	struct iovec iov[GPU_BATCH_MAX_IOVS];
+	unsigned int nhdrs;
+	unsigned int niov;
+
+	struct {
+		struct vqueue_request *req;
+		struct virtio_gpu_ctrl_hdr resp;
+	} pending[GPU_BATCH_MAX_REQS];
+	unsigned int npending;
+};
+
+/*
+ * TRANSFER_TO_HOST_2D commands are not sent right away. Their boxes are
+ * merged per resource and sent when the next other command, e.g. the
+ * RESOURCE_FLUSH, or a fenced command arrives, or when the queue runs
+ * empty. Responses are held until then, so the guest does not change the
+ * backing before it is read.
+ */
+#define GPU_PENDING_MAX_RES 8u
+#define GPU_PENDING_MAX_RECTS 8u
+
+struct gpu_pending_res {
+	uint32_t resid;
+	unsigned int nrects;
+	struct rvgpu_res_rect rects[GPU_PENDING_MAX_RECTS];
+};
+
+struct gpu_pending {
+	struct gpu_pending_res res[GPU_PENDING_MAX_RES];
+	unsigned int nres;
+	struct vqueue_request *reqs[GPU_BATCH_MAX_REQS]; /**< to respond to */
+	unsigned int nreqs;
+};
+
+/*
+ * Mirror of the renderer command buffer cache: the command buffer last
+ * stored in each slot. The slot is picked by the hash of the command
+ * buffer, storing a command buffer replaces the previous one.
+ */
+#define CMD_CACHE_MIN_SIZE 256u
+
+struct cmd_cache_slot {
+	uint64_t hash; /**< XXH64 of the command buffer */
+	uint32_t size; /**< size of the command buffer, 0 if empty */
+};
+
+struct cmd_cache {
+	struct cmd_cache_slot slots[RVGPU_CMD_CACHE_SLOTS];
+	uint32_t gen; /**< connection generation the slots belong to */
+	uint8_t buf[RVGPU_CMD_CACHE_MAX_SIZE]; /**< gathered command buffer */
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long saved; /**< bytes not sent thanks to hits */
+};
+
+/*
+ * A fence is complete when the hosts of the fence policy have reported it:
+ * every host, the primary one or any quorum of hosts. Hosts more than
+ * evict_lag fences behind the fastest one are not waited for until they
+ * catch up with the completed fence.
+ */
+struct fence_sync {
+	uint32_t ids[MAX_HOSTS]; /**< last fence id reported by each host */
+	bool reported[MAX_HOSTS]; /**< host has reported since the last reset */
+	bool evicted[MAX_HOSTS]; /**< host is not waited for */
+	uint32_t max_lag[MAX_HOSTS]; /**< most fences behind the fastest host */
+	unsigned int evictions[MAX_HOSTS];
+	unsigned int nhosts;
+	unsigned int policy; /**< enum fence_policy */
+	unsigned int quorum; /**< hosts needed by FENCE_POLICY_QUORUM */
+	uint32_t evict_lag; /**< 0 to always wait for every host */
+	uint32_t completed; /**< last signalled fence id */
+	bool signalled;
+};
+
+/*
+ * Page faults taken while accessing resource backing during transfers
+ */
+struct fault_stats {
+	uint64_t transfers;
+	uint64_t minflt;
+	uint64_t majflt;
+};
+
+/*
+ * Fault statistics of one resource, kept while the resource exists
+ */
+struct res_faults {
+	uint32_t resid;
+	struct fault_stats to_host;
+	struct fault_stats from_host;
+	LIST_ENTRY(res_faults) entry;
 };
 
 struct gpu_device {
 	int lo_fd;
+	struct map_guest_cache *map_cache;
 	int config_fd;
 	int kick_fd;
 
@@ -158,8 +278,26 @@ struct gpu_device {
 	size_t curr_mem;
 	const struct gpu_device_params *params;
 
+	/* Busy polling statistics */
+	unsigned long long poll_hits;
+	unsigned long long poll_sleeps;
+
+	/* Per-resource fault statistics and their totals */
+	LIST_HEAD(, res_faults) res_faults;
+	pthread_mutex_t res_faults_lock; /**< transfers run on two threads */
+	struct fault_stats to_host;
+	struct fault_stats from_host;
+
 	uint32_t scanres;
 	uint32_t scan_id;
+	/* Resource shown on each scanout, 0 if disabled */
+	uint32_t scanout_res[VIRTIO_GPU_MAX_SCANOUTS];
+	/* Box of the resource shown on each scanout */
+	struct virtio_gpu_rect scanout_box[VIRTIO_GPU_MAX_SCANOUTS];
+	/* Box of the resource being sent shown by each host */
+	struct rvgpu_res_rect clip[MAX_HOSTS];
+	/* Expires when scanouts sent lossy have not been updated for a while */
+	int refresh_fd;
 
 	unsigned int idx;
 	struct gpu_capdata capdata[GPU_MAX_CAPDATA];
@@ -172,6 +310,10 @@ struct gpu_device {
 	struct vqueue vq[2];
 	struct rvgpu_backend *backend;
 	struct async_resp *async_resp;
+	struct gpu_batch batch;
+	struct gpu_pending pending;
+	struct cmd_cache cmd_cache;
+	struct fence_sync fence_sync; /**< owned by the resource thread */
 };
 
 static inline uint64_t bit64(unsigned int shift)
@@ -233,6 +375,18 @@ static int rvgpu_init_ctx(struct rvgpu_backend *b, struct rvgpu_ctx_arguments ct
 		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_res_create);
 		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_res_find);
 		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_res_destroy);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_features);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_late_hosts);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_send_stats);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_credit);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_chunk_miss);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_sendv);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_sendv_hosts);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_res_get);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_res_put);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_res_lossy);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_res_behind);
+		GPU_BE_FIND_SYMBOL_OR_FAIL(v1, rvgpu_ctx_res_set_behind);
 		break;
 	default:
 		err(1, "unsupported backend version: %u", version);
@@ -277,6 +431,13 @@ struct rvgpu_backend *init_backend_rvgpu(struct host_conn *servers)
 		.reconn_intv_ms = servers->reconn_intv_ms,
 		.scanout_num = servers->host_cnt,
 		.rvgpu_surface_id = servers->rvgpu_surface_id,
+		.res_shadow = servers->res_shadow,
+		.patch_lz = servers->patch_lz,
+		.lossy = servers->lossy,
+		.chunks = servers->chunks,
+		.cmd_cache = servers->cmd_cache,
+		.credits = servers->credits,
+		.latency_ms = servers->latency_ms,
 	};
 
 	if (rvgpu_init_ctx(rvgpu_be, ctx_args)) {
@@ -324,12 +485,109 @@ void destroy_backend_rvgpu(struct rvgpu_backend *b)
 	dlclose(b->lib_handle);
 }
 
+static void fault_stats_start(const struct gpu_device *g, struct rusage *ru)
+{
+	if (g->params->fault_stats)
+		getrusage(RUSAGE_THREAD, ru);
+}
+
+/* Find the statistics of a resource, called with res_faults_lock held */
+static struct res_faults *res_faults_get(struct gpu_device *g, uint32_t resid)
+{
+	struct res_faults *rf;
+
+	LIST_FOREACH(rf, &g->res_faults, entry) {
+		if (rf->resid == resid)
+			return rf;
+	}
+
+	rf = calloc(1, sizeof(*rf));
+	if (rf) {
+		rf->resid = resid;
+		LIST_INSERT_HEAD(&g->res_faults, rf, entry);
+	}
+	return rf;
+}
+
+/**
+ * @brief Account page faults taken by the calling thread since start
+ * @param g - pointer to gpu device structure
+ * @param ru - usage recorded by fault_stats_start
+ * @param resid - resource transferred
+ * @param to_host - transfer to host, else from host
+ */
+static void fault_stats_end(struct gpu_device *g, const struct rusage *ru,
+			    uint32_t resid, bool to_host)
+{
+	struct fault_stats *total = to_host ? &g->to_host : &g->from_host;
+	struct res_faults *rf;
+	struct rusage now;
+	uint64_t minflt, majflt;
+
+	if (!g->params->fault_stats)
+		return;
+
+	getrusage(RUSAGE_THREAD, &now);
+	minflt = (uint64_t)(now.ru_minflt - ru->ru_minflt);
+	majflt = (uint64_t)(now.ru_majflt - ru->ru_majflt);
+
+	pthread_mutex_lock(&g->res_faults_lock);
+	rf = res_faults_get(g, resid);
+	if (rf) {
+		struct fault_stats *fs = to_host ? &rf->to_host :
+						   &rf->from_host;
+
+		fs->transfers++;
+		fs->minflt += minflt;
+		fs->majflt += majflt;
+	}
+	total->transfers++;
+	total->minflt += minflt;
+	total->majflt += majflt;
+	pthread_mutex_unlock(&g->res_faults_lock);
+}
+
+static void fault_stats_print(const char *name,
+			      const struct fault_stats *to_host,
+			      const struct fault_stats *from_host)
+{
+	info("%s: to host %llu transfers, %llu minor, %llu major faults; "
+	     "from host %llu transfers, %llu minor, %llu major faults\n",
+	     name, (unsigned long long)to_host->transfers,
+	     (unsigned long long)to_host->minflt,
+	     (unsigned long long)to_host->majflt,
+	     (unsigned long long)from_host->transfers,
+	     (unsigned long long)from_host->minflt,
+	     (unsigned long long)from_host->majflt);
+}
+
 static void gpu_device_free_res(struct gpu_device *g, struct rvgpu_res *res)
 {
 	for (unsigned int i = 0; i < res->nbacking; i++) {
-		unmap_guest(res->backing[i].iov_base, res->backing[i].iov_len);
+		map_guest_release(g->map_cache, res->backing[i].iov_base);
 		g->curr_mem -= res->backing[i].iov_len;
 	}
+
+	if (g->params->fault_stats) {
+		struct res_faults *rf;
+
+		pthread_mutex_lock(&g->res_faults_lock);
+		LIST_FOREACH(rf, &g->res_faults, entry) {
+			if (rf->resid == res->resid)
+				break;
+		}
+		if (rf)
+			LIST_REMOVE(rf, entry);
+		pthread_mutex_unlock(&g->res_faults_lock);
+
+		if (rf) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "resource %u", rf->resid);
+			fault_stats_print(name, &rf->to_host, &rf->from_host);
+			free(rf);
+		}
+	}
 }
 
 static void gpu_capset_init(struct gpu_device *g, int capset)
@@ -361,21 +619,22 @@ done:
 	g->config.num_capsets = i;
 }
 
+static void release_cmd(struct async_resp *r, struct cmd *cmd)
+{
+	TAILQ_REMOVE(&r->async_cmds, cmd, cmds);
+	TAILQ_INSERT_HEAD(&r->free_cmds, cmd, cmds);
+}
+
 size_t process_fences(struct gpu_device *g, uint32_t fence_id)
 {
 	struct async_resp *r = g->async_resp;
-	struct cmd *cmd;
+	struct fence_entry *e;
 	size_t processed = 0;
 
-	TAILQ_FOREACH(cmd, &r->async_cmds, cmds)
-	{
-		if ((cmd->hdr.fence_id > fence_id) ||
-		    (cmd->hdr.flags & VIRTIO_GPU_FLAG_VSYNC))
-			continue;
-
-		vqueue_send_response(cmd->req, &cmd->hdr, sizeof(cmd->hdr));
-		TAILQ_REMOVE(&r->async_cmds, cmd, cmds);
-		free(cmd);
+	while ((e = fence_ring_peek(&r->fences)) != NULL &&
+	       e->hdr.fence_id <= fence_id) {
+		vqueue_send_response(e->req, &e->hdr, sizeof(e->hdr));
+		fence_ring_pop(&r->fences);
 		processed++;
 	}
 
@@ -388,8 +647,19 @@ void add_resp(struct gpu_device *g, struct virtio_gpu_ctrl_hdr *hdr,
 	struct async_resp *r = g->async_resp;
 	struct cmd *cmd;
 
-	cmd = (struct cmd *)calloc(1, sizeof(*cmd));
-	assert(cmd);
+	if (!(hdr->flags & VIRTIO_GPU_FLAG_VSYNC)) {
+		if (fence_ring_push(&r->fences, hdr, req))
+			err(1, "fence ring allocation");
+		return;
+	}
+
+	cmd = TAILQ_FIRST(&r->free_cmds);
+	if (cmd) {
+		TAILQ_REMOVE(&r->free_cmds, cmd, cmds);
+	} else {
+		cmd = (struct cmd *)calloc(1, sizeof(*cmd));
+		assert(cmd);
+	}
 
 	memcpy(&cmd->hdr, hdr, sizeof(*hdr));
 	cmd->req = req;
@@ -400,14 +670,24 @@ void add_resp(struct gpu_device *g, struct virtio_gpu_ctrl_hdr *hdr,
 void destroy_async_resp(struct gpu_device *g)
 {
 	struct async_resp *r = g->async_resp;
+	struct cmd *cmd;
 
-	close(r->fence_pipe[PIPE_READ]);
-	close(r->fence_pipe[PIPE_WRITE]);
+	while ((cmd = TAILQ_FIRST(&r->async_cmds)) != NULL) {
+		TAILQ_REMOVE(&r->async_cmds, cmd, cmds);
+		free(cmd);
+	}
+	while ((cmd = TAILQ_FIRST(&r->free_cmds)) != NULL) {
+		TAILQ_REMOVE(&r->free_cmds, cmd, cmds);
+		free(cmd);
+	}
+
+	fence_ring_free(&r->fences);
+	close(r->fence_fd);
 
 	free(r);
 }
 
-static struct async_resp *init_async_resp(void)
+static struct async_resp *init_async_resp(unsigned int queue_size)
 {
 	struct async_resp *r;
 
@@ -415,9 +695,15 @@ static struct async_resp *init_async_resp(void)
 	assert(r);
 
 	TAILQ_INIT(&r->async_cmds);
+	TAILQ_INIT(&r->free_cmds);
+
+	if (fence_ring_init(&r->fences, queue_size))
+		err(1, "fence ring allocation");
 
-	if (pipe(r->fence_pipe) == -1)
-		err(1, "pipe creation error");
+	r->fence_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->fence_fd == -1)
+		err(1, "eventfd creation error");
+	atomic_init(&r->completed_fence, 0);
 
 	return r;
 }
@@ -459,6 +745,386 @@ static void gpu_device_send_command(struct rvgpu_backend *u, void *buf,
 	}
 }
 
+/**
+ * @brief Send a buffer to some hosts
+ * @param g - pointer to gpu device structure
+ * @param buf - buffer to send
+ * @param size - size of the buffer
+ * @param hosts - mask of hosts
+ */
+static void gpu_device_send_hosts(struct gpu_device *g, const void *buf,
+				  size_t size, uint32_t hosts)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = size };
+
+	if (b->plugin_v1.ops.rvgpu_ctx_sendv_hosts(&b->plugin_v1.ctx, &iov, 1,
+						   hosts))
+		warn("short write");
+}
+
+static uint32_t gpu_device_all_hosts(struct gpu_device *g)
+{
+	return (1u << g->backend->plugin_v1.ctx.scanout_num) - 1u;
+}
+
+/**
+ * @brief Get the hosts showing any of the scanouts
+ * @param g - pointer to gpu device structure
+ * @param scanouts - mask of scanouts
+ * @return mask of hosts
+ */
+static uint32_t gpu_device_scanout_hosts(struct gpu_device *g,
+					 uint32_t scanouts)
+{
+	uint32_t hosts = 0;
+
+	for (unsigned int i = 0; i < g->backend->plugin_v1.ctx.scanout_num;
+	     i++) {
+		uint32_t shown = g->params->host_scanouts[i];
+
+		if (shown == 0 || (shown & scanouts))
+			hosts |= 1u << i;
+	}
+	return hosts;
+}
+
+/* Check if a resource is shown on a scanout */
+static bool gpu_device_res_shown(struct gpu_device *g, uint32_t resid)
+{
+	for (unsigned int i = 0; i < VIRTIO_GPU_MAX_SCANOUTS; i++) {
+		if (resid != 0 && g->scanout_res[i] == resid)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Get the hosts which need the contents of a resource
+ * @param g - pointer to gpu device structure
+ * @param resid - resource
+ * @return mask of hosts showing the resource, all hosts if it is not shown
+ *	   on a scanout
+ */
+static uint32_t gpu_device_res_hosts(struct gpu_device *g, uint32_t resid)
+{
+	uint32_t scanouts = 0;
+
+	for (unsigned int i = 0; i < VIRTIO_GPU_MAX_SCANOUTS; i++) {
+		if (resid != 0 && g->scanout_res[i] == resid)
+			scanouts |= 1u << i;
+	}
+	if (scanouts == 0)
+		return gpu_device_all_hosts(g);
+	return gpu_device_scanout_hosts(g, scanouts);
+}
+
+/* Hosts left out of the 2D updates of a resource */
+static uint32_t gpu_device_skip_hosts(struct gpu_device *g, uint32_t resid)
+{
+	return gpu_device_all_hosts(g) & ~gpu_device_res_hosts(g, resid);
+}
+
+/**
+ * @brief Get the box of a resource each host shows on a video wall
+ * @param g - pointer to gpu device structure
+ * @param resid - resource
+ * @return boxes indexed by host, NULL if all hosts show all of it
+ */
+static const struct rvgpu_res_rect *gpu_device_res_clip(struct gpu_device *g,
+							uint32_t resid)
+{
+	bool clipped = false;
+
+	for (unsigned int h = 0; h < g->backend->plugin_v1.ctx.scanout_num;
+	     h++) {
+		const struct virtio_gpu_rect *reg = &g->params->host_regions[h];
+		uint32_t shown = g->params->host_scanouts[h];
+
+		g->clip[h] = (struct rvgpu_res_rect){ 0, 0, UINT32_MAX,
+						      UINT32_MAX };
+		if (reg->width == 0)
+			continue;
+		for (unsigned int i = 0; i < VIRTIO_GPU_MAX_SCANOUTS; i++) {
+			const struct virtio_gpu_rect *box = &g->scanout_box[i];
+
+			if (resid == 0 || g->scanout_res[i] != resid ||
+			    (shown != 0 && !(shown & (1u << i))))
+				continue;
+			g->clip[h] = (struct rvgpu_res_rect){
+				box->x + reg->x, box->y + reg->y, reg->width,
+				reg->height
+			};
+			clipped = true;
+			break;
+		}
+	}
+	return clipped ? g->clip : NULL;
+}
+
+/**
+ * @brief Copy the box of a resource each host shows
+ * @param g - pointer to gpu device structure
+ * @param resid - resource
+ * @param clip - filled with the boxes indexed by host
+ */
+static void gpu_device_res_clip_copy(struct gpu_device *g, uint32_t resid,
+				     struct rvgpu_res_rect *clip)
+{
+	const struct rvgpu_res_rect *c = gpu_device_res_clip(g, resid);
+
+	for (unsigned int h = 0; h < g->backend->plugin_v1.ctx.scanout_num;
+	     h++) {
+		clip[h] = c ? c[h] :
+			      (struct rvgpu_res_rect){ 0, 0, UINT32_MAX,
+						       UINT32_MAX };
+	}
+}
+
+/**
+ * @brief Get the hosts a control command is for
+ * @param g - pointer to gpu device structure
+ * @param cmd - sane control command
+ * @return mask of hosts
+ *
+ * Display updates only go to the hosts showing them, everything else is
+ * state all hosts need.
+ */
+static uint32_t gpu_device_cmd_hosts(struct gpu_device *g,
+				     const union virtio_gpu_cmd_head *cmd)
+{
+	switch (cmd->hdr.type) {
+	case VIRTIO_GPU_CMD_SET_SCANOUT:
+		return gpu_device_scanout_hosts(g,
+						1u << cmd->s_set.scanout_id);
+	case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
+		return gpu_device_res_hosts(g, cmd->r_flush.resource_id);
+	case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+		return gpu_device_res_hosts(g, cmd->t_2h2d.resource_id);
+	default:
+		return gpu_device_all_hosts(g);
+	}
+}
+
+/**
+ * @brief Send batched commands to all hosts and release held responses
+ * @param g - pointer to gpu device structure
+ */
+static void gpu_batch_flush(struct gpu_device *g)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct gpu_batch *bt = &g->batch;
+
+	if (bt->niov > 0) {
+		if (b->plugin_v1.ops.rvgpu_ctx_sendv(&b->plugin_v1.ctx,
+						     bt->iov, (int)bt->niov))
+			warn("short write");
+	}
+
+	for (unsigned int i = 0; i < bt->npending; i++) {
+		struct vqueue_request *req = bt->pending[i].req;
+
+		vqueue_send_response(req, &bt->pending[i].resp,
+				     sizeof(bt->pending[i].resp));
+	}
+
+	bt->nhdrs = 0;
+	bt->niov = 0;
+	bt->npending = 0;
+}
+
+/**
+ * @brief Queue command of the request for sending to all hosts
+ * @param g - pointer to gpu device structure
+ * @param hdr - rvgpu header of the command
+ * @param req - request holding the command
+ */
+static void gpu_batch_add(struct gpu_device *g, const struct rvgpu_header *hdr,
+			  struct vqueue_request *req)
+{
+	struct gpu_batch *bt = &g->batch;
+
+	if (bt->nhdrs == GPU_BATCH_MAX_REQS ||
+	    bt->niov + req->nr + 1 > GPU_BATCH_MAX_IOVS)
+		gpu_batch_flush(g);
+
+	if (req->nr + 1 > GPU_BATCH_MAX_IOVS) {
+		struct rvgpu_backend *b = g->backend;
+
+		/* Too long to be batched, send it right away */
+		gpu_device_send_command(b, (void *)hdr, sizeof(*hdr), true);
+		if (b->plugin_v1.ops.rvgpu_ctx_sendv(&b->plugin_v1.ctx, req->r,
+						     (int)req->nr))
+			warn("short write");
+		return;
+	}
+
+	bt->hdrs[bt->nhdrs] = *hdr;
+	bt->iov[bt->niov].iov_base = &bt->hdrs[bt->nhdrs];
+	bt->iov[bt->niov].iov_len = sizeof(*hdr);
+	bt->nhdrs++;
+	bt->niov++;
+
+	memcpy(&bt->iov[bt->niov], req->r, req->nr * sizeof(struct iovec));
+	bt->niov += req->nr;
+}
+
+/**
+ * @brief Queue command of the request for sending to some hosts
+ * @param g - pointer to gpu device structure
+ * @param hdr - rvgpu header of the command
+ * @param req - request holding the command
+ * @param ctrl - virtio header of the command
+ * @param hosts - mask of hosts the command is for
+ *
+ * The other hosts get a fenced command replaced by a no-op carrying the
+ * fence, so that all hosts keep signalling every fence.
+ */
+static void gpu_batch_add_routed(struct gpu_device *g,
+				 const struct rvgpu_header *hdr,
+				 struct vqueue_request *req,
+				 const struct virtio_gpu_ctrl_hdr *ctrl,
+				 uint32_t hosts)
+{
+	struct rvgpu_backend *b = g->backend;
+	uint32_t others = gpu_device_all_hosts(g) & ~hosts;
+	struct {
+		struct rvgpu_header hdr;
+		struct virtio_gpu_ctrl_hdr ctrl;
+	} nop = { 0 };
+
+	if (others == 0) {
+		gpu_batch_add(g, hdr, req);
+		return;
+	}
+
+	gpu_batch_flush(g);
+	if (hosts != 0) {
+		gpu_device_send_hosts(g, hdr, sizeof(*hdr), hosts);
+		if (b->plugin_v1.ops.rvgpu_ctx_sendv_hosts(
+			    &b->plugin_v1.ctx, req->r, (int)req->nr, hosts))
+			warn("short write");
+	}
+	if (ctrl->flags & VIRTIO_GPU_FLAG_FENCE) {
+		nop.hdr.size = sizeof(nop.ctrl);
+		nop.ctrl = *ctrl;
+		nop.ctrl.type = VIRTIO_GPU_CMD_GET_DISPLAY_INFO;
+		gpu_device_send_hosts(g, &nop, sizeof(nop), others);
+	}
+}
+
+/**
+ * @brief Queue a command replaying a cached command buffer
+ * @param g - pointer to gpu device structure
+ * @param hdr - rvgpu header of the command
+ * @param submit - command without its command buffer
+ */
+static void gpu_batch_add_replay(struct gpu_device *g,
+				 const struct rvgpu_header *hdr,
+				 const struct virtio_gpu_cmd_submit *submit)
+{
+	struct gpu_batch *bt = &g->batch;
+
+	if (bt->nhdrs == GPU_BATCH_MAX_REQS ||
+	    bt->niov + 2 > GPU_BATCH_MAX_IOVS)
+		gpu_batch_flush(g);
+
+	bt->hdrs[bt->nhdrs] = *hdr;
+	bt->submits[bt->nhdrs] = *submit;
+	bt->iov[bt->niov].iov_base = &bt->hdrs[bt->nhdrs];
+	bt->iov[bt->niov].iov_len = sizeof(*hdr);
+	bt->iov[bt->niov + 1].iov_base = &bt->submits[bt->nhdrs];
+	bt->iov[bt->niov + 1].iov_len = sizeof(*submit);
+	bt->nhdrs++;
+	bt->niov += 2;
+}
+
+/**
+ * @brief Look the command buffer of a SUBMIT_3D up in the command cache
+ *
+ * On a miss the command buffer is stored in its slot and the header is
+ * flagged so that the renderers store it too.
+ *
+ * @param g - pointer to gpu device structure
+ * @param req - request holding the command
+ * @param size - size of the command buffer
+ * @param hdr - rvgpu header of the command, updated for the cache
+ * @return true if the command buffer can be replayed from the cache
+ */
+static bool gpu_device_cmd_cache(struct gpu_device *g,
+				 struct vqueue_request *req, uint32_t size,
+				 struct rvgpu_header *hdr)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct cmd_cache *cc = &g->cmd_cache;
+	struct cmd_cache_slot *slot;
+	struct iov_cursor c;
+	uint32_t features, gen;
+	uint64_t hash;
+
+	features = b->plugin_v1.ops.rvgpu_ctx_features(&b->plugin_v1.ctx, &gen);
+	if (!(features & RVGPU_FEATURE_CMD_CACHE))
+		return false;
+
+	if (cc->gen != gen) {
+		/* Renderers lost their caches on reconnection */
+		memset(cc->slots, 0, sizeof(cc->slots));
+		cc->gen = gen;
+	}
+
+	if (size < CMD_CACHE_MIN_SIZE || size > RVGPU_CMD_CACHE_MAX_SIZE)
+		return false;
+
+	iov_cursor_init(&c, req->r, req->nr);
+	iov_cursor_skip(&c, sizeof(struct virtio_gpu_cmd_submit));
+	if (iov_cursor_read(&c, cc->buf, size) != size)
+		return false;
+
+	hash = chunk_hash(cc->buf, size);
+	slot = &cc->slots[hash % RVGPU_CMD_CACHE_SLOTS];
+	hdr->idx = (uint16_t)(hash % RVGPU_CMD_CACHE_SLOTS);
+
+	if (slot->hash == hash && slot->size == size) {
+		hdr->flags |= RVGPU_CMD_REPLAY;
+		hdr->size = sizeof(struct virtio_gpu_cmd_submit);
+		cc->hits++;
+		cc->saved += size;
+		return true;
+	}
+
+	slot->hash = hash;
+	slot->size = size;
+	hdr->flags |= RVGPU_CMD_STORE;
+	cc->misses++;
+	return false;
+}
+
+/**
+ * @brief Respond to the request once its command has left the batch
+ * @param g - pointer to gpu device structure
+ * @param req - request to respond to
+ * @param resp - response buffer
+ * @param resp_len - size of response buffer
+ */
+static void gpu_batch_respond(struct gpu_device *g, struct vqueue_request *req,
+			      void *resp, size_t resp_len)
+{
+	struct gpu_batch *bt = &g->batch;
+
+	if (bt->niov > 0 && resp_len == sizeof(struct virtio_gpu_ctrl_hdr) &&
+	    bt->npending < GPU_BATCH_MAX_REQS) {
+		bt->pending[bt->npending].req = req;
+		memcpy(&bt->pending[bt->npending].resp, resp, resp_len);
+		bt->npending++;
+		return;
+	}
+
+	if (bt->niov > 0)
+		gpu_batch_flush(g);
+
+	vqueue_send_response(req, resp, resp_len);
+}
+
 static void read_from_pipe(struct rvgpu_scanout *s, char *buf, size_t size)
 {
 	size_t offset = 0;
@@ -503,6 +1169,7 @@ static void resource_transfer(struct gpu_device *g, struct rvgpu_scanout *s)
 	struct rvgpu_patch patch = {0, 0, 0};
 	struct virtio_gpu_transfer_host_3d t;
 	struct rvgpu_res *res;
+	struct rusage ru;
 
 	read_from_pipe(s, (char *)&header, sizeof(header));
 
@@ -512,14 +1179,20 @@ static void resource_transfer(struct gpu_device *g, struct rvgpu_scanout *s)
 	read_from_pipe(s, (char *)&t, sizeof(t));
 	read_from_pipe(s, (char *)&patch, sizeof(patch));
 
-	res = g->backend->plugin_v1.ops.rvgpu_ctx_res_find(
+	/* The control queue may destroy the resource meanwhile */
+	res = g->backend->plugin_v1.ops.rvgpu_ctx_res_get(
 	    &g->backend->plugin_v1.ctx, t.resource_id);
 
 	if (!res || !res->backing) {
 		fprintf(stderr, "insufficient resource id %d, res %p\n",
 			t.resource_id, res);
+		if (res)
+			g->backend->plugin_v1.ops.rvgpu_ctx_res_put(
+				&g->backend->plugin_v1.ctx, res);
 		return;
 	}
+
+	fault_stats_start(g, &ru);
 	if (t.box.w == res->info.width && t.box.h == res->info.height) {
 		resource_update(s, res->backing, res->nbacking, patch.offset,
 		patch.len);
@@ -534,7 +1207,7 @@ static void resource_transfer(struct gpu_device *g, struct rvgpu_scanout *s)
 		char *res_data = malloc(patch.len);
 		if (!res_data) {
 			fprintf(stderr, "failed to allocate memory for resource transfer\n");
-			return;
+			goto out;
 		}
 		read_from_pipe(s, res_data, patch.len);
 
@@ -572,16 +1245,178 @@ static void resource_transfer(struct gpu_device *g, struct rvgpu_scanout *s)
 				}
 			}
 
-			if (line_len > 0u) {
-				fprintf(stderr,
-					"resource_transfer: backing too small for resource %u (missing %zu bytes)\n",
-					t.resource_id, line_len);
-				free(res_data);
-				return;
-			}
-		}
-		free(res_data);
+			if (line_len > 0u) {
+				fprintf(stderr,
+					"resource_transfer: backing too small for resource %u (missing %zu bytes)\n",
+					t.resource_id, line_len);
+				free(res_data);
+				goto out;
+			}
+		}
+		free(res_data);
+	}
+out:
+	fault_stats_end(g, &ru, res->resid, false);
+	g->backend->plugin_v1.ops.rvgpu_ctx_res_put(&g->backend->plugin_v1.ctx,
+						    res);
+}
+
+static void fence_sync_init(struct fence_sync *fs,
+			    const struct gpu_device_params *params,
+			    unsigned int nhosts)
+{
+	memset(fs, 0, sizeof(*fs));
+	fs->nhosts = nhosts;
+	fs->policy = params->fence_policy;
+	fs->quorum = params->fence_quorum;
+	fs->evict_lag = params->fence_evict_lag;
+}
+
+/* Track the lag of each host behind the fastest one */
+static void fence_sync_lag(struct fence_sync *fs)
+{
+	uint32_t newest = 0;
+
+	for (unsigned int j = 0; j < fs->nhosts; j++) {
+		if (fs->reported[j] && fs->ids[j] > newest)
+			newest = fs->ids[j];
+	}
+
+	for (unsigned int j = 0; j < fs->nhosts; j++) {
+		uint32_t lag = newest - fs->ids[j];
+
+		if (!fs->reported[j])
+			continue;
+		if (lag > fs->max_lag[j])
+			fs->max_lag[j] = lag;
+		if (fs->evict_lag == 0 || fs->policy == FENCE_POLICY_PRIMARY)
+			continue;
+
+		if (!fs->evicted[j] && lag > fs->evict_lag) {
+			fs->evicted[j] = true;
+			fs->evictions[j]++;
+			warnx("host %u is %u fences behind, not waiting for it",
+			      j, lag);
+		} else if (fs->evicted[j] && fs->signalled &&
+			   fs->ids[j] >= fs->completed) {
+			fs->evicted[j] = false;
+			warnx("host %u caught up with the fences", j);
+		}
+	}
+}
+
+/**
+ * @brief Record fence reported by host and recompute completed fence
+ * @param fs - fence synchronization state
+ * @param host - index of the reporting host
+ * @param fence_id - fence id reported by the host
+ * @retval true if completed fence id has changed
+ */
+static bool fence_sync_update(struct fence_sync *fs, unsigned int host,
+			      uint32_t fence_id)
+{
+	uint32_t ids[MAX_HOSTS];
+	unsigned int n = 0, need;
+
+	if (fs->reported[host] && fence_id < fs->ids[host]) {
+		/* Fence ids start over, wait for the new ones of every host */
+		memset(fs->reported, 0, sizeof(fs->reported));
+		memset(fs->evicted, 0, sizeof(fs->evicted));
+	}
+	fs->reported[host] = true;
+	fs->ids[host] = fence_id;
+	fence_sync_lag(fs);
+
+	if (fs->policy == FENCE_POLICY_PRIMARY) {
+		if (!fs->reported[0])
+			return false;
+		ids[n++] = fs->ids[0];
+		need = 1;
+	} else {
+		unsigned int counted = 0;
+
+		for (unsigned int j = 0; j < fs->nhosts; j++) {
+			if (fs->evicted[j])
+				continue;
+			counted++;
+			if (fs->reported[j])
+				ids[n++] = fs->ids[j];
+		}
+		need = counted;
+		if (fs->policy == FENCE_POLICY_QUORUM && fs->quorum < need)
+			need = fs->quorum;
+	}
+	if (need == 0 || n < need)
+		return false;
+
+	/* The need-th newest fence has been reached by need hosts */
+	for (unsigned int i = 1; i < n; i++) {
+		uint32_t id = ids[i];
+		unsigned int j = i;
+
+		for (; j > 0 && ids[j - 1] < id; j--)
+			ids[j] = ids[j - 1];
+		ids[j] = id;
+	}
+
+	if (fs->signalled && ids[need - 1] == fs->completed)
+		return false;
+
+	fs->completed = ids[need - 1];
+	fs->signalled = true;
+	return true;
+}
+
+static void signal_fence(struct async_resp *r, uint32_t fence_id)
+{
+	uint64_t ev = 1;
+
+	atomic_store_explicit(&r->completed_fence, fence_id,
+			      memory_order_release);
+	if (write(r->fence_fd, &ev, sizeof(ev)) != sizeof(ev))
+		warn("write error to fence eventfd");
+}
+
+/**
+ * @brief Pass the credit granted by a host to its send queue
+ * @param g - pointer to gpu device structure
+ * @param host - index of the host
+ */
+static void resource_credit(struct gpu_device *g, unsigned int host)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct rvgpu_scanout *s = &b->plugin_v1.scanout[host];
+	struct rvgpu_credit credit;
+
+	if (s->plugin_v1.ops.rvgpu_recv_all(s, RESOURCE, &credit,
+					    sizeof(credit)) !=
+	    (int)sizeof(credit)) {
+		warnx("short credit message from host %u", host);
+		return;
+	}
+	b->plugin_v1.ops.rvgpu_ctx_credit(&b->plugin_v1.ctx, host,
+					  credit.limit);
+}
+
+/**
+ * @brief Have a resource resent after a host missed a chunk of it
+ * @param g - pointer to gpu device structure
+ * @param host - host that sent the miss
+ */
+static void resource_chunk_miss(struct gpu_device *g, unsigned int host)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct rvgpu_scanout *s = &b->plugin_v1.scanout[host];
+	struct rvgpu_chunk_miss miss;
+
+	if (s->plugin_v1.ops.rvgpu_recv_all(s, RESOURCE, &miss,
+					    sizeof(miss)) != (int)sizeof(miss)) {
+		warnx("short chunk miss message from host %u", host);
+		return;
 	}
+	warnx("host %u missed a chunk of resource %u, resending it", host,
+	      miss.resid);
+	b->plugin_v1.ops.rvgpu_ctx_chunk_miss(&b->plugin_v1.ctx, miss.resid);
 }
 
 static void *resource_thread_func(void *param)
@@ -591,14 +1426,9 @@ static void *resource_thread_func(void *param)
 	struct rvgpu_backend *b = g->backend;
 	struct rvgpu_res_message_header msg;
 	short int revents[MAX_HOSTS];
+	struct fence_sync *fs = &g->fence_sync;
 
-	uint32_t recv_fence_ids[b->plugin_v1.ctx.scanout_num];
-	int recv_fence_flags[b->plugin_v1.ctx.scanout_num];
-
-	for (int i = 0; i < b->plugin_v1.ctx.scanout_num; i++) {
-		recv_fence_ids[i] = 0;
-		recv_fence_flags[i] = 0;
-	}
+	fence_sync_init(fs, g->params, b->plugin_v1.ctx.scanout_num);
 
 	while (!g->resource_thread_shutdown) {
 		/*
@@ -623,32 +1453,16 @@ static void *resource_thread_func(void *param)
 				(void)ret;
 
 				if (msg.type == RVGPU_FENCE) {
-					recv_fence_flags[i] = 1;
-					uint32_t sync_fence_id = msg.fence_id;
-					int recv_scanout_id = i;
-					recv_fence_ids[i] = msg.fence_id;
-					for (int j = 0;
-					     j < b->plugin_v1.ctx.scanout_num;
-					     j++) {
-						if (sync_fence_id >
-						    recv_fence_ids[j]) {
-							sync_fence_id =
-								recv_fence_ids[j];
-							recv_scanout_id = j;
-						}
-					}
-
-					if (recv_fence_flags[recv_scanout_id] ==
-					    1) {
-						ret = write_all(
-							r->fence_pipe[PIPE_WRITE],
-							&sync_fence_id,
-							sizeof(sync_fence_id));
-						assert(ret >= 0);
-					}
+					if (fence_sync_update(fs, i,
+							      msg.fence_id))
+						signal_fence(r, fs->completed);
 				} else if (msg.type == RVGPU_RES_TRANSFER) {
 					resource_transfer(
 					    g, &b->plugin_v1.scanout[i]);
+				} else if (msg.type == RVGPU_CREDIT) {
+					resource_credit(g, i);
+				} else if (msg.type == RVGPU_CHUNK_MISS) {
+					resource_chunk_miss(g, i);
 				}
 			}
 		}
@@ -789,8 +1603,14 @@ struct gpu_device *gpu_device_init(int lo_fd, int efd, int capset,
 		.device_id = VIRTIO_ID_GPU,
 		.vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET + virtual_card_num,
 		.config_size = sizeof(struct virtio_gpu_config),
-		.features =
-			bit64(VIRTIO_GPU_F_VIRGL) | bit64(VIRTIO_F_VERSION_1),
+		/*
+		 * VIRTIO_RING_F_EVENT_IDX is not offered: virtio-lo does not
+		 * tell the device whether the driver accepted it, so the
+		 * queues use the flag-based notification suppression.
+		 */
+		.features = bit64(VIRTIO_GPU_F_VIRGL) |
+			    bit64(VIRTIO_F_VERSION_1) |
+			    bit64(VIRTIO_RING_F_INDIRECT_DESC),
 	};
 	if (params->framerate)
 		info.features |= bit64(VIRTIO_GPU_F_VSYNC);
@@ -802,6 +1622,12 @@ struct gpu_device *gpu_device_init(int lo_fd, int efd, int capset,
 	}
 	g->params = params;
 	g->lo_fd = lo_fd;
+	LIST_INIT(&g->res_faults);
+	pthread_mutex_init(&g->res_faults_lock, NULL);
+	g->map_cache = map_guest_cache_init(lo_fd);
+	if (!g->map_cache)
+		err(1, "guest mapping cache");
+	map_guest_cache_set_policy(g->map_cache, params->backing_policy);
 	g->config_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 	g->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 	g->config.num_scanouts = params->num_scanouts;
@@ -814,7 +1640,7 @@ struct gpu_device *gpu_device_init(int lo_fd, int efd, int capset,
 
 	for (i = 0u; i < 2u; i++) {
 		q[i].kickfd = g->kick_fd;
-		q[i].size = 1024u;
+		q[i].size = params->queue_size;
 	}
 	if (ioctl(lo_fd, VIRTIO_LO_ADDDEV, &info))
 		err(1, "add virtio-lo-device");
@@ -834,6 +1660,9 @@ struct gpu_device *gpu_device_init(int lo_fd, int efd, int capset,
 			(struct vring_used *)map_guest(lo_fd, q[i].used,
 						       PROT_READ | PROT_WRITE,
 						       q[i].size * 8u + 6u);
+		vqueue_init_state(&g->vq[i], false);
+		if (vqueue_init_pool(&g->vq[i]))
+			err(1, "virtqueue request pool");
 	}
 
 #ifdef VSYNC_ENABLE
@@ -862,8 +1691,16 @@ struct gpu_device *gpu_device_init(int lo_fd, int efd, int capset,
 		  &(struct epoll_event){ .events = EPOLLIN,
 					 .data = { .u32 = PROXY_GPU_QUEUES } });
 
-	g->async_resp = init_async_resp();
-	epoll_ctl(efd, EPOLL_CTL_ADD, g->async_resp->fence_pipe[PIPE_READ],
+	g->refresh_fd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	if (g->refresh_fd == -1)
+		err(1, "timerfd_create");
+	epoll_ctl(efd, EPOLL_CTL_ADD, g->refresh_fd,
+		  &(struct epoll_event){ .events = EPOLLIN,
+					 .data = { .u32 = PROXY_GPU_QUEUES } });
+
+	g->async_resp = init_async_resp(params->queue_size);
+	epoll_ctl(efd, EPOLL_CTL_ADD, g->async_resp->fence_fd,
 		  &(struct epoll_event){ .events = EPOLLIN,
 					 .data = { .u32 = PROXY_GPU_QUEUES } });
 
@@ -891,6 +1728,7 @@ void gpu_device_flush_pending(struct gpu_device *g)
 	 */
 	const int wait_between_passes_us = 50000;
 	struct async_resp *r = g->async_resp;
+	struct fence_entry *e;
 	struct cmd *cmd;
 
 	/*
@@ -913,7 +1751,21 @@ void gpu_device_flush_pending(struct gpu_device *g)
 		flushed_this_pass = 0;
 		pass++;
 
-		/* Flush async commands (fence-waiting requests) */
+		/* Flush fence-waiting requests */
+		while ((e = fence_ring_peek(&r->fences)) != NULL) {
+			struct virtio_gpu_ctrl_hdr resp = {
+				.type = VIRTIO_GPU_RESP_OK_NODATA,
+				.flags = e->hdr.flags,
+				.fence_id = e->hdr.fence_id,
+				.ctx_id = e->hdr.ctx_id,
+			};
+			vqueue_send_response(e->req, &resp, sizeof(resp));
+			fence_ring_pop(&r->fences);
+			kick_ctrl++;
+			flushed_this_pass++;
+		}
+
+		/* Flush async commands (vsync-waiting requests) */
 		while ((cmd = TAILQ_FIRST(&r->async_cmds)) != NULL) {
 			struct virtio_gpu_ctrl_hdr resp = {
 				.type = VIRTIO_GPU_RESP_OK_NODATA,
@@ -922,8 +1774,7 @@ void gpu_device_flush_pending(struct gpu_device *g)
 				.ctx_id = cmd->hdr.ctx_id,
 			};
 			vqueue_send_response(cmd->req, &resp, sizeof(resp));
-			TAILQ_REMOVE(&r->async_cmds, cmd, cmds);
-			free(cmd);
+			release_cmd(r, cmd);
 			kick_ctrl++;
 			flushed_this_pass++;
 		}
@@ -941,7 +1792,7 @@ void gpu_device_flush_pending(struct gpu_device *g)
 					.ctx_id = 0,
 				};
 
-				req = vqueue_get_request(g->lo_fd, q);
+				req = vqueue_get_request(g->map_cache, q);
 				if (!req)
 					break;
 
@@ -958,6 +1809,8 @@ void gpu_device_flush_pending(struct gpu_device *g)
 		total_flushed += flushed_this_pass;
 
 		/* Notify the kernel driver about completed requests */
+		vqueue_flush_used(&g->vq[0]);
+		vqueue_flush_used(&g->vq[1]);
 		if (kick_ctrl) {
 			struct virtio_lo_kick k = { .idx = g->idx, .qidx = 0 };
 			ioctl(g->lo_fd, VIRTIO_LO_KICK, &k);
@@ -997,8 +1850,9 @@ void gpu_device_flush_pending(struct gpu_device *g)
 					has_pending = true;
 			}
 
-			/* Also check async_cmds */
-			if (!TAILQ_EMPTY(&r->async_cmds))
+			/* Also check async responses */
+			if (!TAILQ_EMPTY(&r->async_cmds) ||
+			    !fence_ring_empty(&r->fences))
 				has_pending = true;
 
 			if (has_pending) {
@@ -1008,14 +1862,23 @@ void gpu_device_flush_pending(struct gpu_device *g)
 					.type = VIRTIO_GPU_RESP_OK_NODATA,
 				};
 
+				while ((e = fence_ring_peek(&r->fences)) !=
+				       NULL) {
+					resp.flags = e->hdr.flags;
+					resp.fence_id = e->hdr.fence_id;
+					resp.ctx_id = e->hdr.ctx_id;
+					vqueue_send_response(e->req, &resp,
+							     sizeof(resp));
+					fence_ring_pop(&r->fences);
+				}
+
 				while ((cmd = TAILQ_FIRST(&r->async_cmds)) != NULL) {
 					resp.flags = cmd->hdr.flags;
 					resp.fence_id = cmd->hdr.fence_id;
 					resp.ctx_id = cmd->hdr.ctx_id;
 					vqueue_send_response(cmd->req, &resp,
 							     sizeof(resp));
-					TAILQ_REMOVE(&r->async_cmds, cmd, cmds);
-					free(cmd);
+					release_cmd(r, cmd);
 				}
 
 				for (i = 0; i < 2; i++) {
@@ -1023,7 +1886,7 @@ void gpu_device_flush_pending(struct gpu_device *g)
 
 					while (vqueue_are_requests_available(q)) {
 						struct vqueue_request *req =
-							vqueue_get_request(g->lo_fd,
+							vqueue_get_request(g->map_cache,
 									   q);
 						if (!req)
 							break;
@@ -1034,6 +1897,8 @@ void gpu_device_flush_pending(struct gpu_device *g)
 				}
 
 				/* Notify kernel */
+				vqueue_flush_used(&g->vq[0]);
+				vqueue_flush_used(&g->vq[1]);
 				struct virtio_lo_kick k = {
 					.idx = g->idx, .qidx = 0
 				};
@@ -1049,6 +1914,25 @@ void gpu_device_flush_pending(struct gpu_device *g)
 	}
 }
 
+static void gpu_device_print_send_stats(struct gpu_device *g)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct rvgpu_send_stats st;
+
+	for (unsigned int i = 0; i < b->plugin_v1.ctx.scanout_num; i++) {
+		if (b->plugin_v1.ops.rvgpu_ctx_send_stats(&b->plugin_v1.ctx, i,
+							  &st) ||
+		    st.queued == 0u)
+			continue;
+		info("host %u: %llu bytes sent directly, %llu queued, "
+		     "%zu queued at most, %llu stalls, %llu credit waits\n",
+		     i, (unsigned long long)st.direct,
+		     (unsigned long long)st.queued, st.peak,
+		     (unsigned long long)st.stalls,
+		     (unsigned long long)st.credit_waits);
+	}
+}
+
 void gpu_device_free(struct gpu_device *g)
 {
 	unsigned int i;
@@ -1069,13 +1953,43 @@ void gpu_device_free(struct gpu_device *g)
 		unmap_guest(vr->desc, vr->num * 16u);
 		unmap_guest(vr->avail, vr->num * 2u + 6u);
 		unmap_guest(vr->used, vr->num * 8u + 6u);
+		vqueue_free_pool(&g->vq[i]);
+	}
+	map_guest_cache_free(g->map_cache);
+
+	if (g->params->fault_stats)
+		fault_stats_print("total", &g->to_host, &g->from_host);
+	while (!LIST_EMPTY(&g->res_faults)) {
+		struct res_faults *rf = LIST_FIRST(&g->res_faults);
+
+		LIST_REMOVE(rf, entry);
+		free(rf);
+	}
+	pthread_mutex_destroy(&g->res_faults_lock);
+	if (g->params->poll_us)
+		info("busy poll: %llu hits, %llu sleeps\n", g->poll_hits,
+		     g->poll_sleeps);
+	if (g->cmd_cache.hits + g->cmd_cache.misses > 0u)
+		info("command cache: %llu hits, %llu misses (%llu%%), "
+		     "%llu bytes saved\n",
+		     g->cmd_cache.hits, g->cmd_cache.misses,
+		     g->cmd_cache.hits * 100u /
+			     (g->cmd_cache.hits + g->cmd_cache.misses),
+		     g->cmd_cache.saved);
+	for (i = 0u; i < g->fence_sync.nhosts; i++) {
+		if (g->fence_sync.max_lag[i] == 0u)
+			continue;
+		info("host %u: up to %u fences behind, evicted %u times\n",
+		     i, g->fence_sync.max_lag[i], g->fence_sync.evictions[i]);
 	}
+	gpu_device_print_send_stats(g);
 
 #ifdef VSYNC_ENABLE
 	close(g->vsync_fd);
 #endif
 	close(g->config_fd);
 	close(g->kick_fd);
+	close(g->refresh_fd);
 
 	if (g->backend)
 		destroy_backend_rvgpu(g->backend);
@@ -1135,21 +2049,296 @@ static unsigned int gpu_device_destroy_res(struct gpu_device *g,
 	if (res == NULL)
 		return VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
 
+	for (unsigned int i = 0; i < VIRTIO_GPU_MAX_SCANOUTS; i++) {
+		if (g->scanout_res[i] == resid)
+			g->scanout_res[i] = 0;
+	}
 	gpu_device_free_res(g, res);
 	b->plugin_v1.ops.rvgpu_ctx_res_destroy(&b->plugin_v1.ctx, resid);
 	return VIRTIO_GPU_RESP_OK_NODATA;
 }
 
 static void gpu_device_send_patched(struct gpu_device *g,
-				    const struct rvgpu_res *res,
+				    struct rvgpu_res *res,
 				    const struct rvgpu_res_transfer *t)
 {
 	struct rvgpu_backend *b = g->backend;
+	struct rvgpu_res_transfer st = *t;
+	struct rusage ru;
+
+	if (gpu_device_res_shown(g, res->resid))
+		st.flags |= RVGPU_TRANSFER_SCANOUT;
 
-	if (b->plugin_v1.ops.rvgpu_ctx_transfer_to_host(&b->plugin_v1.ctx, t,
+	/* Patches must follow the command they belong to */
+	gpu_batch_flush(g);
+	fault_stats_start(g, &ru);
+	if (b->plugin_v1.ops.rvgpu_ctx_transfer_to_host(&b->plugin_v1.ctx, &st,
 							res)) {
 		warn("short write");
 	}
+	fault_stats_end(g, &ru, res->resid, true);
+}
+
+/* Scanouts sent lossy are resent lossless after this long without updates */
+#define LOSSY_REFRESH_MS 100u
+
+/* Scanouts skipped for late hosts are checked this often for a catch up */
+#define CATCHUP_MS 16u
+
+static void gpu_device_arm_refresh(struct gpu_device *g)
+{
+	struct itimerspec ts = {
+		.it_value = { .tv_nsec = LOSSY_REFRESH_MS * 1000000L },
+	};
+
+	if (timerfd_settime(g->refresh_fd, 0, &ts, NULL) == -1)
+		warn("Failed to set refresh timer");
+}
+
+/* Unlike the lossy refresh, the catch up is not postponed by updates */
+static void gpu_device_arm_catchup(struct gpu_device *g)
+{
+	struct itimerspec ts = {
+		.it_value = { .tv_nsec = CATCHUP_MS * 1000000L },
+	};
+	struct itimerspec cur;
+
+	if (timerfd_gettime(g->refresh_fd, &cur) == 0 &&
+	    (cur.it_value.tv_sec != 0 || cur.it_value.tv_nsec != 0) &&
+	    cur.it_value.tv_sec == 0 &&
+	    cur.it_value.tv_nsec <= ts.it_value.tv_nsec)
+		return;
+
+	if (timerfd_settime(g->refresh_fd, 0, &ts, NULL) == -1)
+		warn("Failed to set refresh timer");
+}
+
+/**
+ * @brief Arm the refresh timer for a scanout that needs a resend
+ * @param g - pointer to gpu device structure
+ * @param res - resource just sent
+ */
+static void gpu_device_arm_scanout(struct gpu_device *g,
+				   const struct rvgpu_res *res)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct rvgpu_res_rect lossy, behind;
+	uint32_t hosts;
+
+	if (!gpu_device_res_shown(g, res->resid))
+		return;
+	b->plugin_v1.ops.rvgpu_ctx_res_lossy(&b->plugin_v1.ctx, res, &lossy);
+	if (lossy.w != 0)
+		gpu_device_arm_refresh(g);
+	hosts = b->plugin_v1.ops.rvgpu_ctx_res_behind(&b->plugin_v1.ctx, res,
+						      &behind);
+	if (behind.w != 0 && (hosts & gpu_device_res_hosts(g, res->resid)))
+		gpu_device_arm_catchup(g);
+}
+
+/**
+ * @brief Have the hosts which show another box of a resource than before
+ *	  get all of it with the next catch up
+ * @param g - pointer to gpu device structure
+ * @param resid - resource
+ * @param before - boxes of the resource each host showed before
+ *
+ * Transfers only reach the hosts showing the transferred box, so the
+ * rest of the resource may be stale on a host.
+ */
+static void gpu_device_reclip(struct gpu_device *g, uint32_t resid,
+			      const struct rvgpu_res_rect *before)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct rvgpu_res_rect after[MAX_HOSTS];
+	struct rvgpu_res *res;
+	uint32_t hosts = 0;
+
+	if (resid == 0)
+		return;
+	res = b->plugin_v1.ops.rvgpu_ctx_res_find(&b->plugin_v1.ctx, resid);
+	if (!res)
+		return;
+
+	gpu_device_res_clip_copy(g, resid, after);
+	for (unsigned int h = 0; h < b->plugin_v1.ctx.scanout_num; h++) {
+		if (memcmp(&before[h], &after[h], sizeof(after[h])) != 0)
+			hosts |= 1u << h;
+	}
+	hosts &= gpu_device_res_hosts(g, resid);
+	b->plugin_v1.ops.rvgpu_ctx_res_set_behind(&b->plugin_v1.ctx, res,
+						  hosts);
+}
+
+/**
+ * @brief Track the resource shown on a scanout
+ * @param g - pointer to gpu device structure
+ * @param scanout_id - scanout
+ * @param resid - resource shown on it, 0 to disable the scanout
+ * @param r - box of the resource shown on it
+ */
+static void gpu_device_set_scanout(struct gpu_device *g, uint32_t scanout_id,
+				   uint32_t resid,
+				   const struct virtio_gpu_rect *r)
+{
+	struct rvgpu_backend *b = g->backend;
+	uint32_t old = g->scanout_res[scanout_id];
+	struct rvgpu_res_rect before[2][MAX_HOSTS];
+	struct rvgpu_res *res;
+
+	gpu_device_res_clip_copy(g, old, before[0]);
+	gpu_device_res_clip_copy(g, resid, before[1]);
+	g->scanout_res[scanout_id] = resid;
+	g->scanout_box[scanout_id] = *r;
+	if (old != resid)
+		gpu_device_reclip(g, old, before[0]);
+	gpu_device_reclip(g, resid, before[1]);
+	if (resid != 0) {
+		res = b->plugin_v1.ops.rvgpu_ctx_res_find(&b->plugin_v1.ctx,
+							  resid);
+		/* Hosts left out so far get it on the next catch up */
+		if (res)
+			gpu_device_arm_scanout(g, res);
+	}
+}
+
+static uint64_t rect_area(const struct rvgpu_res_rect *r)
+{
+	return (uint64_t)r->w * r->h;
+}
+
+static struct rvgpu_res_rect rect_bound(const struct rvgpu_res_rect *a,
+					const struct rvgpu_res_rect *b)
+{
+	uint32_t x0 = a->x < b->x ? a->x : b->x;
+	uint32_t y0 = a->y < b->y ? a->y : b->y;
+	uint32_t x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+	uint32_t y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+
+	return (struct rvgpu_res_rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+/**
+ * @brief Send a 2D transfer of a box as if the guest did it
+ * @param g - pointer to gpu device structure
+ * @param res - resource with backing
+ * @param r - box to transfer
+ * @param flags - flags of the transfer (enum rvgpu_transfer_flags)
+ */
+static void gpu_device_send_2d(struct gpu_device *g, struct rvgpu_res *res,
+			       const struct rvgpu_res_rect *r, uint32_t flags)
+{
+	int bpp = get_format_bpp(res->info.format);
+	uint32_t hosts = gpu_device_res_hosts(g, res->resid);
+	uint64_t offset;
+	struct {
+		struct rvgpu_header hdr;
+		struct virtio_gpu_transfer_to_host_2d t;
+	} xfer = { 0 };
+
+	if (bpp <= 0)
+		return;
+	offset = ((uint64_t)r->y * res->info.width + r->x) * (uint64_t)bpp;
+
+	xfer.hdr.size = sizeof(xfer.t);
+	xfer.t.hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
+	xfer.t.r = (struct virtio_gpu_rect){ r->x, r->y, r->w, r->h };
+	xfer.t.offset = offset;
+	xfer.t.resource_id = res->resid;
+
+	gpu_batch_flush(g);
+	gpu_device_send_hosts(g, &xfer, sizeof(xfer), hosts);
+	gpu_device_send_patched(g, res,
+				&(struct rvgpu_res_transfer){
+					.x = r->x,
+					.y = r->y,
+					.w = r->w,
+					.h = r->h,
+					.d = 1,
+					.offset = offset,
+					.flags = flags,
+					.skip_hosts = gpu_device_all_hosts(g) &
+						      ~hosts,
+					.clip = gpu_device_res_clip(g,
+								    res->resid),
+				});
+}
+
+/**
+ * @brief Resend the parts of a scanout sent lossy in full quality and the
+ *	  parts skipped for hosts that fell behind
+ * @param g - pointer to gpu device structure
+ * @param res - scanout resource
+ * @param lossy - bounding box of the parts sent lossy
+ * @param behind - bounding box of the parts skipped for late hosts
+ *
+ * Transfer and flush of the box are sent as if the guest did them.
+ */
+static void gpu_device_refresh_res(struct gpu_device *g, struct rvgpu_res *res,
+				   const struct rvgpu_res_rect *lossy,
+				   const struct rvgpu_res_rect *behind)
+{
+	struct rvgpu_res_rect r;
+	uint32_t flags = 0;
+	struct {
+		struct rvgpu_header hdr;
+		struct virtio_gpu_resource_flush f;
+	} flush = { 0 };
+
+	if (lossy->w != 0 && behind->w != 0) {
+		r = rect_bound(lossy, behind);
+		flags = RVGPU_TRANSFER_LOSSLESS | RVGPU_TRANSFER_CATCHUP;
+	} else if (lossy->w != 0) {
+		r = *lossy;
+		flags = RVGPU_TRANSFER_LOSSLESS;
+	} else {
+		r = *behind;
+		flags = RVGPU_TRANSFER_CATCHUP;
+	}
+
+	flush.hdr.size = sizeof(flush.f);
+	flush.f.hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
+	flush.f.r = (struct virtio_gpu_rect){ r.x, r.y, r.w, r.h };
+	flush.f.resource_id = res->resid;
+
+	gpu_device_send_2d(g, res, &r, flags);
+	gpu_device_send_hosts(g, &flush, sizeof(flush),
+			      gpu_device_res_hosts(g, res->resid));
+}
+
+static void gpu_device_serve_refresh(struct gpu_device *g)
+{
+	struct rvgpu_backend *b = g->backend;
+	uint64_t expired;
+	uint32_t late, hosts;
+
+	if (read(g->refresh_fd, &expired, sizeof(expired)) != sizeof(expired))
+		return;
+
+	late = b->plugin_v1.ops.rvgpu_ctx_late_hosts(&b->plugin_v1.ctx);
+	for (unsigned int i = 0; i < VIRTIO_GPU_MAX_SCANOUTS; i++) {
+		struct rvgpu_res_rect lossy, behind;
+		struct rvgpu_res *res;
+
+		if (g->scanout_res[i] == 0)
+			continue;
+		res = b->plugin_v1.ops.rvgpu_ctx_res_find(&b->plugin_v1.ctx,
+							  g->scanout_res[i]);
+		if (!res || !res->backing)
+			continue;
+
+		/* Hosts not showing the resource catch up once they do */
+		b->plugin_v1.ops.rvgpu_ctx_res_lossy(&b->plugin_v1.ctx, res,
+						     &lossy);
+		hosts = b->plugin_v1.ops.rvgpu_ctx_res_behind(&b->plugin_v1.ctx,
+							      res, &behind);
+		hosts &= gpu_device_res_hosts(g, res->resid);
+		if (lossy.w != 0 || (behind.w != 0 && (hosts & ~late)))
+			gpu_device_refresh_res(g, res, &lossy, &behind);
+		/* Hosts still late are checked again */
+		if (behind.w != 0 && hosts)
+			gpu_device_arm_catchup(g);
+	}
 }
 
 static unsigned int gpu_device_send_res(struct gpu_device *g,
@@ -1167,13 +2356,231 @@ static unsigned int gpu_device_send_res(struct gpu_device *g,
 		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
 
 	gpu_device_send_patched(g, res, t);
+	gpu_device_arm_scanout(g, res);
 
 	return VIRTIO_GPU_RESP_OK_NODATA;
 }
 
+/*
+ * Boxes are merged if they touch or overlap and their bounding box holds
+ * no other pixels, e.g. one contains the other or they share an edge.
+ * Pixels the guest did not transfer may not be up to date in the backing.
+ */
+static bool rect_mergeable(const struct rvgpu_res_rect *a,
+			   const struct rvgpu_res_rect *b)
+{
+	struct rvgpu_res_rect u;
+	uint64_t iw = 0, ih = 0;
+
+	if (a->x > b->x + b->w || b->x > a->x + a->w || a->y > b->y + b->h ||
+	    b->y > a->y + a->h)
+		return false;
+
+	u = rect_bound(a, b);
+	if (a->w + b->w > u.w)
+		iw = a->w + b->w - u.w;
+	if (a->h + b->h > u.h)
+		ih = a->h + b->h - u.h;
+	return rect_area(&u) == rect_area(a) + rect_area(b) - iw * ih;
+}
+
+static bool rect_overlap(const struct rvgpu_res_rect *a,
+			 const struct rvgpu_res_rect *b)
+{
+	return a->x < b->x + b->w && b->x < a->x + a->w &&
+	       a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+/*
+ * Split the parts of r outside of the overlapping box q into up to four
+ * boxes: the bands above and below q and the parts left and right of it.
+ * Returns the number of boxes stored to out.
+ */
+static unsigned int rect_subtract(const struct rvgpu_res_rect *r,
+				  const struct rvgpu_res_rect *q,
+				  struct rvgpu_res_rect out[4])
+{
+	uint32_t y0 = r->y > q->y ? r->y : q->y;
+	uint32_t y1 = r->y + r->h < q->y + q->h ? r->y + r->h : q->y + q->h;
+	unsigned int n = 0;
+
+	if (q->y > r->y)
+		out[n++] = (struct rvgpu_res_rect){ r->x, r->y, r->w,
+						    q->y - r->y };
+	if (q->y + q->h < r->y + r->h)
+		out[n++] = (struct rvgpu_res_rect){ r->x, q->y + q->h, r->w,
+						    r->y + r->h - q->y - q->h };
+	if (q->x > r->x)
+		out[n++] = (struct rvgpu_res_rect){ r->x, y0, q->x - r->x,
+						    y1 - y0 };
+	if (q->x + q->w < r->x + r->w)
+		out[n++] = (struct rvgpu_res_rect){ q->x + q->w, y0,
+						    r->x + r->w - q->x - q->w,
+						    y1 - y0 };
+	return n;
+}
+
+/* Most boxes left to place while a box is added */
+#define GPU_PENDING_MAX_SPLIT 32u
+
+/*
+ * Add a box to the pending ones of a resource. Parts of it that overlap a
+ * pending box which it can't be merged with are cut off, so no pixel is
+ * sent twice. Returns false, leaving the pending boxes as they were, if
+ * there is no room left for it.
+ */
+static bool gpu_pending_merge(struct gpu_pending_res *p,
+			      struct rvgpu_res_rect r)
+{
+	struct rvgpu_res_rect todo[GPU_PENDING_MAX_SPLIT];
+	struct gpu_pending_res n = *p;
+	unsigned int ntodo = 0;
+
+	todo[ntodo++] = r;
+	while (ntodo > 0) {
+		unsigned int i = 0;
+
+		r = todo[--ntodo];
+		/* A merged box may reach boxes that were kept apart so far */
+		while (i < n.nrects) {
+			if (rect_mergeable(&n.rects[i], &r)) {
+				r = rect_bound(&n.rects[i], &r);
+				n.rects[i] = n.rects[--n.nrects];
+				i = 0;
+			} else {
+				i++;
+			}
+		}
+
+		for (i = 0; i < n.nrects; i++) {
+			if (rect_overlap(&n.rects[i], &r))
+				break;
+		}
+		if (i < n.nrects) {
+			if (ntodo + 4u > GPU_PENDING_MAX_SPLIT)
+				return false;
+			ntodo += rect_subtract(&r, &n.rects[i], &todo[ntodo]);
+			continue;
+		}
+
+		if (n.nrects == GPU_PENDING_MAX_RECTS)
+			return false;
+		n.rects[n.nrects++] = r;
+	}
+
+	*p = n;
+	return true;
+}
+
+/**
+ * @brief Send the pending transfers and respond to their requests
+ * @param g - pointer to gpu device structure
+ */
+static void gpu_pending_flush(struct gpu_device *g)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct gpu_pending *pd = &g->pending;
+
+	for (unsigned int i = 0; i < pd->nres; i++) {
+		struct gpu_pending_res *p = &pd->res[i];
+		struct rvgpu_res *res;
+
+		res = b->plugin_v1.ops.rvgpu_ctx_res_find(&b->plugin_v1.ctx,
+							  p->resid);
+		if (!res || !res->backing)
+			continue;
+
+		for (unsigned int j = 0; j < p->nrects; j++)
+			gpu_device_send_2d(g, res, &p->rects[j], 0);
+		gpu_device_arm_scanout(g, res);
+	}
+
+	for (unsigned int i = 0; i < pd->nreqs; i++) {
+		struct virtio_gpu_ctrl_hdr resp = {
+			.type = VIRTIO_GPU_RESP_OK_NODATA,
+		};
+
+		vqueue_send_response(pd->reqs[i], &resp, sizeof(resp));
+	}
+
+	pd->nres = 0;
+	pd->nreqs = 0;
+}
+
+/**
+ * @brief Defer a TRANSFER_TO_HOST_2D command
+ * @param g - pointer to gpu device structure
+ * @param t - transfer command
+ * @param req - request holding the command
+ * @return true if the transfer is pending and the request is responded
+ *	   to later, false if the command has to be processed as usual
+ */
+static bool gpu_pending_add(struct gpu_device *g,
+			    const struct virtio_gpu_transfer_to_host_2d *t,
+			    struct vqueue_request *req)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct gpu_pending *pd = &g->pending;
+	struct gpu_pending_res *p = NULL;
+	struct rvgpu_res_rect r = { t->r.x, t->r.y, t->r.width, t->r.height };
+	struct rvgpu_res *res;
+	int bpp;
+
+	if (t->hdr.type != VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D ||
+	    (t->hdr.flags & VIRTIO_GPU_FLAG_FENCE) ||
+	    gpu_reset_state != GPU_RESET_NONE)
+		return false;
+
+	res = b->plugin_v1.ops.rvgpu_ctx_res_find(&b->plugin_v1.ctx,
+						  t->resource_id);
+	if (!res || !res->backing)
+		return false;
+
+	/* Only boxes that can be resent as is are merged */
+	bpp = get_format_bpp(res->info.format);
+	if (bpp <= 0 || t->r.width == 0 || t->r.height == 0 ||
+	    t->r.x >= res->info.width || t->r.y >= res->info.height ||
+	    t->r.width > res->info.width - t->r.x ||
+	    t->r.height > res->info.height - t->r.y ||
+	    t->offset != ((uint64_t)t->r.y * res->info.width + t->r.x) *
+				 (uint64_t)bpp)
+		return false;
+
+	for (unsigned int i = 0; i < pd->nres; i++) {
+		if (pd->res[i].resid == t->resource_id)
+			p = &pd->res[i];
+	}
+	if (!p && pd->nres == GPU_PENDING_MAX_RES)
+		gpu_pending_flush(g);
+	if (pd->nreqs == GPU_BATCH_MAX_REQS) {
+		gpu_pending_flush(g);
+		p = NULL;
+	}
+	/* A box that doesn't fit sends the others early, nothing is widened */
+	if (p && !gpu_pending_merge(p, r)) {
+		gpu_pending_flush(g);
+		p = NULL;
+	}
+	if (!p) {
+		p = &pd->res[pd->nres++];
+		p->resid = t->resource_id;
+		p->nrects = 0;
+		gpu_pending_merge(p, r);
+	}
+
+	pd->reqs[pd->nreqs++] = req;
+	return true;
+}
+
+static void gpu_device_release_backing(struct gpu_device *g,
+				       struct iovec *backing, unsigned int n)
+{
+	for (unsigned int i = 0u; i < n; i++)
+		map_guest_release(g->map_cache, backing[i].iov_base);
+}
+
 static unsigned int gpu_device_attach(struct gpu_device *g, unsigned int resid,
-				      struct virtio_gpu_mem_entry mem[],
-				      unsigned int n)
+				      struct iov_cursor *c, unsigned int n)
 {
 	struct rvgpu_backend *b = g->backend;
 	struct rvgpu_res *res;
@@ -1194,18 +2601,28 @@ static unsigned int gpu_device_attach(struct gpu_device *g, unsigned int resid,
 	}
 	res->nbacking = n;
 	for (i = 0u; i < n; i++) {
-		res->backing[i].iov_base = map_guest(g->lo_fd, mem[i].addr,
-						     PROT_READ | PROT_WRITE,
-						     mem[i].length);
-		res->backing[i].iov_len = mem[i].length;
-		sentsize += mem[i].length;
+		struct virtio_gpu_mem_entry mem;
+
+		if (iov_cursor_read(c, &mem, sizeof(mem)) == sizeof(mem))
+			res->backing[i].iov_base = map_guest_cached(
+				g->map_cache, mem.addr, mem.length,
+				PROT_READ | PROT_WRITE);
+		else
+			res->backing[i].iov_base = NULL;
+
+		if (!res->backing[i].iov_base) {
+			gpu_device_release_backing(g, res->backing, i);
+			free(res->backing);
+			res->backing = NULL;
+			res->nbacking = 0u;
+			return VIRTIO_GPU_RESP_ERR_UNSPEC;
+		}
+		res->backing[i].iov_len = mem.length;
+		sentsize += mem.length;
 	}
 	if (g->max_mem != 0 && (g->curr_mem + sentsize) > g->max_mem) {
-		for (i = 0u; i < n; i++) {
-			unmap_guest(res->backing[i].iov_base,
-				    res->backing[i].iov_len);
-		}
 		warnx("Out of memory on attach");
+		gpu_device_release_backing(g, res->backing, n);
 		free(res->backing);
 		res->backing = NULL;
 		res->nbacking = 0u;
@@ -1213,6 +2630,13 @@ static unsigned int gpu_device_attach(struct gpu_device *g, unsigned int resid,
 	}
 
 	g->curr_mem += sentsize;
+	/* Remote side starts over with a zeroed copy */
+	res->generation++;
+
+	/* Take the backing faults now rather than on the transfer path */
+	for (i = 0u; i < n; i++)
+		map_guest_prepare(g->map_cache, res->backing[i].iov_base,
+				  res->backing[i].iov_len);
 
 	return VIRTIO_GPU_RESP_OK_NODATA;
 }
@@ -1230,10 +2654,10 @@ static unsigned int gpu_device_detach(struct gpu_device *g, unsigned int resid)
 	if (!res->backing)
 		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
 
-	for (i = 0u; i < res->nbacking; i++) {
-		unmap_guest(res->backing[i].iov_base, res->backing[i].iov_len);
+	for (i = 0u; i < res->nbacking; i++)
 		g->curr_mem -= res->backing[i].iov_len;
-	}
+
+	gpu_device_release_backing(g, res->backing, res->nbacking);
 	free(res->backing);
 	res->backing = NULL;
 	res->nbacking = 0u;
@@ -1332,15 +2756,14 @@ static uint64_t gpu_device_read_vsync(struct gpu_device *g)
 static size_t gpu_device_serve_vsync(struct gpu_device *g)
 {
 	struct async_resp *r = g->async_resp;
-	struct cmd *cmd;
+	struct cmd *cmd, *next;
 	size_t processed = 0;
 
-	TAILQ_FOREACH(cmd, &r->async_cmds, cmds)
-	{
+	for (cmd = TAILQ_FIRST(&r->async_cmds); cmd != NULL; cmd = next) {
+		next = TAILQ_NEXT(cmd, cmds);
 		if (cmd->hdr.flags & VIRTIO_GPU_FLAG_VSYNC) {
 			vqueue_send_response(cmd->req, &cmd->hdr, sizeof(cmd->hdr));
-			TAILQ_REMOVE(&r->async_cmds, cmd, cmds);
-			free(cmd);
+			release_cmd(r, cmd);
 			processed++;
 		}
 	}
@@ -1376,24 +2799,19 @@ static void gpu_device_trigger_vsync(struct gpu_device *g,
 static int gpu_device_serve_fences(struct gpu_device *g)
 {
 	struct async_resp *r = g->async_resp;
-	struct pollfd pfd;
-	int processed = 0;
-	uint32_t fence_id;
-
-	pfd.fd = r->fence_pipe[PIPE_READ];
-	pfd.events = POLLIN;
-
-	while (poll(&pfd, 1, 0) > 0) {
-		if (pfd.revents & POLLIN) {
-			int rc = read_all(r->fence_pipe[PIPE_READ], &fence_id,
-					  sizeof(fence_id));
-			if (rc != sizeof(fence_id))
-				warnx("read error: %d", rc);
+	uint64_t ev;
+	ssize_t n;
 
-			processed += process_fences(g, fence_id);
-		}
+	n = read(r->fence_fd, &ev, sizeof(ev));
+	if (n < 0) {
+		if (errno != EAGAIN)
+			warn("read error from fence eventfd");
+		return 0;
 	}
-	return processed;
+
+	r->served_fence = atomic_load_explicit(&r->completed_fence,
+					       memory_order_acquire);
+	return (int)process_fences(g, r->served_fence);
 }
 
 union virtio_gpu_resp {
@@ -1404,58 +2822,81 @@ union virtio_gpu_resp {
 	uint8_t data[4096];
 };
 
-void gpu_device_handle_submit_3d(struct gpu_device *g, union virtio_gpu_cmd *cmd, union virtio_gpu_resp *resp) {
-	uint32_t c_submit_rs_id = 0;
-	struct rvgpu_res_transfer c_submit_res = {0};
-	uint32_t *c_submit_buf = NULL;
-	uint32_t c_submit_buf_offset = 0;
-	uint32_t c_submit_header = 0;
-	uint32_t c_submit_len = 0;
-	c_submit_buf = cmd->c_cmdbuf;
-	while (c_submit_buf_offset < (cmd->c_submit.size / 4)) {
-		c_submit_header = c_submit_buf[c_submit_buf_offset];
-		c_submit_len = c_submit_header >> 16;
-		const uint32_t *buf = &c_submit_buf[c_submit_buf_offset];
-		switch (c_submit_header) {
-			case VIRGL_CMD0(VIRGL_CCMD_TRANSFER3D,0,VIRGL_TRANSFER3D_SIZE):
-				c_submit_rs_id = buf[VIRGL_RESOURCE_IW_RES_HANDLE];
-				c_submit_res.x = buf[VIRGL_RESOURCE_IW_X];
-				c_submit_res.y = buf[VIRGL_RESOURCE_IW_Y];
-				c_submit_res.z = buf[VIRGL_RESOURCE_IW_Z];
-				c_submit_res.w = buf[VIRGL_RESOURCE_IW_W];
-				c_submit_res.h = buf[VIRGL_RESOURCE_IW_H];
-				c_submit_res.d = buf[VIRGL_RESOURCE_IW_D];
-				c_submit_res.level = buf[VIRGL_RESOURCE_IW_LEVEL];
-				c_submit_res.stride = buf[VIRGL_RESOURCE_IW_STRIDE];
-				c_submit_res.offset = buf[VIRGL_RESOURCE_IW_DATA_START];
-				c_submit_res.layer_stride = buf[VIRGL_RESOURCE_IW_LAYER_STRIDE];
-				resp->hdr.type = gpu_device_send_res(
-					g, c_submit_rs_id,
-					&c_submit_res);
-				break;
-			case VIRGL_CMD0(VIRGL_CCMD_COPY_TRANSFER3D,0,VIRGL_COPY_TRANSFER3D_SIZE):
-				c_submit_rs_id = buf[VIRGL_COPY_TRANSFER3D_SRC_RES_HANDLE];
-				c_submit_res.x = buf[VIRGL_RESOURCE_IW_X];
-				c_submit_res.y = buf[VIRGL_RESOURCE_IW_Y];
-				c_submit_res.z = buf[VIRGL_RESOURCE_IW_Z];
-				c_submit_res.w = buf[VIRGL_RESOURCE_IW_W];
-				c_submit_res.h = buf[VIRGL_RESOURCE_IW_H];
-				c_submit_res.d = buf[VIRGL_RESOURCE_IW_D];
-				c_submit_res.level = buf[VIRGL_RESOURCE_IW_LEVEL];
-				c_submit_res.stride = buf[VIRGL_RESOURCE_IW_STRIDE];
-				c_submit_res.layer_stride = buf[VIRGL_RESOURCE_IW_LAYER_STRIDE];
-				c_submit_res.offset = buf[VIRGL_COPY_TRANSFER3D_SRC_RES_OFFSET];
-				resp->hdr.type = gpu_device_send_res(
-					g, c_submit_rs_id,
-					&c_submit_res);
-				break;
-			/*TODO*/
-			default:
-				break;
+static void gpu_device_handle_submit_3d(struct gpu_device *g,
+					struct iov_cursor *c, uint32_t size,
+					union virtio_gpu_resp *resp)
+{
+	uint32_t buf[VIRGL_COPY_TRANSFER3D_SIZE + 1];
+	struct rvgpu_res_transfer c_submit_res = { 0 };
+	uint32_t c_submit_rs_id;
+	size_t left = size / 4;
+
+	while (left > 0) {
+		uint32_t c_submit_len;
+
+		if (iov_cursor_read(c, &buf[0], sizeof(buf[0])) !=
+		    sizeof(buf[0]))
+			break;
+
+		left--;
+		c_submit_len = buf[0] >> 16;
+		if (c_submit_len > left)
+			break;
+
+		switch (buf[0]) {
+		case VIRGL_CMD0(VIRGL_CCMD_TRANSFER3D, 0, VIRGL_TRANSFER3D_SIZE):
+			iov_cursor_read(c, &buf[1], c_submit_len * 4);
+			c_submit_rs_id = buf[VIRGL_RESOURCE_IW_RES_HANDLE];
+			c_submit_res.x = buf[VIRGL_RESOURCE_IW_X];
+			c_submit_res.y = buf[VIRGL_RESOURCE_IW_Y];
+			c_submit_res.z = buf[VIRGL_RESOURCE_IW_Z];
+			c_submit_res.w = buf[VIRGL_RESOURCE_IW_W];
+			c_submit_res.h = buf[VIRGL_RESOURCE_IW_H];
+			c_submit_res.d = buf[VIRGL_RESOURCE_IW_D];
+			c_submit_res.level = buf[VIRGL_RESOURCE_IW_LEVEL];
+			c_submit_res.stride = buf[VIRGL_RESOURCE_IW_STRIDE];
+			c_submit_res.offset = buf[VIRGL_RESOURCE_IW_DATA_START];
+			c_submit_res.layer_stride =
+				buf[VIRGL_RESOURCE_IW_LAYER_STRIDE];
+			resp->hdr.type = gpu_device_send_res(g, c_submit_rs_id,
+							     &c_submit_res);
+			break;
+		case VIRGL_CMD0(VIRGL_CCMD_COPY_TRANSFER3D, 0,
+				VIRGL_COPY_TRANSFER3D_SIZE):
+			iov_cursor_read(c, &buf[1], c_submit_len * 4);
+			c_submit_rs_id = buf[VIRGL_COPY_TRANSFER3D_SRC_RES_HANDLE];
+			c_submit_res.x = buf[VIRGL_RESOURCE_IW_X];
+			c_submit_res.y = buf[VIRGL_RESOURCE_IW_Y];
+			c_submit_res.z = buf[VIRGL_RESOURCE_IW_Z];
+			c_submit_res.w = buf[VIRGL_RESOURCE_IW_W];
+			c_submit_res.h = buf[VIRGL_RESOURCE_IW_H];
+			c_submit_res.d = buf[VIRGL_RESOURCE_IW_D];
+			c_submit_res.level = buf[VIRGL_RESOURCE_IW_LEVEL];
+			c_submit_res.stride = buf[VIRGL_RESOURCE_IW_STRIDE];
+			c_submit_res.layer_stride =
+				buf[VIRGL_RESOURCE_IW_LAYER_STRIDE];
+			c_submit_res.offset =
+				buf[VIRGL_COPY_TRANSFER3D_SRC_RES_OFFSET];
+			resp->hdr.type = gpu_device_send_res(g, c_submit_rs_id,
+							     &c_submit_res);
+			break;
+		default:
+			iov_cursor_skip(c, c_submit_len * 4);
+			break;
 		}
-		c_submit_buf_offset += c_submit_len + 1;
+		left -= c_submit_len;
 	}
-	
+}
+
+/* Readback overwrites the remote copy of the backing */
+static void gpu_device_res_readback(struct gpu_device *g, unsigned int resid)
+{
+	struct rvgpu_backend *b = g->backend;
+	struct rvgpu_res *res;
+
+	res = b->plugin_v1.ops.rvgpu_ctx_res_find(&b->plugin_v1.ctx, resid);
+	if (res)
+		res->generation++;
 }
 
 static void get_meta_res_from_cmd(struct gpu_device *g, struct virtio_gpu_transfer_host_3d *t, uint32_t *bpp, uint32_t *stride)
@@ -1474,23 +2915,25 @@ static void get_meta_res_from_cmd(struct gpu_device *g, struct virtio_gpu_transf
 static void gpu_device_serve_ctrl(struct gpu_device *g)
 {
 	struct rvgpu_backend *b = g->backend;
-	int kick = 0;
 	static bool reset;
 
-	static union virtio_gpu_cmd cmd;
+	/* Payloads are read in place, only the head is copied */
+	static union virtio_gpu_cmd_head cmd;
 	static union virtio_gpu_resp resp;
+	struct iov_cursor c;
 
 	memset(&resp.hdr, 0, sizeof(resp.hdr));
 #ifdef VSYNC_ENABLE
 	if (g->wait_vsync) {
 		if (gpu_device_read_vsync(g) > 0u) {
 			g->wait_vsync = 0;
-			kick += gpu_device_serve_vsync(g);
+			gpu_device_serve_vsync(g);
 			set_timer(g->vsync_fd, 0, 0);
 		}
 	}
 #endif
-	kick += gpu_device_serve_fences(g);
+	gpu_device_serve_fences(g);
+	gpu_device_serve_refresh(g);
 	while (1) {
 		struct vqueue_request *req;
 		size_t resp_len = sizeof(resp.hdr);
@@ -1503,22 +2946,28 @@ static void gpu_device_serve_ctrl(struct gpu_device *g)
 		if (!vqueue_are_requests_available(&g->vq[0]))
 			break;
 
-		req = vqueue_get_request(g->lo_fd, &g->vq[0]);
+		req = vqueue_get_request(g->map_cache, &g->vq[0]);
 		if (!req)
 			errx(1, "out of memory");
 
 		rhdr.size = (uint32_t)iov_size(req->r, req->nr),
 
-		copy_from_iov(req->r, req->nr, &cmd, sizeof(cmd));
+		iov_cursor_init(&c, req->r, req->nr);
+		iov_cursor_read(&c, &cmd, sizeof(cmd));
 
 		resp.hdr.flags = 0;
 		resp.hdr.fence_id = 0;
-		resp.hdr.type = sanity_check_gpu_ctrl(&cmd, rhdr.size, true);
+		resp.hdr.type = sanity_check_gpu_ctrl_head(&cmd, rhdr.size,
+							   true);
 
 		if (resp.hdr.type == VIRTIO_GPU_RESP_OK_NODATA) {
 			bool notify_all = true;
 			size_t i;
 
+			if (gpu_pending_add(g, &cmd.t_2h2d, req))
+				continue;
+			gpu_pending_flush(g);
+
 			if (cmd.hdr.flags & VIRTIO_GPU_FLAG_FENCE) {
 				resp.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
 				resp.hdr.fence_id = cmd.hdr.fence_id;
@@ -1528,15 +2977,29 @@ static void gpu_device_serve_ctrl(struct gpu_device *g)
 
 			if (cmd.hdr.type == VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D){
 				notify_all = false;
+				gpu_device_res_readback(g, cmd.t_h3d.resource_id);
 				get_meta_res_from_cmd(g, &cmd.t_h3d, &rhdr.bpp, &rhdr.stride);
 			}
-			gpu_device_send_command(b, &rhdr, sizeof(rhdr),
-						notify_all);
-			for (i = 0u; i < req->nr; i++) {
-				struct iovec *iov = &req->r[i];
-
-				gpu_device_send_command(
-					b, iov->iov_base, iov->iov_len, notify_all);
+			if (notify_all &&
+			    cmd.hdr.type == VIRTIO_GPU_CMD_SUBMIT_3D &&
+			    gpu_device_cmd_cache(g, req, cmd.c_submit.size,
+						 &rhdr)) {
+				gpu_batch_add_replay(g, &rhdr, &cmd.c_submit);
+			} else if (notify_all) {
+				gpu_batch_add_routed(g, &rhdr, req, &cmd.hdr,
+						     gpu_device_cmd_hosts(g,
+									  &cmd));
+			} else {
+				gpu_batch_flush(g);
+				gpu_device_send_command(b, &rhdr, sizeof(rhdr),
+							false);
+				for (i = 0u; i < req->nr; i++) {
+					struct iovec *iov = &req->r[i];
+
+					gpu_device_send_command(
+						b, iov->iov_base, iov->iov_len,
+						false);
+				}
 			}
 
 			/* command is sane, parse it */
@@ -1583,6 +3046,9 @@ static void gpu_device_serve_ctrl(struct gpu_device *g)
 				if (cmd.s_set.scanout_id == 0)
 					g->scanres = cmd.s_set.resource_id;
 				g->scan_id = cmd.s_set.scanout_id;
+				gpu_device_set_scanout(g, cmd.s_set.scanout_id,
+						       cmd.s_set.resource_id,
+						       &cmd.s_set.r);
 				break;
 			case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
 #ifdef VSYNC_ENABLE
@@ -1599,7 +3065,10 @@ static void gpu_device_serve_ctrl(struct gpu_device *g)
 #endif
 				break;
 		   case VIRTIO_GPU_CMD_SUBMIT_3D:
-			   gpu_device_handle_submit_3d(g, &cmd, &resp);
+			   iov_cursor_init(&c, req->r, req->nr);
+			   iov_cursor_skip(&c, sizeof(cmd.c_submit));
+			   gpu_device_handle_submit_3d(g, &c, cmd.c_submit.size,
+						       &resp);
 			   break;
 			case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
 				resp.hdr.type = gpu_device_send_res(
@@ -1611,6 +3080,10 @@ static void gpu_device_serve_ctrl(struct gpu_device *g)
 						.h      = cmd.t_2h2d.r.height,
 						.offset = cmd.t_2h2d.offset,
 						.d      = 1,
+						.skip_hosts = gpu_device_skip_hosts(
+							g, cmd.t_2h2d.resource_id),
+						.clip = gpu_device_res_clip(
+							g, cmd.t_2h2d.resource_id),
 					});
 				break;
 			case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
@@ -1629,8 +3102,10 @@ static void gpu_device_serve_ctrl(struct gpu_device *g)
 					});
 				break;
 			case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
+				iov_cursor_init(&c, req->r, req->nr);
+				iov_cursor_skip(&c, sizeof(cmd.r_att));
 				resp.hdr.type = gpu_device_attach(
-					g, cmd.r_att.resource_id, cmd.r_mem,
+					g, cmd.r_att.resource_id, &c,
 					cmd.r_att.nr_entries);
 				break;
 			case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
@@ -1658,13 +3133,14 @@ static void gpu_device_serve_ctrl(struct gpu_device *g)
 		}
 		if ((!(resp.hdr.flags & VIRTIO_GPU_FLAG_FENCE)) &&
 		    (!(resp.hdr.flags & VIRTIO_GPU_FLAG_VSYNC))) {
-			vqueue_send_response(req, &resp, resp_len);
-			kick++;
+			gpu_batch_respond(g, req, &resp, resp_len);
 		} else {
 			vqueue_request_unref(req);
 		}
 	}
-	if (kick) {
+	gpu_pending_flush(g);
+	gpu_batch_flush(g);
+	if (vqueue_flush_used(&g->vq[0])) {
 		struct virtio_lo_kick k = {
 			.idx = g->idx,
 			.qidx = 0,
@@ -1690,12 +3166,9 @@ static void gpu_device_serve_ctrl(struct gpu_device *g)
 
 static void gpu_device_serve_cursor(struct gpu_device *g)
 {
-	struct rvgpu_backend *b = g->backend;
-	int kick = 0;
-
 	while (1) {
 		struct vqueue_request *req;
-		union virtio_gpu_cmd r;
+		union virtio_gpu_cmd_head r;
 		struct virtio_gpu_ctrl_hdr resp = { .flags = 0, .fence_id = 0 };
 		struct rvgpu_header rhdr = {
 			.idx = 0,
@@ -1705,16 +3178,16 @@ static void gpu_device_serve_cursor(struct gpu_device *g)
 		if (!vqueue_are_requests_available(&g->vq[1]))
 			break;
 
-		req = vqueue_get_request(g->lo_fd, &g->vq[1]);
+		req = vqueue_get_request(g->map_cache, &g->vq[1]);
 		if (!req)
 			errx(1, "out of memory");
 
 		size_t cmdsize = iov_size(req->r, req->nr);
 		rhdr.size = (uint32_t)cmdsize,
 
-		copy_from_iov(req->r, req->nr, &r, sizeof(r));
+		copy_from_iov(req->r, req->nr, &r, sizeof(r.cursor));
 
-		resp.type = sanity_check_gpu_cursor(&r, cmdsize, true);
+		resp.type = sanity_check_gpu_cursor_head(&r, cmdsize, true);
 		if (resp.type == VIRTIO_GPU_RESP_OK_NODATA) {
 			if (r.hdr.flags & VIRTIO_GPU_FLAG_FENCE) {
 				resp.flags = VIRTIO_GPU_FLAG_FENCE;
@@ -1722,18 +3195,12 @@ static void gpu_device_serve_cursor(struct gpu_device *g)
 				resp.ctx_id = r.hdr.ctx_id;
 			}
 
-			gpu_device_send_command(b, &rhdr, sizeof(rhdr), true);
-			for (unsigned int i = 0u; i < req->nr; i++) {
-				struct iovec *iov = &req->r[i];
-
-				gpu_device_send_command(b, iov->iov_base,
-							iov->iov_len, true);
-			}
+			gpu_batch_add(g, &rhdr, req);
 		}
-		vqueue_send_response(req, &resp, sizeof(resp));
-		kick = 1;
+		gpu_batch_respond(g, req, &resp, sizeof(resp));
 	}
-	if (kick) {
+	gpu_batch_flush(g);
+	if (vqueue_flush_used(&g->vq[1])) {
 		struct virtio_lo_kick k = {
 			.idx = g->idx,
 			.qidx = 1,
@@ -1755,6 +3222,75 @@ void gpu_device_serve(struct gpu_device *g)
 		err(1, "read failed from eventfd");
 	}
 
-	gpu_device_serve_ctrl(g);
-	gpu_device_serve_cursor(g);
+	/*
+	 * Kicks are suppressed while the queues are drained, so a burst of
+	 * requests costs a single kick. Requests that slipped in before
+	 * kicks were enabled again are picked up by another pass.
+	 */
+	do {
+		vqueue_disable_notify(&g->vq[0]);
+		vqueue_disable_notify(&g->vq[1]);
+		gpu_device_serve_ctrl(g);
+		gpu_device_serve_cursor(g);
+	} while (vqueue_enable_notify(&g->vq[0]) |
+		 vqueue_enable_notify(&g->vq[1]));
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ volatile("yield" ::: "memory");
+#endif
+}
+
+static bool gpu_device_has_work(struct gpu_device *g)
+{
+	struct async_resp *r = g->async_resp;
+
+	return vqueue_are_requests_available(&g->vq[0]) ||
+	       vqueue_are_requests_available(&g->vq[1]) ||
+	       atomic_load_explicit(&r->completed_fence,
+				    memory_order_relaxed) != r->served_fence;
+}
+
+bool gpu_device_poll(struct gpu_device *g)
+{
+	unsigned long long budget_ns = g->params->poll_us * 1000ull;
+	struct timespec start, now;
+	bool again;
+
+	if (budget_ns == 0)
+		return false;
+
+	/* The driver does not need to kick while we are watching the ring */
+	vqueue_disable_notify(&g->vq[0]);
+	vqueue_disable_notify(&g->vq[1]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (unsigned int i = 0; i < 64u; i++) {
+			if (gpu_device_has_work(g)) {
+				g->poll_hits++;
+				return true;
+			}
+			cpu_relax();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((unsigned long long)(now.tv_sec - start.tv_sec) *
+				 1000000000ull +
+			 (unsigned long long)now.tv_nsec -
+			 (unsigned long long)start.tv_nsec <
+		 budget_ns);
+
+	again = vqueue_enable_notify(&g->vq[0]);
+	again |= vqueue_enable_notify(&g->vq[1]);
+	if (again) {
+		g->poll_hits++;
+		return true;
+	}
+
+	g->poll_sleeps++;
+	return false;
 }
@@ -67,3 +67,47 @@ size_t iov_size(const struct iovec iov[], size_t n)
 
 	return result;
 }
+
+void iov_cursor_init(struct iov_cursor *c, const struct iovec iov[], size_t n)
+{
+	c->iov = iov;
+	c->n = n;
+	c->idx = 0u;
+	c->off = 0u;
+}
+
+static size_t iov_cursor_advance(struct iov_cursor *c, void *buffer,
+				 size_t len)
+{
+	size_t ret = 0u;
+
+	while (ret < len && c->idx < c->n) {
+		const struct iovec *iov = &c->iov[c->idx];
+		size_t chunk = iov->iov_len - c->off;
+
+		if (chunk > len - ret)
+			chunk = len - ret;
+
+		if (buffer)
+			memcpy((char *)buffer + ret,
+			       (const char *)iov->iov_base + c->off, chunk);
+
+		ret += chunk;
+		c->off += chunk;
+		if (c->off == iov->iov_len) {
+			c->idx++;
+			c->off = 0u;
+		}
+	}
+	return ret;
+}
+
+size_t iov_cursor_read(struct iov_cursor *c, void *buffer, size_t len)
+{
+	return iov_cursor_advance(c, buffer, len);
+}
+
+size_t iov_cursor_skip(struct iov_cursor *c, size_t len)
+{
+	return iov_cursor_advance(c, NULL, len);
+}
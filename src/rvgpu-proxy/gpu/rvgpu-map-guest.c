@@ -16,8 +16,10 @@
  */
 
 #include <err.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <sys/queue.h>
 
 #include <rvgpu-proxy/gpu/rvgpu-map-guest.h>
 
@@ -53,3 +55,275 @@ void unmap_guest(void *addr, size_t size)
 
 	munmap((void *)realpa, realsize);
 }
+
+/**
+ * @brief Contiguous mapping of guest memory
+ */
+struct guest_window {
+	uint64_t gpa; /**< guest physical address of the first byte */
+	size_t size; /**< size of the mapping */
+	void *addr; /**< address of the mapping */
+	int prot; /**< protection of the mapping */
+	unsigned int refs; /**< users of a span, unused for windows */
+	LIST_ENTRY(guest_window) entry;
+};
+
+/**
+ * @brief Hash table slot, maps window key to the mapping covering it
+ */
+struct guest_window_slot {
+	uint64_t key;
+	struct guest_window *w;
+};
+
+struct map_guest_cache {
+	int fd;
+	unsigned int policy; /**< MAP_GUEST_* flags */
+	struct guest_window_slot *slots; /**< open addressing hash table */
+	size_t nslots; /**< always power of two */
+	size_t nused;
+	LIST_HEAD(, guest_window) windows;
+	LIST_HEAD(, guest_window) spans; /**< mappings of the fallback spans */
+};
+
+#define MAP_GUEST_CACHE_INITIAL_SLOTS 256u
+
+/* Read-only and writable mappings of a window are kept apart */
+static inline uint64_t window_key(uint64_t index, int prot)
+{
+	return (index << 1) | ((prot & PROT_WRITE) ? 1u : 0u);
+}
+
+static inline size_t window_hash(uint64_t key, size_t nslots)
+{
+	return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (nslots - 1);
+}
+
+static struct guest_window_slot *window_slot(struct guest_window_slot *slots,
+					     size_t nslots, uint64_t key)
+{
+	size_t i = window_hash(key, nslots);
+
+	while (slots[i].w != NULL && slots[i].key != key)
+		i = (i + 1) & (nslots - 1);
+
+	return &slots[i];
+}
+
+static int window_table_grow(struct map_guest_cache *c)
+{
+	size_t nslots = c->nslots * 2;
+	struct guest_window_slot *slots;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots)
+		return -1;
+
+	for (size_t i = 0; i < c->nslots; i++) {
+		if (c->slots[i].w != NULL)
+			*window_slot(slots, nslots, c->slots[i].key) =
+				c->slots[i];
+	}
+	free(c->slots);
+	c->slots = slots;
+	c->nslots = nslots;
+	return 0;
+}
+
+static int window_table_set(struct map_guest_cache *c, uint64_t key,
+			    struct guest_window *w)
+{
+	struct guest_window_slot *slot;
+
+	if ((c->nused + 1) * 2 > c->nslots && window_table_grow(c))
+		return -1;
+
+	slot = window_slot(c->slots, c->nslots, key);
+	if (slot->w == NULL)
+		c->nused++;
+
+	slot->key = key;
+	slot->w = w;
+	return 0;
+}
+
+static struct guest_window *window_map(struct map_guest_cache *c,
+				       uint64_t start, uint64_t end, int prot)
+{
+	struct guest_window *w;
+	int flags = MAP_SHARED;
+	void *addr;
+
+	if (c->policy & MAP_GUEST_POPULATE)
+		flags |= MAP_POPULATE;
+
+	addr = mmap(NULL, end - start, prot, flags, c->fd, (off_t)start);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	if (c->policy & MAP_GUEST_HUGEPAGE)
+		(void)madvise(addr, end - start, MADV_HUGEPAGE);
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		munmap(addr, end - start);
+		return NULL;
+	}
+	w->gpa = start;
+	w->size = end - start;
+	w->addr = addr;
+	w->prot = prot;
+	return w;
+}
+
+struct map_guest_cache *map_guest_cache_init(int fd)
+{
+	struct map_guest_cache *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->slots = calloc(MAP_GUEST_CACHE_INITIAL_SLOTS, sizeof(*c->slots));
+	if (!c->slots) {
+		free(c);
+		return NULL;
+	}
+	c->nslots = MAP_GUEST_CACHE_INITIAL_SLOTS;
+	c->fd = fd;
+	LIST_INIT(&c->windows);
+	LIST_INIT(&c->spans);
+	return c;
+}
+
+/* Take another reference to a span that covers the region */
+static void *span_get(struct map_guest_cache *c, uint64_t gpa, size_t size,
+		      int prot)
+{
+	struct guest_window *w;
+
+	LIST_FOREACH(w, &c->spans, entry) {
+		if (w->prot == prot && gpa >= w->gpa &&
+		    gpa + size <= w->gpa + w->size) {
+			w->refs++;
+			return (char *)w->addr + (gpa - w->gpa);
+		}
+	}
+
+	return NULL;
+}
+
+void *map_guest_cached(struct map_guest_cache *c, uint64_t gpa, size_t size,
+		       int prot)
+{
+	const uint64_t wmask = MAP_GUEST_WINDOW_SIZE - 1;
+	struct guest_window *w;
+	uint64_t start, end, last;
+	void *addr;
+
+	if (size == 0)
+		size = 1;
+	if (gpa + size < gpa)
+		return NULL;
+
+	w = window_slot(c->slots, c->nslots,
+			window_key(gpa >> MAP_GUEST_WINDOW_SHIFT, prot))->w;
+	if (w && gpa >= w->gpa && gpa + size <= w->gpa + w->size)
+		return (char *)w->addr + (gpa - w->gpa);
+
+	addr = span_get(c, gpa, size, prot);
+	if (addr)
+		return addr;
+
+	/*
+	 * Map the whole windows the region falls into. Windows that run
+	 * past the end of guest RAM may be refused by the driver, in that
+	 * case fall back to the exact page span of the region. Spans are
+	 * shared by their users and unmapped by the last one to release.
+	 */
+	start = gpa & ~wmask;
+	end = (gpa + size + wmask) & ~wmask;
+	w = window_map(c, start, end, prot);
+	if (!w) {
+		start = align_to_page_down(gpa);
+		end = align_to_page_up(gpa + size);
+		w = window_map(c, start, end, prot);
+		if (!w) {
+			warn("cannot map guest memory at 0x%llx",
+			     (unsigned long long)gpa);
+			return NULL;
+		}
+		w->refs = 1u;
+		LIST_INSERT_HEAD(&c->spans, w, entry);
+		return (char *)w->addr + (gpa - w->gpa);
+	}
+	LIST_INSERT_HEAD(&c->windows, w, entry);
+
+	last = (end - 1) >> MAP_GUEST_WINDOW_SHIFT;
+	for (uint64_t i = start >> MAP_GUEST_WINDOW_SHIFT; i <= last; i++) {
+		if (window_table_set(c, window_key(i, prot), w)) {
+			warnx("out of memory in guest mapping cache");
+			break;
+		}
+	}
+
+	return (char *)w->addr + (gpa - w->gpa);
+}
+
+void map_guest_release(struct map_guest_cache *c, void *addr)
+{
+	struct guest_window *w;
+
+	/* Windows stay mapped, only spans are counted */
+	LIST_FOREACH(w, &c->spans, entry) {
+		if ((char *)addr >= (char *)w->addr &&
+		    (char *)addr < (char *)w->addr + w->size) {
+			if (--w->refs == 0u) {
+				LIST_REMOVE(w, entry);
+				munmap(w->addr, w->size);
+				free(w);
+			}
+			return;
+		}
+	}
+}
+
+void map_guest_cache_set_policy(struct map_guest_cache *c, unsigned int flags)
+{
+	c->policy = flags;
+}
+
+void map_guest_prepare(struct map_guest_cache *c, void *addr, size_t size)
+{
+	uintptr_t start = align_to_page_down((uintptr_t)addr);
+	uintptr_t end = align_to_page_up((uintptr_t)addr + size);
+
+	if (size == 0)
+		return;
+
+	if (c->policy & MAP_GUEST_WILLNEED)
+		(void)madvise((void *)start, end - start, MADV_WILLNEED);
+
+	if (c->policy & MAP_GUEST_PREFAULT) {
+		for (uintptr_t p = start; p < end; p += 4096u)
+			(void)*(volatile const char *)p;
+	}
+}
+
+void map_guest_cache_free(struct map_guest_cache *c)
+{
+	struct guest_window *w;
+
+	while ((w = LIST_FIRST(&c->windows)) != NULL) {
+		LIST_REMOVE(w, entry);
+		munmap(w->addr, w->size);
+		free(w);
+	}
+	while ((w = LIST_FIRST(&c->spans)) != NULL) {
+		LIST_REMOVE(w, entry);
+		munmap(w->addr, w->size);
+		free(w);
+	}
+	free(c->slots);
+	free(c);
+}
@@ -15,6 +15,7 @@
  * limitations under the License.
  */
 
+#include <err.h>
 #include <stdatomic.h>
 #include <sys/mman.h>
 #include <time.h>
@@ -24,21 +25,85 @@
 #include <rvgpu-proxy/gpu/rvgpu-map-guest.h>
 #include <rvgpu-proxy/gpu/rvgpu-vqueue.h>
 
-static struct vqueue_request *vqueue_init_request(void)
+int vqueue_init_pool(struct vqueue *q)
 {
-	struct vqueue_request *req = calloc(1, sizeof(struct vqueue_request));
+	SLIST_INIT(&q->free_reqs);
+	q->pool = calloc(q->vr.num, sizeof(struct vqueue_request));
+	if (!q->pool)
+		return -1;
 
-	if (!req)
-		return NULL;
+	for (unsigned int i = q->vr.num; i > 0; i--) {
+		struct vqueue_request *req = &q->pool[i - 1];
+
+		req->pooled = true;
+		SLIST_INSERT_HEAD(&q->free_reqs, req, free_entry);
+	}
+	return 0;
+}
+
+void vqueue_free_pool(struct vqueue *q)
+{
+	if (!q->pool)
+		return;
+
+	for (unsigned int i = 0; i < q->vr.num; i++)
+		free(q->pool[i].iov_ext);
+
+	free(q->pool);
+	q->pool = NULL;
+	SLIST_INIT(&q->free_reqs);
+}
+
+static struct vqueue_request *vqueue_init_request(struct vqueue *q)
+{
+	struct vqueue_request *req = SLIST_FIRST(&q->free_reqs);
+
+	if (req) {
+		SLIST_REMOVE_HEAD(&q->free_reqs, free_entry);
+	} else {
+		/* Pool exhausted, e.g. requests kept alive for vsync */
+		req = calloc(1, sizeof(struct vqueue_request));
+		if (!req)
+			return NULL;
+	}
 
 	req->idx = 0u;
 	req->nr = req->nw = 0u;
 	req->refcount = 1;
 	req->mapped = false;
+	req->q = q;
 
 	return req;
 }
 
+/*
+ * Provide storage for n iovecs, growing the external array to the next
+ * size class if needed.
+ */
+static struct iovec *vqueue_request_iov(struct vqueue_request *req, size_t n)
+{
+	size_t len = VQUEUE_REQUEST_MIN_EXT_IOVEC_LEN;
+	struct iovec *iov;
+
+	if (n <= VQUEUE_REQUEST_INLINE_IOVEC_LEN)
+		return req->iov_inline;
+
+	if (n <= req->iov_ext_len)
+		return req->iov_ext;
+
+	while (len < n)
+		len *= 2;
+
+	iov = malloc(len * sizeof(struct iovec));
+	if (!iov)
+		return NULL;
+
+	free(req->iov_ext);
+	req->iov_ext = iov;
+	req->iov_ext_len = len;
+	return iov;
+}
+
 void vqueue_request_unref(struct vqueue_request *req)
 {
 	req->refcount--;
@@ -46,54 +111,163 @@ void vqueue_request_unref(struct vqueue_request *req)
 		return;
 
 	assert(!req->mapped);
-	free(req);
+	if (req->pooled) {
+		SLIST_INSERT_HEAD(&req->q->free_reqs, req, free_entry);
+	} else {
+		free(req->iov_ext);
+		free(req);
+	}
+}
+
+/*
+ * Walker over a descriptor chain. A chain that starts with an indirect
+ * descriptor is walked in the table the descriptor points to.
+ */
+struct desc_walk {
+	const struct vring_desc *table; /**< descriptor table of the chain */
+	unsigned int num; /**< number of entries in the table */
+	unsigned int count; /**< descriptors visited, bounds looped chains */
+	bool indirect; /**< table is an indirect one */
+	bool broken; /**< walk stopped at an invalid descriptor */
+};
+
+/* An indirect table must not refer to another indirect table */
+static const struct vring_desc *desc_walk_check(struct desc_walk *w,
+						const struct vring_desc *d)
+{
+	if (w->indirect && (d->flags & VRING_DESC_F_INDIRECT)) {
+		w->broken = true;
+		return NULL;
+	}
+
+	return d;
+}
+
+static const struct vring_desc *desc_walk_first(struct desc_walk *w,
+						struct map_guest_cache *mc,
+						struct vqueue *q, uint16_t head)
+{
+	const struct vring_desc *d = &q->vr.desc[head % q->vr.num];
+
+	w->count = 0u;
+	w->broken = false;
+	w->indirect = d->flags & VRING_DESC_F_INDIRECT;
+	if (w->indirect) {
+		w->num = d->len / sizeof(struct vring_desc);
+		if (w->num == 0u)
+			return NULL;
+		w->table = map_guest_cached(mc, d->addr, d->len, PROT_READ);
+		if (!w->table)
+			return NULL;
+		return desc_walk_check(w, &w->table[0]);
+	}
+
+	w->table = q->vr.desc;
+	w->num = q->vr.num;
+	return d;
+}
+
+static void desc_walk_end(struct desc_walk *w, struct map_guest_cache *mc,
+			  struct vqueue *q)
+{
+	if (w->table && w->table != q->vr.desc)
+		map_guest_release(mc, (void *)w->table);
+	w->table = NULL;
+}
+
+static const struct vring_desc *desc_walk_next(struct desc_walk *w,
+					       const struct vring_desc *d)
+{
+	if (!(d->flags & VRING_DESC_F_NEXT) || ++w->count >= w->num)
+		return NULL;
+
+	if (d->next >= w->num)
+		return NULL;
+
+	return desc_walk_check(w, &w->table[d->next]);
 }
 
-struct vqueue_request *vqueue_get_request(int vilo, struct vqueue *q)
+struct vqueue_request *vqueue_get_request(struct map_guest_cache *mc,
+					  struct vqueue *q)
 {
 	struct vqueue_request *req;
-	uint16_t didx;
+	const struct vring_desc *d;
+	struct desc_walk w;
+	struct iovec *iov;
+	size_t nr = 0, nw = 0;
 
 	assert(vqueue_are_requests_available(q));
 
-	req = vqueue_init_request();
+	req = vqueue_init_request(q);
 	if (!req)
 		return NULL;
 
 	atomic_thread_fence(memory_order_seq_cst);
 	req->idx = q->vr.avail->ring[q->last_avail_idx % q->vr.num];
-	req->nr = 0;
-	req->nw = 0;
-	req->q = q;
-	for (didx = req->idx;;) {
-		struct vring_desc d = q->vr.desc[didx % q->vr.num];
-		struct iovec *iov;
-		int prot;
+
+	/* Count the chain first to size the iovec storage */
+	for (d = desc_walk_first(&w, mc, q, req->idx); d != NULL;
+	     d = desc_walk_next(&w, d)) {
+		if (d->flags & VRING_DESC_F_WRITE)
+			nw++;
+		else
+			nr++;
+
+		if (nr >= VQUEUE_REQUEST_IOVEC_LEN ||
+		    nw >= VQUEUE_REQUEST_IOVEC_LEN)
+			break;
+	}
+	desc_walk_end(&w, mc, q);
+
+	iov = vqueue_request_iov(req, nr + nw);
+	if (!iov) {
+		vqueue_request_unref(req);
+		return NULL;
+	}
+	req->r = iov;
+	req->w = iov + nr;
+
+	for (d = desc_walk_first(&w, mc, q, req->idx); d != NULL;
+	     d = desc_walk_next(&w, d)) {
+		struct vring_desc dd = *d;
 		size_t *pn;
+		int prot;
 
-		if (d.flags & VRING_DESC_F_WRITE) {
+		if (dd.flags & VRING_DESC_F_WRITE) {
+			if (req->nw >= nw)
+				break;
 			iov = &req->w[req->nw];
 			prot = PROT_READ | PROT_WRITE;
 			pn = &req->nw;
 		} else {
+			if (req->nr >= nr)
+				break;
 			iov = &req->r[req->nr];
 			prot = PROT_READ;
 			pn = &req->nr;
 		}
-		iov->iov_len = d.len;
-		iov->iov_base = map_guest(vilo, d.addr, prot, d.len);
+		iov->iov_len = dd.len;
+		iov->iov_base = map_guest_cached(mc, dd.addr, dd.len, prot);
 		if (iov->iov_base != NULL) {
 			(*pn)++;
 			if (*pn >= VQUEUE_REQUEST_IOVEC_LEN)
 				break;
 		}
+	}
+	desc_walk_end(&w, mc, q);
 
-		if (d.flags & VRING_DESC_F_NEXT)
-			didx = d.next;
-		else
-			break;
+	/*
+	 * Fail a malformed chain: without the command the request gets an
+	 * error response in whatever writable buffers preceded the fault.
+	 */
+	if (w.broken) {
+		warnx("nested indirect descriptor in request %u", req->idx);
+		for (size_t i = 0; i < req->nr; i++)
+			map_guest_release(mc, req->r[i].iov_base);
+		req->nr = 0;
 	}
 	q->last_avail_idx++;
+	req->mc = mc;
 	req->mapped = true;
 	return req;
 }
@@ -102,24 +276,82 @@ void vqueue_send_response(struct vqueue_request *req,
 			  void *resp, size_t resp_len)
 {
 	struct vqueue *q = req->q;
-	uint16_t idx = atomic_load_explicit((atomic_ushort *)&q->vr.used->idx, memory_order_relaxed);
-	struct vring_used_elem *el = &q->vr.used->ring[idx % q->vr.num];
-	size_t i;
+	struct vring_used_elem *el = &q->vr.used->ring[q->used_idx % q->vr.num];
 
 	resp_len = copy_to_iov(req->w, req->nw, resp, resp_len);
 
-	for (i = 0; i < req->nr; i++)
-		unmap_guest(req->r[i].iov_base, req->r[i].iov_len);
+	for (size_t i = 0; i < req->nr; i++)
+		map_guest_release(req->mc, req->r[i].iov_base);
 
-	for (i = 0; i < req->nw; i++)
-		unmap_guest(req->w[i].iov_base, req->w[i].iov_len);
+	for (size_t i = 0; i < req->nw; i++)
+		map_guest_release(req->mc, req->w[i].iov_base);
 
 	req->mapped = false;
 
 	atomic_store_explicit((atomic_uint *)&el->len, resp_len, memory_order_relaxed);
 	atomic_store_explicit((atomic_uint *)&el->id, req->idx, memory_order_relaxed);
-	atomic_thread_fence(memory_order_release);
-	idx++;
-	atomic_store_explicit((atomic_ushort *)&q->vr.used->idx, idx, memory_order_release);
+	q->used_idx++;
 	vqueue_request_unref(req);
-}
\ No newline at end of file
+}
+
+void vqueue_init_state(struct vqueue *q, bool event_idx)
+{
+	q->last_avail_idx = 0u;
+	q->used_idx = q->used_published = atomic_load_explicit(
+		(atomic_ushort *)&q->vr.used->idx, memory_order_relaxed);
+	q->event_idx = event_idx;
+}
+
+void vqueue_disable_notify(struct vqueue *q)
+{
+	/*
+	 * With event index the driver only kicks when avail index passes
+	 * avail_event, which is left behind while the queue is drained.
+	 */
+	if (!q->event_idx)
+		atomic_store_explicit((atomic_ushort *)&q->vr.used->flags,
+				      VRING_USED_F_NO_NOTIFY,
+				      memory_order_relaxed);
+}
+
+bool vqueue_enable_notify(struct vqueue *q)
+{
+	if (q->event_idx)
+		atomic_store_explicit(
+			(atomic_ushort *)&vring_avail_event(&q->vr),
+			q->last_avail_idx, memory_order_relaxed);
+	else
+		atomic_store_explicit((atomic_ushort *)&q->vr.used->flags, 0,
+				      memory_order_relaxed);
+
+	/* Make the store visible before checking for missed requests */
+	atomic_thread_fence(memory_order_seq_cst);
+	return vqueue_are_requests_available(q);
+}
+
+bool vqueue_flush_used(struct vqueue *q)
+{
+	uint16_t old = q->used_published;
+	uint16_t new = q->used_idx;
+
+	if (old == new)
+		return false;
+
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit((atomic_ushort *)&q->vr.used->idx, new,
+			      memory_order_release);
+	q->used_published = new;
+
+	/* Order used index store against reading the driver's wishes */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (q->event_idx)
+		return vring_need_event(
+			atomic_load_explicit(
+				(atomic_ushort *)&vring_used_event(&q->vr),
+				memory_order_relaxed),
+			new, old);
+
+	return !(atomic_load_explicit((atomic_ushort *)&q->vr.avail->flags,
+				      memory_order_relaxed) &
+		 VRING_AVAIL_F_NO_INTERRUPT);
+}
@@ -37,6 +37,7 @@
 
 #include <rvgpu-proxy/gpu/rvgpu-gpu-device.h>
 #include <rvgpu-proxy/gpu/rvgpu-input-device.h>
+#include <rvgpu-proxy/gpu/rvgpu-map-guest.h>
 #include <rvgpu-proxy/rvgpu-proxy.h>
 
 #include <rvgpu-generic/rvgpu-sanity.h>
@@ -309,12 +310,124 @@ static void usage(void)
 	info("\t-s scanout\tspecify scanout in form WxH@X,Y (default: %ux%u@0,0)\n",
 	     DEFAULT_WIDTH, DEFAULT_HEIGHT);
 	info("\t-f rate\t\tspecify virtual framerate (default: disabled)\n");
+	info("\t-p usec\t\tbusy poll queues for usec after activity (default: 0, disabled)\n");
+	info("\t-q depth\tspecify virtqueue depth, power of two (default: %u)\n",
+	     QUEUE_SIZE_DEFAULT);
+	info("\t-d\t\tsend only changed tiles of 2D resources, keeps a shadow\n"
+	     "\t\t\tcopy of each one (default: disabled)\n");
+	info("\t-z\t\tcompress resource patches for renderers supporting it\n");
+	info("\t-l\t\tsend scanout updates lossy while the links can't keep\n"
+	     "\t\t\tup, for renderers supporting it (default: disabled)\n");
+	info("\t-k\t\tsend resource patches cached by the renderers as\n"
+	     "\t\t\treferences, for renderers supporting it (default: disabled)\n");
+	info("\t-r\t\treplay repeated 3D command buffers from the renderer\n"
+	     "\t\t\tcache, for renderers supporting it (default: disabled)\n");
+	info("\t-C\t\tsend the command stream only as fast as the renderers\n"
+	     "\t\t\tgrant credits, for renderers supporting it, keeps the\n"
+	     "\t\t\tbacklog in the proxy (default: disabled)\n");
+	info("\t-L msec\t\tskip scanout updates for renderers with more than\n"
+	     "\t\t\tmsec of data queued and send them the latest contents\n"
+	     "\t\t\tonce they catch up (default: disabled)\n");
 	info("\t-i id\tspecify rvgpu surface id\n");
+	info("\t-b policy\tbacking mapping policy, comma separated list of\n"
+	     "\t\t\tpopulate,prefault,willneed,hugepage,stats (default: none)\n");
 	info("\t-n\t\tserver:port for connecting (max 4 hosts, default: %s:%s)\n",
 	     RVGPU_DEFAULT_HOSTNAME, RVGPU_DEFAULT_PORT);
+	info("\t\t\tserver:port@0,1 sends 2D updates of a scanout only to\n"
+	     "\t\t\tthe servers listing it (default: all scanouts)\n");
+	info("\t-W region\tpart WxH@X,Y of its scanouts the previous -n server\n"
+	     "\t\t\tshows, it only gets 2D updates inside (default: all)\n");
+	info("\t-Q policy\thosts a fence waits for: all, primary or a number\n"
+	     "\t\t\tof hosts (default: all)\n");
+	info("\t-E fences\tstop waiting for a host more than this many fences\n"
+	     "\t\t\tbehind until it catches up (default: 0, disabled)\n");
 	info("\t-h\t\tshow this message\n");
 }
 
+/**
+ * @brief Parse backing mapping policy
+ * @param arg - comma separated list of policy names
+ * @param params - pointer to gpu device params to fill
+ */
+static void parse_backing_policy(char *arg, struct gpu_device_params *params)
+{
+	static const struct {
+		const char *name;
+		unsigned int flag;
+	} policies[] = {
+		{ "populate", MAP_GUEST_POPULATE },
+		{ "prefault", MAP_GUEST_PREFAULT },
+		{ "willneed", MAP_GUEST_WILLNEED },
+		{ "hugepage", MAP_GUEST_HUGEPAGE },
+	};
+	char *saveptr = NULL;
+
+	for (char *tok = strtok_r(arg, ",", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		size_t i;
+
+		if (strcmp(tok, "stats") == 0) {
+			params->fault_stats = true;
+			continue;
+		}
+		for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+			if (strcmp(tok, policies[i].name) == 0) {
+				params->backing_policy |= policies[i].flag;
+				break;
+			}
+		}
+		if (i == sizeof(policies) / sizeof(policies[0]))
+			errx(1, "Invalid backing policy %s", tok);
+	}
+}
+
+/**
+ * @brief Parse the scanouts shown by a host
+ * @param arg - comma separated list of scanout ids
+ * @return mask of scanouts
+ */
+static uint32_t parse_host_scanouts(char *arg)
+{
+	char *saveptr = NULL, *errstr = NULL;
+	uint32_t mask = 0;
+
+	for (char *tok = strtok_r(arg, ",", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		unsigned int id = (unsigned int)sanity_strtonum(
+			tok, 0, VIRTIO_GPU_MAX_SCANOUTS - 1, &errstr);
+
+		if (errstr != NULL)
+			errx(1, "Invalid scanout %s:%s", tok, errstr);
+		mask |= 1u << id;
+	}
+	if (mask == 0)
+		errx(1, "Empty scanout list");
+	return mask;
+}
+
+/**
+ * @brief Parse fence policy
+ * @param arg - all, primary or number of hosts
+ * @param params - pointer to gpu device params to fill
+ */
+static void parse_fence_policy(const char *arg,
+			       struct gpu_device_params *params)
+{
+	char *errstr = NULL;
+
+	if (strcmp(arg, "all") == 0) {
+		params->fence_policy = FENCE_POLICY_ALL;
+	} else if (strcmp(arg, "primary") == 0) {
+		params->fence_policy = FENCE_POLICY_PRIMARY;
+	} else {
+		params->fence_quorum = (unsigned int)sanity_strtonum(
+			arg, 1, MAX_HOSTS, &errstr);
+		if (errstr != NULL)
+			errx(1, "Invalid fence policy %s:%s", arg, errstr);
+		params->fence_policy = FENCE_POLICY_QUORUM;
+	}
+}
+
 static void *input_thread_func(void *param)
 {
 	struct input_device *inpdev = (struct input_device *)param;
@@ -336,10 +449,12 @@ int main(int argc, char **argv)
 	struct gpu_device *dev;
 	struct input_device *inpdev;
 	struct rvgpu_backend *rvgpu_be = NULL;
+	bool spinning = false;
 	int w, h, x , y;
 
 	struct gpu_device_params params = {
 		.framerate = 0u,
+		.queue_size = QUEUE_SIZE_DEFAULT,
 		.mem_limit = VMEM_DEFAULT_MB,
 		.num_scanouts = 0u,
 		.dpys = { { .r = { .x = 0,
@@ -361,18 +476,50 @@ int main(int argc, char **argv)
 	pthread_t input_thread;
 	FILE *oomFile;
 	int lo_fd, epoll_fd, opt, capset = -1;
-	char *ip, *port, *errstr = NULL;
+	char *ip, *port, *scanouts, *errstr = NULL;
 
-	while ((opt = getopt(argc, argv, "hi:n:M:c:R:f:s:")) != -1) {
+	while ((opt = getopt(argc, argv,
+			     "hdzlkrCi:n:M:c:R:f:p:q:s:b:L:W:Q:E:")) != -1) {
 		switch (opt) {
 		case 'c':
 			capset = open(optarg, O_RDONLY);
 			if (capset == -1)
 				err(1, "open %s", optarg);
 			break;
+		case 'd':
+			servers.res_shadow = true;
+			break;
+		case 'z':
+			servers.patch_lz = true;
+			break;
+		case 'l':
+			servers.lossy = true;
+			break;
+		case 'k':
+			servers.chunks = true;
+			break;
+		case 'r':
+			servers.cmd_cache = true;
+			break;
+		case 'C':
+			servers.credits = true;
+			break;
+		case 'L':
+			servers.latency_ms = (unsigned int)sanity_strtonum(
+				optarg, LATENCY_MS_MIN, LATENCY_MS_MAX, &errstr);
+			if (errstr != NULL) {
+				warnx("Latency limit should be in [%u..%u]\n",
+				      LATENCY_MS_MIN, LATENCY_MS_MAX);
+				errx(1, "Invalid latency limit %s:%s", optarg,
+				     errstr);
+			}
+			break;
 		case 'i':
 			servers.rvgpu_surface_id = optarg;
 			break;
+		case 'b':
+			parse_backing_policy(optarg, &params);
+			break;
 		case 'M':
 			params.mem_limit = (unsigned int)sanity_strtonum(
 				optarg, VMEM_MIN_MB, VMEM_MAX_MB, &errstr);
@@ -393,6 +540,29 @@ int main(int argc, char **argv)
 				     errstr);
 			}
 			break;
+		case 'p':
+			params.poll_us = (unsigned int)sanity_strtonum(
+				optarg, POLL_US_MIN, POLL_US_MAX, &errstr);
+			if (errstr != NULL) {
+				warnx("Poll budget should be in [%u..%u]\n",
+				      POLL_US_MIN, POLL_US_MAX);
+				errx(1, "Invalid poll budget %s:%s", optarg,
+				     errstr);
+			}
+			break;
+		case 'q':
+			params.queue_size = (unsigned int)sanity_strtonum(
+				optarg, QUEUE_SIZE_MIN, QUEUE_SIZE_MAX, &errstr);
+			if (errstr == NULL &&
+			    (params.queue_size & (params.queue_size - 1)) != 0)
+				errstr = "not a power of two";
+			if (errstr != NULL) {
+				warnx("Queue depth should be a power of two in [%u..%u]\n",
+				      QUEUE_SIZE_MIN, QUEUE_SIZE_MAX);
+				errx(1, "Invalid queue depth %s:%s", optarg,
+				     errstr);
+			}
+			break;
 		case 's':
 			if (params.num_scanouts >= VIRTIO_GPU_MAX_SCANOUTS) {
 				errx(1, "too many scanouts, max is %d",
@@ -419,6 +589,9 @@ int main(int argc, char **argv)
 			}
 			break;
 		case 'n':
+			scanouts = strchr(optarg, '@');
+			if (scanouts != NULL)
+				*scanouts++ = '\0';
 			ip = strtok(optarg, ":");
 			if (ip == NULL) {
 				warnx("Pass a valid IPv4 address and port\n");
@@ -435,8 +608,38 @@ int main(int argc, char **argv)
 
 			servers.hosts[servers.host_cnt].hostname = ip;
 			servers.hosts[servers.host_cnt].portnum = port;
+			if (scanouts != NULL)
+				params.host_scanouts[servers.host_cnt] =
+					parse_host_scanouts(scanouts);
 			servers.host_cnt++;
 			break;
+		case 'W':
+			if (servers.host_cnt == 0)
+				errx(1, "-W applies to the previous -n server");
+			if (sscanf(optarg, "%dx%d@%d,%d", &w, &h, &x, &y) != 4 ||
+			    w <= 0 || h <= 0 || x < 0 || y < 0)
+				errx(1, "invalid region %s", optarg);
+			params.host_regions[servers.host_cnt - 1] =
+				(struct virtio_gpu_rect){
+					.x = (uint32_t)x,
+					.y = (uint32_t)y,
+					.width = (uint32_t)w,
+					.height = (uint32_t)h,
+				};
+			break;
+		case 'Q':
+			parse_fence_policy(optarg, &params);
+			break;
+		case 'E':
+			params.fence_evict_lag = (unsigned int)sanity_strtonum(
+				optarg, FENCE_LAG_MIN, FENCE_LAG_MAX, &errstr);
+			if (errstr != NULL) {
+				warnx("Fence lag should be in [%u..%u]\n",
+				      FENCE_LAG_MIN, FENCE_LAG_MAX);
+				errx(1, "Invalid fence lag %s:%s", optarg,
+				     errstr);
+			}
+			break;
 		case 'R':
 			servers.conn_tmt_s = (unsigned int)sanity_strtonum(
 				optarg, RVGPU_MIN_CONN_TMT_S,
@@ -469,6 +672,10 @@ int main(int argc, char **argv)
 		servers.hosts[0].portnum = RVGPU_DEFAULT_PORT;
 		servers.host_cnt = 1;
 	}
+	if (params.fence_policy == FENCE_POLICY_QUORUM &&
+	    params.fence_quorum > servers.host_cnt)
+		errx(1, "Fence quorum %u exceeds the %u hosts",
+		     params.fence_quorum, servers.host_cnt);
 
 	rvgpu_be = init_backend_rvgpu(&servers);
 	assert(rvgpu_be);
@@ -522,8 +729,12 @@ int main(int argc, char **argv)
 		int i, n;
 		struct epoll_event events[8];
 
-		/* Use timeout to periodically check shutdown flag */
-		n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), 500);
+		/*
+		 * Use timeout to periodically check shutdown flag. Only peek
+		 * at the events when spinning was cut short with work left.
+		 */
+		n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events),
+			       spinning ? 0 : 500);
 		if (n < 0) {
 			if (errno == EINTR) {
 				/* Interrupted by signal, check shutdown flag */
@@ -547,6 +758,25 @@ int main(int argc, char **argv)
 				break;
 			}
 		}
+
+		/*
+		 * After activity keep spinning on the queues for a while,
+		 * saving the wakeup for back-to-back commands. Under steady
+		 * load the queues never run dry, so spinning is cut after
+		 * a number of rounds to let the other events through.
+		 */
+		if (n > 0 || spinning) {
+			unsigned int rounds = 0;
+
+			spinning = false;
+			while (!g_shutdown_requested && gpu_device_poll(dev)) {
+				gpu_device_serve(dev);
+				if (++rounds == POLL_ROUNDS_MAX) {
+					spinning = true;
+					break;
+				}
+			}
+		}
 	}
 
 	warnx("Shutdown requested, cleaning up...");
@@ -2326,6 +2326,7 @@ void rvgpu_render(struct render_params *params)
 	struct rvgpu_pr_params pp = {
 		.sp = sp,
 		.nsp = VIRTIO_GPU_MAX_SCANOUTS,
+		.features = params->features,
 	};
 	if (capset_file != NULL)
 		pp.capset = fopen(capset_file, "w");
@@ -43,6 +43,34 @@
 #include <rvgpu-renderer/compositor/rvgpu-json-helpers.h>
 #include <rvgpu-renderer/compositor/rvgpu-connection.h>
 
+/*
+ * Answer the optional protocol features requested by rvgpu-proxy after the
+ * surface id with the supported ones, which are also stored to accepted.
+ * Proxies without features send no request and get no answer.
+ */
+static bool accept_features(int sock, const char *data, uint32_t size,
+			    uint32_t *accepted)
+{
+	size_t len = strnlen(data, size) + 1;
+	struct rvgpu_features_req req;
+	uint32_t features;
+
+	*accepted = 0;
+	if (len + sizeof(req) > size)
+		return true;
+	memcpy(&req, data + len, sizeof(req));
+	if (req.magic != RVGPU_FEATURES_MAGIC)
+		return true;
+
+	features = req.features;
+	features &= RVGPU_FEATURE_LZ | RVGPU_FEATURE_LOSSY |
+		    RVGPU_FEATURE_CHUNKS | RVGPU_FEATURE_CMD_CACHE |
+		    RVGPU_FEATURE_CREDITS;
+	*accepted = features;
+	return write_all(sock, &features, sizeof(features)) ==
+	       sizeof(features);
+}
+
 static void usage(void)
 {
 	static const char program_name[] = "rvgpu-renderer";
@@ -181,6 +209,7 @@ void rvgpu_handle_connection(struct rvgpu_compositor_params *params)
 		fds.events = POLLIN;
 		num_proxy++;
 		int max_id_length = 256;
+		uint32_t features = 0;
 		char rvgpu_surface_id[max_id_length];
 		json_t *json_proxy_obj = NULL;
 		int ret = poll(&fds, 1, -1);
@@ -189,7 +218,9 @@ void rvgpu_handle_connection(struct rvgpu_compositor_params *params)
 			result = -1;
 		} else {
 			if (fds.revents & POLLIN) {
-				char *received_data = recv_str_all(newsock);
+				uint32_t received_size;
+				char *received_data = recv_buf_all(
+					newsock, &received_size);
 				if (received_data == NULL) {
 					close(newsock);
 					close(rsocket);
@@ -198,6 +229,14 @@ void rvgpu_handle_connection(struct rvgpu_compositor_params *params)
 				strncpy(rvgpu_surface_id, received_data,
 					max_id_length - 1);
 				rvgpu_surface_id[max_id_length - 1] = '\0';
+				if (!accept_features(newsock, received_data,
+						     received_size,
+						     &features)) {
+					free(received_data);
+					close(newsock);
+					close(rsocket);
+					continue;
+				}
 				free(received_data);
 				if (strcmp(rvgpu_surface_id, "no") == 0) {
 					snprintf(rvgpu_surface_id,
@@ -270,6 +309,7 @@ void rvgpu_handle_connection(struct rvgpu_compositor_params *params)
 			render_params->layout_params = layout_params;
 			render_params->domain_params = domain_params;
 			render_params->capset_file = capset_file;
+			render_params->features = features;
 			rvgpu_render(render_params);
 			free(render_params);
 			printf("rvgpu_surface_id %s render process finished\n",
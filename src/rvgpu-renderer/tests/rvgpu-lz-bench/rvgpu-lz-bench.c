@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of the patch compression: ratio and MB/s of lz_compress() and
+ * lz_decompress() on 32 bit frames. Frames are read from raw dumps given
+ * on the command line. Without files, synthetic UI and video frames are
+ * used.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rvgpu-utils/rvgpu-lz.h>
+
+#define CPP 4u
+
+struct frame {
+	const char *name;
+	uint8_t *data;
+	size_t size;
+};
+
+static uint32_t rnd_state = 0x12345678u;
+
+static uint32_t rnd(void)
+{
+	/* xorshift32, the frames are the same on every run */
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void fill_rect(uint32_t *px, uint32_t stride, uint32_t x, uint32_t y,
+		      uint32_t w, uint32_t h, uint32_t color)
+{
+	for (uint32_t j = y; j < y + h; j++) {
+		for (uint32_t i = x; i < x + w; i++)
+			px[(size_t)j * stride + i] = color;
+	}
+}
+
+static void draw_glyph(uint32_t *px, uint32_t stride, uint32_t x, uint32_t y,
+		       const uint8_t glyph[16])
+{
+	for (unsigned int r = 0; r < 16; r++) {
+		for (unsigned int c = 0; c < 8; c++) {
+			if (glyph[r] & (1u << c))
+				px[(size_t)(y + r) * stride + x + c] =
+					0xff000000u;
+		}
+	}
+}
+
+/*
+ * Desktop like frame: flat background, windows with title bars and lines
+ * of text drawn from a small set of glyphs.
+ */
+static void gen_ui(uint32_t *px, uint32_t w, uint32_t h)
+{
+	uint8_t glyphs[16][16];
+
+	for (unsigned int g = 0; g < 16; g++) {
+		for (unsigned int r = 0; r < 16; r++)
+			glyphs[g][r] = (uint8_t)rnd();
+	}
+
+	fill_rect(px, w, 0, 0, w, h, 0xff305070u);
+	for (unsigned int n = 0; n < 6; n++) {
+		uint32_t ww = w / 4 + rnd() % (w / 3);
+		uint32_t wh = h / 4 + rnd() % (h / 3);
+		uint32_t wx = rnd() % (w - ww);
+		uint32_t wy = rnd() % (h - wh);
+
+		fill_rect(px, w, wx, wy, ww, wh, 0xfff0f0f0u);
+		fill_rect(px, w, wx, wy, ww, 24, 0xff2060c0u);
+		for (uint32_t ty = wy + 32; ty + 16 <= wy + wh; ty += 20) {
+			for (uint32_t tx = wx + 8; tx + 8 <= wx + ww; tx += 8)
+				draw_glyph(px, w, tx, ty, glyphs[rnd() % 16]);
+		}
+	}
+}
+
+/*
+ * Video like frame: smooth gradients with sensor noise in the low bits,
+ * close to incompressible for a byte oriented LZ.
+ */
+static void gen_video(uint32_t *px, uint32_t w, uint32_t h)
+{
+	for (uint32_t y = 0; y < h; y++) {
+		for (uint32_t x = 0; x < w; x++) {
+			uint32_t n = rnd();
+			uint32_t r = (x * 255u / w + (n & 7u)) & 0xffu;
+			uint32_t g = (y * 255u / h + ((n >> 3) & 7u)) & 0xffu;
+			uint32_t b = ((x + y) * 127u / (w + h) +
+				      ((n >> 6) & 7u)) & 0xffu;
+
+			px[(size_t)y * w + x] = 0xff000000u | r << 16 |
+						g << 8 | b;
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench(const struct frame *f, size_t block, double min_time)
+{
+	size_t cap = block + block / 255u + 16u;
+	uint8_t *out = malloc((f->size / block + 1u) * cap);
+	uint8_t *back = malloc(block);
+	size_t *clen = calloc(f->size / block + 1u, sizeof(*clen));
+	size_t packed = 0, unpacked = 0, runs = 0;
+	double t0, tc, td;
+
+	if (!out || !back || !clen)
+		err(1, "Failed to allocate buffers");
+
+	/* Blocks that don't shrink are sent raw, as by rvgpu-proxy */
+	t0 = now();
+	do {
+		packed = 0;
+		for (size_t off = 0, i = 0; off < f->size; off += block, i++) {
+			size_t len = f->size - off < block ? f->size - off :
+							     block;
+
+			clen[i] = lz_compress(f->data + off, len, out + i * cap,
+					      len - len / 8u);
+			packed += clen[i] ? clen[i] : len;
+		}
+		runs++;
+	} while ((tc = now() - t0) < min_time);
+	tc /= (double)runs;
+
+	runs = 0;
+	t0 = now();
+	do {
+		unpacked = 0;
+		for (size_t off = 0, i = 0; off < f->size; off += block, i++) {
+			size_t len = f->size - off < block ? f->size - off :
+							     block;
+
+			if (clen[i] == 0)
+				continue;
+			unpacked += len;
+			if (lz_decompress(out + i * cap, clen[i], back, len) !=
+				    (ssize_t)len ||
+			    memcmp(back, f->data + off, len) != 0)
+				errx(1, "%s: block at %zu does not round trip",
+				     f->name, off);
+		}
+		runs++;
+	} while ((td = now() - t0) < min_time);
+	td /= (double)runs;
+
+	/* Decompression speed counts the output of compressed blocks only */
+	printf("%-12s %10zu %9zu %10zu %7.2f %11.1f", f->name, block,
+	       f->size, packed, (double)f->size / (double)packed,
+	       (double)f->size / tc / 1e6);
+	if (unpacked)
+		printf(" %11.1f\n", (double)unpacked / td / 1e6);
+	else
+		printf(" %11s\n", "-");
+
+	free(clen);
+	free(back);
+	free(out);
+}
+
+static int read_frames(const char *path, size_t frame_size,
+		       struct frame **frames, size_t *count)
+{
+	FILE *fp = fopen(path, "rb");
+
+	if (!fp) {
+		warn("%s", path);
+		return -1;
+	}
+	for (;;) {
+		uint8_t *data = malloc(frame_size);
+		struct frame *f;
+
+		if (!data)
+			err(1, "Failed to allocate frame");
+		if (fread(data, 1, frame_size, fp) != frame_size) {
+			free(data);
+			break;
+		}
+		f = realloc(*frames, (*count + 1) * sizeof(**frames));
+		if (!f)
+			err(1, "Failed to allocate frame");
+		*frames = f;
+		f[*count] = (struct frame){ path, data, frame_size };
+		(*count)++;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-s WxH] [-b block] [-t seconds] [frames.rgba...]\n"
+		"\t-s WxH\t\tframe size (default 1920x1080)\n"
+		"\t-b block\tbytes compressed at once, 0 for a whole frame\n"
+		"\t-t seconds\tminimum time per measurement (default 1)\n"
+		"Files hold raw 32 bit frames back to back. Without files,\n"
+		"synthetic UI and video frames are used.\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t w = 1920u, h = 1080u;
+	size_t block = 0, frame_size, count = 0;
+	double min_time = 1.0;
+	struct frame *frames = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:b:t:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (sscanf(optarg, "%ux%u", &w, &h) != 2 || w < 64u ||
+			    h < 64u)
+				usage(argv[0]);
+			break;
+		case 'b':
+			block = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			min_time = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	frame_size = (size_t)w * h * CPP;
+	if (block == 0 || block > frame_size)
+		block = frame_size;
+
+	for (int i = optind; i < argc; i++) {
+		if (read_frames(argv[i], frame_size, &frames, &count) < 0)
+			return EXIT_FAILURE;
+	}
+	if (optind == argc) {
+		frames = calloc(2, sizeof(*frames));
+		if (!frames)
+			err(1, "Failed to allocate frames");
+		frames[0] = (struct frame){ "ui", malloc(frame_size),
+					    frame_size };
+		frames[1] = (struct frame){ "video", malloc(frame_size),
+					    frame_size };
+		if (!frames[0].data || !frames[1].data)
+			err(1, "Failed to allocate frames");
+		gen_ui((uint32_t *)frames[0].data, w, h);
+		gen_video((uint32_t *)frames[1].data, w, h);
+		count = 2;
+	}
+	if (count == 0)
+		errx(1, "No complete %ux%u frame in the input", w, h);
+
+	printf("%-12s %10s %9s %10s %7s %11s %11s\n", "frame", "block",
+	       "bytes", "sent", "ratio", "comp MB/s", "decomp MB/s");
+	for (size_t i = 0; i < count; i++) {
+		bench(&frames[i], block, min_time);
+		free(frames[i].data);
+	}
+	free(frames);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of the resource lookup of librvgpu. Registers 10, 1k and 100k
+ * resources with rvgpu_ctx_res_create() and reports the cost of
+ * rvgpu_ctx_res_find() on random ids, next to a walk of a list of the
+ * same resources as done before the hash table.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <librvgpu/rvgpu.h>
+#include <rvgpu-utils/rvgpu-utils.h>
+
+struct list_res {
+	uint32_t resid;
+	struct list_res *next;
+};
+
+static uint32_t rnd_state = 0x12345678u;
+
+static uint32_t rnd(void)
+{
+	/* xorshift32, the ids are the same on every run */
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static struct list_res *list_find(struct list_res *head, uint32_t resid)
+{
+	for (struct list_res *r = head; r; r = r->next) {
+		if (r->resid == resid)
+			return r;
+	}
+	return NULL;
+}
+
+/* Returns the time per lookup in ns */
+static double bench_table(struct rvgpu_ctx *ctx, const uint32_t *ids,
+			  size_t nids, double min_time)
+{
+	size_t runs = 0;
+	double t0 = now(), t;
+
+	do {
+		for (size_t i = 0; i < nids; i++) {
+			if (!rvgpu_ctx_res_find(ctx, ids[i]))
+				errx(1, "Resource %u not found", ids[i]);
+		}
+		runs++;
+	} while ((t = now() - t0) < min_time);
+
+	return t * 1e9 / (double)(runs * nids);
+}
+
+static double bench_list(struct list_res *head, const uint32_t *ids,
+			 size_t nids, double min_time)
+{
+	size_t runs = 0;
+	double t0 = now(), t;
+
+	do {
+		for (size_t i = 0; i < nids; i++) {
+			if (!list_find(head, ids[i]))
+				errx(1, "Resource %u not found", ids[i]);
+		}
+		runs++;
+	} while ((t = now() - t0) < min_time);
+
+	return t * 1e9 / (double)(runs * nids);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n lookups] [-t seconds]\n"
+		"\t-n lookups\trandom ids looked up per run (default 4096)\n"
+		"\t-t seconds\tminimum time per measurement (default 1)\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	static const uint32_t counts[] = { 10u, 1000u, 100000u };
+	struct rvgpu_res_info info = { .width = 1u, .height = 1u };
+	size_t nids = 4096u;
+	double min_time = 1.0;
+	uint32_t *ids;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nids = strtoul(optarg, NULL, 0);
+			if (nids == 0)
+				usage(argv[0]);
+			break;
+		case 't':
+			min_time = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	ids = malloc(nids * sizeof(*ids));
+	if (!ids)
+		err(1, "Failed to allocate ids");
+
+	printf("%10s %14s %14s\n", "resources", "table ns/find",
+	       "list ns/find");
+	for (unsigned int c = 0; c < ARRAY_SIZE(counts); c++) {
+		struct ctx_priv priv;
+		struct rvgpu_ctx ctx = { .priv = &priv };
+		struct list_res *list, *head = NULL;
+
+		memset(&priv, 0, sizeof(priv));
+		pthread_rwlock_init(&priv.resources.lock, NULL);
+
+		list = calloc(counts[c], sizeof(*list));
+		if (!list)
+			err(1, "Failed to allocate list");
+
+		/* Guests hand out ids counting up from 1 */
+		for (uint32_t i = 0; i < counts[c]; i++) {
+			if (rvgpu_ctx_res_create(&ctx, &info, i + 1u))
+				errx(1, "Failed to create resource %u", i + 1u);
+			list[i] = (struct list_res){ i + 1u, head };
+			head = &list[i];
+		}
+		for (size_t i = 0; i < nids; i++)
+			ids[i] = 1u + rnd() % counts[c];
+
+		printf("%10u %14.1f %14.1f\n", counts[c],
+		       bench_table(&ctx, ids, nids, min_time),
+		       bench_list(head, ids, nids, min_time));
+
+		free(list);
+		rvgpu_ctx_res_destroy_all(&ctx);
+		pthread_rwlock_destroy(&priv.resources.lock);
+	}
+
+	free(ids);
+	return EXIT_SUCCESS;
+}
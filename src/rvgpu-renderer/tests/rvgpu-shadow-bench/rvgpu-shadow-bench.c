@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of the tile compare of the resource shadow. Synthetic 32 bit
+ * frames with a given share of changed tiles are synced with a shadow of
+ * the previous frame in SHADOW_TILE x SHADOW_TILE tiles, as rvgpu-proxy
+ * does for transfers. Reports the bytes saved by skipping unchanged
+ * tiles and the CPU time per megapixel of every compare variant the CPU
+ * can run.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rvgpu-utils/rvgpu-utils.h>
+
+/* The compare variants are static, so the source is built in */
+#include "../../../librvgpu/res/rvgpu-shadow.c"
+
+#define CPP 4u
+
+typedef size_t (*match_fn)(const uint8_t *a, const uint8_t *b, size_t len);
+
+struct variant {
+	const char *name;
+	match_fn fn;
+};
+
+static uint32_t rnd_state = 0x12345678u;
+
+static uint32_t rnd(void)
+{
+	/* xorshift32, the frames are the same on every run */
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Change a small box at a random place in percent of the tiles, which is
+ * the worst case for the compare: most of a changed tile is still equal.
+ */
+static void gen_frame(uint32_t *cur, const uint32_t *prev, uint32_t w,
+		      uint32_t h, unsigned int percent)
+{
+	memcpy(cur, prev, (size_t)w * h * CPP);
+	for (uint32_t ty = 0; ty < h; ty += SHADOW_TILE) {
+		for (uint32_t tx = 0; tx < w; tx += SHADOW_TILE) {
+			uint32_t tw = w - tx < SHADOW_TILE ? w - tx :
+							     SHADOW_TILE;
+			uint32_t th = h - ty < SHADOW_TILE ? h - ty :
+							     SHADOW_TILE;
+			uint32_t x, y;
+
+			if (rnd() % 100u >= percent)
+				continue;
+			x = tx + rnd() % tw;
+			y = ty + rnd() % th;
+			for (uint32_t j = y; j < y + 4u && j < ty + th; j++) {
+				uint32_t *row = cur + (size_t)j * w;
+
+				for (uint32_t i = x; i < x + 4u && i < tx + tw;
+				     i++)
+					row[i] = ~row[i];
+			}
+		}
+	}
+}
+
+/*
+ * Sync the shadow with the frame tile by tile and return the number of
+ * changed tiles, their size is added to bytes.
+ */
+static size_t sync_tiles(match_fn fn, uint8_t *shadow, const uint8_t *cur,
+			 uint32_t w, uint32_t h, size_t *bytes)
+{
+	size_t stride = (size_t)w * CPP;
+	size_t tile_bytes = (size_t)SHADOW_TILE * CPP;
+	uint32_t ncols = (w + SHADOW_TILE - 1u) / SHADOW_TILE;
+	uint8_t tiles[SHADOW_MAX_COLS];
+	size_t changed = 0;
+
+	for (uint32_t y = 0; y < h; y += SHADOW_TILE) {
+		memset(tiles, 0, ncols);
+		for (uint32_t r = y; r < y + SHADOW_TILE && r < h; r++) {
+			for (uint32_t c = 0; c < ncols; c++) {
+				size_t pos = r * stride + c * tile_bytes;
+				size_t len = stride - c * tile_bytes;
+				size_t n;
+
+				if (len > tile_bytes)
+					len = tile_bytes;
+				n = fn(shadow + pos, cur + pos, len);
+				if (n == len)
+					continue;
+				memcpy(shadow + pos + n, cur + pos + n,
+				       len - n);
+				tiles[c] = 1u;
+			}
+		}
+		for (uint32_t c = 0; c < ncols; c++) {
+			size_t len = stride - c * tile_bytes;
+			uint32_t rows = h - y;
+
+			if (!tiles[c])
+				continue;
+			if (len > tile_bytes)
+				len = tile_bytes;
+			if (rows > SHADOW_TILE)
+				rows = SHADOW_TILE;
+			*bytes += len * rows;
+			changed++;
+		}
+	}
+	return changed;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-s WxH] [-t seconds]\n"
+		"\t-s WxH\t\tframe size (default 1920x1080)\n"
+		"\t-t seconds\tminimum time per measurement (default 1)\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int percents[] = { 0, 1, 5, 25, 50, 100 };
+	struct variant variants[4];
+	unsigned int nvariants = 0;
+	uint32_t w = 1920u, h = 1080u;
+	double min_time = 1.0;
+	size_t size;
+	uint8_t *prev, *cur, *shadow;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (sscanf(optarg, "%ux%u", &w, &h) != 2 || w == 0u ||
+			    h == 0u || w > SHADOW_MAX_COLS * SHADOW_TILE)
+				usage(argv[0]);
+			break;
+		case 't':
+			min_time = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	variants[nvariants++] = (struct variant){ "scalar", match_scalar };
+#if defined(__x86_64__)
+	variants[nvariants++] = (struct variant){ "sse2", match_sse2 };
+	if (__builtin_cpu_supports("avx2"))
+		variants[nvariants++] = (struct variant){ "avx2", match_avx2 };
+#elif defined(__aarch64__)
+	variants[nvariants++] = (struct variant){ "neon", match_neon };
+#endif
+
+	size = (size_t)w * h * CPP;
+	prev = malloc(size);
+	cur = malloc(size);
+	shadow = malloc(size);
+	if (!prev || !cur || !shadow)
+		err(1, "Failed to allocate frames");
+	for (size_t i = 0; i < size; i++)
+		prev[i] = (uint8_t)rnd();
+
+	printf("%-8s %8s %8s %12s %8s %10s\n", "variant", "changed", "tiles",
+	       "bytes saved", "saved", "ms/Mpix");
+	for (unsigned int p = 0; p < ARRAY_SIZE(percents); p++) {
+		gen_frame((uint32_t *)cur, (const uint32_t *)prev, w, h,
+			  percents[p]);
+		for (unsigned int v = 0; v < nvariants; v++) {
+			double spent = 0.0;
+			size_t runs = 0, changed = 0, bytes = 0;
+
+			/* Only the compare and copy of the tiles is timed */
+			do {
+				double t0;
+
+				memcpy(shadow, prev, size);
+				bytes = 0;
+				t0 = now();
+				changed = sync_tiles(variants[v].fn, shadow,
+						     cur, w, h, &bytes);
+				spent += now() - t0;
+				runs++;
+			} while (spent < min_time);
+
+			if (memcmp(shadow, cur, size) != 0)
+				errx(1, "%s: shadow does not match the frame",
+				     variants[v].name);
+
+			printf("%-8s %7u%% %8zu %12zu %7.1f%% %10.3f\n",
+			       variants[v].name, percents[p], changed,
+			       size - bytes,
+			       100.0 * (double)(size - bytes) / (double)size,
+			       spent / (double)runs * 1e3 /
+				       ((double)w * h / 1e6));
+		}
+	}
+
+	free(shadow);
+	free(cur);
+	free(prev);
+	return EXIT_SUCCESS;
+}
@@ -36,6 +36,9 @@
 
 #include <rvgpu-generic/rvgpu-capset.h>
 #include <rvgpu-generic/rvgpu-sanity.h>
+#include <rvgpu-utils/rvgpu-chunk.h>
+#include <rvgpu-utils/rvgpu-lossy.h>
+#include <rvgpu-utils/rvgpu-lz.h>
 #include <rvgpu-utils/rvgpu-utils.h>
 #include <rvgpu-renderer/renderer/rvgpu-egl.h>
 #include <rvgpu-renderer/rvgpu-renderer.h>
@@ -51,6 +54,16 @@ struct rvgpu_pr_state {
 	int cmd_socket;
 	int res_socket;
 	atomic_uint fence_received, fence_sent;
+	uint64_t cmd_read; /**< command stream bytes read */
+	uint64_t credit; /**< command stream limit granted to the proxy */
+	uint8_t *lz_buf[2]; /**< compressed and decompressed patch payload */
+	size_t lz_cap[2];
+	struct chunk_cache chunks; /**< payloads kept for chunk references */
+	bool chunk_miss; /**< cache got out of sync with the proxy */
+	struct {
+		uint8_t *data;
+		uint32_t size;
+	} cmds[RVGPU_CMD_CACHE_SLOTS]; /**< command buffers kept for replay */
 };
 
 static void clear_scanout(struct rvgpu_pr_state *p, struct rvgpu_scanout *s);
@@ -106,6 +119,45 @@ static struct virgl_renderer_callbacks virgl_cbs = {
 	.make_current = make_context_current,
 };
 
+/*
+ * Grant the proxy another window of the command stream once a quarter of
+ * it has been read, everything read so far has been processed.
+ */
+static void rvgpu_pr_credit(struct rvgpu_pr_state *p)
+{
+	struct rvgpu_res_message_header msg = { .type = RVGPU_CREDIT };
+	struct rvgpu_credit credit = {
+		.limit = p->cmd_read + RVGPU_CREDIT_WINDOW,
+	};
+
+	if (!(p->pp.features & RVGPU_FEATURE_CREDITS) ||
+	    credit.limit - p->credit < RVGPU_CREDIT_WINDOW / 4u)
+		return;
+
+	if (write_all(p->res_socket, &msg, sizeof(msg)) != sizeof(msg) ||
+	    write_all(p->res_socket, &credit, sizeof(credit)) !=
+		    sizeof(credit)) {
+		warn("Error while writing credit to socket");
+		return;
+	}
+	p->credit = credit.limit;
+}
+
+/*
+ * Tell the proxy that the chunk cache lost sync while a resource was
+ * loaded, it drops its mirror and sends the resource in full.
+ */
+static void rvgpu_pr_chunk_miss(struct rvgpu_pr_state *p, uint32_t res_id)
+{
+	struct rvgpu_res_message_header msg = { .type = RVGPU_CHUNK_MISS };
+	struct rvgpu_chunk_miss miss = { .resid = res_id };
+
+	p->chunk_miss = false;
+	if (write_all(p->res_socket, &msg, sizeof(msg)) != sizeof(msg) ||
+	    write_all(p->res_socket, &miss, sizeof(miss)) != sizeof(miss))
+		warn("Error while writing chunk miss to socket");
+}
+
 static int rvgpu_pr_readbuf(struct rvgpu_pr_state *p, int stream)
 {
 	struct pollfd pfd[MAX_PFD];
@@ -113,6 +165,8 @@ static int rvgpu_pr_readbuf(struct rvgpu_pr_state *p, int stream)
 	int timeout = 0;
 	struct timespec barrier_delay = { .tv_nsec = 1000 };
 
+	rvgpu_pr_credit(p);
+
 	pfd[0].fd = p->cmd_socket;
 
 	pfd[0].events = POLLIN;
@@ -144,6 +198,7 @@ static int rvgpu_pr_readbuf(struct rvgpu_pr_state *p, int stream)
 
 		p->bufcurlen[stream] = (size_t)n;
 		p->bufpos[stream] = 0u;
+		p->cmd_read += (uint64_t)n;
 	}
 	for (size_t i = 0; i <= n; i++) {
 		if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))
@@ -214,6 +269,7 @@ struct rvgpu_pr_state *rvgpu_pr_init(struct rvgpu_egl_state *e,
 
 	p->cmd_socket = cmd_socket;
 	p->res_socket = res_socket;
+	p->credit = RVGPU_CREDIT_WINDOW;
 
 	return p;
 }
@@ -226,6 +282,11 @@ void rvgpu_pr_free(struct rvgpu_pr_state *p)
 	virgl_renderer_cleanup(p);
 
 	free(p->buffer[COMMAND]);
+	free(p->lz_buf[0]);
+	free(p->lz_buf[1]);
+	chunk_cache_free(&p->chunks);
+	for (unsigned int i = 0; i < RVGPU_CMD_CACHE_SLOTS; i++)
+		free(p->cmds[i].data);
 	free(p);
 }
 
@@ -265,6 +326,271 @@ resource_attach_backing(struct virtio_gpu_resource_attach_backing *r,
 	}
 }
 
+static bool rect_patch_fits(const struct iovec *p, uint32_t offset,
+			    const struct rvgpu_patch_rect *rect,
+			    uint64_t rows_len)
+{
+	return rect->height != 0 &&
+	       rows_len == (uint64_t)rect->width * rect->height &&
+	       (uint64_t)offset + (uint64_t)(rect->height - 1) * rect->stride +
+			       rect->width <=
+		       p[0].iov_len;
+}
+
+static bool load_rect_patch(struct rvgpu_pr_state *state, struct iovec *p,
+			    const struct rvgpu_patch *header)
+{
+	struct rvgpu_patch_rect rect;
+	char *dst;
+
+	if (header->len < sizeof(rect))
+		errx(1, "Wrong patch format!");
+
+	if (rvgpu_pr_read(state, &rect, sizeof(rect), 1, COMMAND) != 1)
+		return false;
+
+	if (!rect_patch_fits(p, header->offset, &rect,
+			     header->len - sizeof(rect)))
+		errx(1, "Wrong patch format!");
+
+	dst = (char *)p[0].iov_base + header->offset;
+	for (uint32_t row = 0; row < rect.height; row++) {
+		if (rvgpu_pr_read(state, dst, 1, rect.width, COMMAND) !=
+		    rect.width) {
+			/* Connection closed by peer */
+			return false;
+		}
+		dst += rect.stride;
+	}
+	return true;
+}
+
+static bool lossy_patch_fits(const struct iovec *p, uint32_t offset,
+			     const struct rvgpu_patch_lossy *q,
+			     uint64_t rows_len)
+{
+	return q->height != 0 && q->width != 0 && q->level >= 1 &&
+	       q->level <= LOSSY_LEVEL_MAX && (q->alpha == 0 || q->alpha == 3) &&
+	       rows_len == (uint64_t)lossy_row_size(q->width, q->level) *
+				   q->height &&
+	       (uint64_t)offset + (uint64_t)(q->height - 1) * q->stride +
+			       (uint64_t)q->width * LOSSY_PIXEL_SIZE <=
+		       p[0].iov_len;
+}
+
+static void unpack_lossy(struct iovec *p, uint32_t offset,
+			 const struct rvgpu_patch_lossy *q, const uint8_t *src)
+{
+	size_t packed = lossy_row_size(q->width, q->level);
+	char *dst = (char *)p[0].iov_base + offset;
+
+	for (uint32_t row = 0; row < q->height; row++) {
+		lossy_unpack_row(dst, src, q->width, q->level, q->alpha);
+		src += packed;
+		dst += q->stride;
+	}
+}
+
+static uint8_t *lz_buffer(struct rvgpu_pr_state *state, int i, size_t size)
+{
+	if (size > state->lz_cap[i]) {
+		uint8_t *buf = realloc(state->lz_buf[i], size);
+
+		if (!buf)
+			err(1, "Out of mem");
+		state->lz_buf[i] = buf;
+		state->lz_cap[i] = size;
+	}
+	return state->lz_buf[i];
+}
+
+/*
+ * Read len bytes of patch payload to a scratch buffer, decompressing it if
+ * the patch is compressed.
+ */
+static bool read_payload(struct rvgpu_pr_state *state, const struct iovec *p,
+			 uint8_t type, size_t len, uint8_t **data,
+			 size_t *size)
+{
+	struct rvgpu_patch_lz lz;
+	uint8_t *in;
+
+	if (!(type & RVGPU_PATCH_LZ)) {
+		if (len > p[0].iov_len + sizeof(struct rvgpu_patch_lossy))
+			errx(1, "Wrong patch format!");
+		*data = lz_buffer(state, 1, len);
+		*size = len;
+		/* Connection closed by peer if short */
+		return rvgpu_pr_read(state, *data, 1, len, COMMAND) == len;
+	}
+
+	if (len < sizeof(lz))
+		errx(1, "Wrong patch format!");
+
+	if (rvgpu_pr_read(state, &lz, sizeof(lz), 1, COMMAND) != 1)
+		return false;
+
+	/* Payload never exceeds the backing and the largest layout */
+	len -= sizeof(lz);
+	if (lz.size == 0 ||
+	    lz.size > p[0].iov_len + sizeof(struct rvgpu_patch_lossy) ||
+	    len > lz.size)
+		errx(1, "Wrong patch format!");
+
+	in = lz_buffer(state, 0, len);
+	*data = lz_buffer(state, 1, lz.size);
+	*size = lz.size;
+	if (rvgpu_pr_read(state, in, 1, len, COMMAND) != len) {
+		/* Connection closed by peer */
+		return false;
+	}
+
+	if (lz_decompress(in, len, *data, lz.size) != (ssize_t)lz.size)
+		errx(1, "Wrong patch format!");
+	return true;
+}
+
+/*
+ * Apply a patch payload held in memory, type is the patch type without
+ * modifier flags.
+ */
+static void apply_payload(struct iovec *p, uint8_t type, uint32_t offset,
+			  const uint8_t *data, size_t size)
+{
+	if (type & RVGPU_PATCH_LOSSY) {
+		struct rvgpu_patch_lossy q;
+
+		if (size < sizeof(q))
+			errx(1, "Wrong patch format!");
+		memcpy(&q, data, sizeof(q));
+		if (!lossy_patch_fits(p, offset, &q, size - sizeof(q)))
+			errx(1, "Wrong patch format!");
+		unpack_lossy(p, offset, &q, data + sizeof(q));
+	} else if (type & RVGPU_PATCH_RECT) {
+		struct rvgpu_patch_rect rect;
+		char *dst;
+
+		if (size < sizeof(rect))
+			errx(1, "Wrong patch format!");
+		memcpy(&rect, data, sizeof(rect));
+		if (!rect_patch_fits(p, offset, &rect, size - sizeof(rect)))
+			errx(1, "Wrong patch format!");
+
+		data += sizeof(rect);
+		dst = (char *)p[0].iov_base + offset;
+		for (uint32_t row = 0; row < rect.height; row++) {
+			memcpy(dst, data, rect.width);
+			data += rect.width;
+			dst += rect.stride;
+		}
+	} else {
+		if ((uint64_t)offset + size > p[0].iov_len)
+			errx(1, "Wrong patch format!");
+		memcpy((char *)p[0].iov_base + offset, data, size);
+	}
+}
+
+static bool load_lz_patch(struct rvgpu_pr_state *state, struct iovec *p,
+			  const struct rvgpu_patch *header)
+{
+	uint8_t *data;
+	size_t size;
+
+	if (!read_payload(state, p, header->type, header->len, &data, &size))
+		return false;
+
+	apply_payload(p, header->type & ~RVGPU_PATCH_LZ, header->offset, data,
+		      size);
+	return true;
+}
+
+/*
+ * Apply a chunk cache patch: take the payload of a ref patch from the
+ * cache, keep the payload of a store patch in it. If the cache turns out
+ * to be out of sync it is dropped and the patch is left out, the proxy
+ * is asked to resend the resource once it is loaded.
+ */
+static bool load_chunk_patch(struct rvgpu_pr_state *state, struct iovec *p,
+			     const struct rvgpu_patch *header)
+{
+	uint8_t type = header->type &
+		       ~(RVGPU_PATCH_LZ | RVGPU_PATCH_STORE | RVGPU_PATCH_REF);
+	struct rvgpu_patch_chunk chunk;
+	struct chunk *ch;
+	uint8_t *data, *copy;
+	size_t size;
+
+	if (header->len < sizeof(chunk))
+		errx(1, "Wrong patch format!");
+
+	if (rvgpu_pr_read(state, &chunk, sizeof(chunk), 1, COMMAND) != 1)
+		return false;
+
+	if (!state->chunks.buckets &&
+	    chunk_cache_init(&state->chunks, RVGPU_CHUNK_CACHE_SIZE,
+			     RVGPU_CHUNK_MIN_SIZE))
+		err(1, "Out of mem");
+
+	if (header->type & RVGPU_PATCH_REF) {
+		if (header->len != sizeof(chunk))
+			errx(1, "Wrong patch format!");
+		ch = chunk_cache_find(&state->chunks, chunk.hash, chunk.size);
+		if (!ch) {
+			warnx("Unknown chunk %016" PRIx64, chunk.hash);
+			chunk_cache_clear(&state->chunks);
+			state->chunk_miss = true;
+			return true;
+		}
+		apply_payload(p, type, header->offset, ch->data, ch->size);
+		return true;
+	}
+
+	if (!read_payload(state, p, header->type,
+			  header->len - sizeof(chunk), &data, &size))
+		return false;
+	if (size != chunk.size)
+		errx(1, "Wrong patch format!");
+
+	apply_payload(p, type, header->offset, data, size);
+
+	copy = malloc(size);
+	if (copy)
+		memcpy(copy, data, size);
+	if (!copy ||
+	    chunk_cache_insert(&state->chunks, chunk.hash, chunk.size, copy)) {
+		warnx("Failed to cache chunk %016" PRIx64, chunk.hash);
+		chunk_cache_clear(&state->chunks);
+		state->chunk_miss = true;
+	}
+	return true;
+}
+
+static bool load_lossy_patch(struct rvgpu_pr_state *state, struct iovec *p,
+			     const struct rvgpu_patch *header)
+{
+	struct rvgpu_patch_lossy q;
+	size_t len;
+	uint8_t *buf;
+
+	if (header->len < sizeof(q))
+		errx(1, "Wrong patch format!");
+
+	if (rvgpu_pr_read(state, &q, sizeof(q), 1, COMMAND) != 1)
+		return false;
+
+	len = header->len - sizeof(q);
+	if (!lossy_patch_fits(p, header->offset, &q, len))
+		errx(1, "Wrong patch format!");
+
+	buf = lz_buffer(state, 1, len);
+	if (rvgpu_pr_read(state, buf, 1, len, COMMAND) != len) {
+		/* Connection closed by peer */
+		return false;
+	}
+	unpack_lossy(p, header->offset, &q, buf);
+	return true;
+}
+
 static bool load_resource_patched(struct rvgpu_pr_state *state, struct iovec *p)
 {
 	struct rvgpu_patch header = { 0, 0, 0 };
@@ -275,6 +601,30 @@ static bool load_resource_patched(struct rvgpu_pr_state *state, struct iovec *p)
 		if (header.len == 0)
 			break;
 
+		if (header.type & (RVGPU_PATCH_STORE | RVGPU_PATCH_REF)) {
+			if (!load_chunk_patch(state, p, &header))
+				return false;
+			continue;
+		}
+
+		if (header.type & RVGPU_PATCH_LZ) {
+			if (!load_lz_patch(state, p, &header))
+				return false;
+			continue;
+		}
+
+		if (header.type == RVGPU_PATCH_RECT) {
+			if (!load_rect_patch(state, p, &header))
+				return false;
+			continue;
+		}
+
+		if (header.type == RVGPU_PATCH_LOSSY) {
+			if (!load_lossy_patch(state, p, &header))
+				return false;
+			continue;
+		}
+
 		if (stream == COMMAND)
 			offset = header.offset;
 
@@ -307,6 +657,8 @@ static bool load_resource(struct rvgpu_pr_state *state, unsigned int res_id)
 			return false;
 		}
 		virgl_renderer_resource_attach_iov(res_id, p, iovn);
+		if (state->chunk_miss)
+			rvgpu_pr_chunk_miss(state, res_id);
 	}
 
 	return load;
@@ -509,6 +861,49 @@ static void rvgpu_handle_submit_3d(struct rvgpu_pr_state *p, union virtio_gpu_cm
 	p->egl->has_submit_3d_draw = true;
 }
 
+/*
+ * Complete a replayed SUBMIT_3D with the command buffer kept in its slot
+ */
+static void replay_cmdbuf(struct rvgpu_pr_state *p, union virtio_gpu_cmd *r,
+			  struct rvgpu_header *uhdr)
+{
+	if (uhdr->size != sizeof(r->c_submit) ||
+	    r->hdr.type != VIRTIO_GPU_CMD_SUBMIT_3D ||
+	    uhdr->idx >= RVGPU_CMD_CACHE_SLOTS)
+		errx(1, "Invalid command replay");
+
+	if (!p->cmds[uhdr->idx].data ||
+	    p->cmds[uhdr->idx].size != r->c_submit.size)
+		errx(1, "Unknown command buffer in slot %u", uhdr->idx);
+
+	memcpy(r->buf + sizeof(r->c_submit), p->cmds[uhdr->idx].data,
+	       r->c_submit.size);
+	uhdr->size += r->c_submit.size;
+}
+
+/*
+ * Keep the command buffer of a SUBMIT_3D in a slot for later replays
+ */
+static void store_cmdbuf(struct rvgpu_pr_state *p,
+			 const union virtio_gpu_cmd *r, uint16_t idx)
+{
+	uint32_t size = r->c_submit.size;
+
+	if (r->hdr.type != VIRTIO_GPU_CMD_SUBMIT_3D ||
+	    idx >= RVGPU_CMD_CACHE_SLOTS || size == 0u ||
+	    size > RVGPU_CMD_CACHE_MAX_SIZE)
+		errx(1, "Invalid command store");
+
+	if (p->cmds[idx].size != size) {
+		free(p->cmds[idx].data);
+		p->cmds[idx].data = malloc(size);
+		if (!p->cmds[idx].data)
+			err(1, "Failed to cache command buffer");
+		p->cmds[idx].size = size;
+	}
+	memcpy(p->cmds[idx].data, r->buf + sizeof(r->c_submit), size);
+}
+
 unsigned int rvgpu_pr_dispatch(struct rvgpu_pr_state *p)
 {
 	static union virtio_gpu_cmd r;
@@ -585,6 +980,9 @@ unsigned int rvgpu_pr_dispatch(struct rvgpu_pr_state *p)
 			virgl_cmd_laptime = current_get_time_ms();
 		}
 
+		if (uhdr.flags & RVGPU_CMD_REPLAY)
+			replay_cmdbuf(p, &r, &uhdr);
+
 		if (uhdr.flags & RVGPU_CURSOR)
 			sane = sanity_check_gpu_cursor(&r, uhdr.size, false);
 		else
@@ -593,6 +991,9 @@ unsigned int rvgpu_pr_dispatch(struct rvgpu_pr_state *p)
 		if (sane != VIRTIO_GPU_RESP_OK_NODATA)
 			errx(1, "insane command issued: %x", (int)r.hdr.type);
 
+		if (uhdr.flags & RVGPU_CMD_STORE)
+			store_cmdbuf(p, &r, uhdr.idx);
+
 		virgl_renderer_force_ctx_0();
 		virgl_renderer_poll();
 		switch (r.hdr.type) {
@@ -157,13 +157,14 @@ bool sanity_check_resource_box(const struct virtio_gpu_box *b, uint32_t width,
 	return true;
 }
 
-enum virtio_gpu_ctrl_type sanity_check_gpu_ctrl(const union virtio_gpu_cmd *cmd,
-						size_t size, bool strict)
+enum virtio_gpu_ctrl_type
+sanity_check_gpu_ctrl_head(const union virtio_gpu_cmd_head *cmd, size_t size,
+			   bool strict)
 {
 	if (size < sizeof(cmd->hdr))
 		return VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
 
-	if (size > sizeof(*cmd))
+	if (size > sizeof(union virtio_gpu_cmd))
 		return VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
 
 	switch (cmd->hdr.type) {
@@ -356,9 +357,17 @@ enum virtio_gpu_ctrl_type sanity_check_gpu_ctrl(const union virtio_gpu_cmd *cmd,
 	}
 }
 
+enum virtio_gpu_ctrl_type sanity_check_gpu_ctrl(const union virtio_gpu_cmd *cmd,
+						size_t size, bool strict)
+{
+	/* The heads are the common initial part of the commands */
+	return sanity_check_gpu_ctrl_head(
+		(const union virtio_gpu_cmd_head *)cmd, size, strict);
+}
+
 enum virtio_gpu_ctrl_type
-sanity_check_gpu_cursor(const union virtio_gpu_cmd *cmd, size_t size,
-			bool strict)
+sanity_check_gpu_cursor_head(const union virtio_gpu_cmd_head *cmd,
+			     size_t size, bool strict)
 {
 	(void)strict;
 	if (size != sizeof(cmd->cursor))
@@ -379,3 +388,11 @@ sanity_check_gpu_cursor(const union virtio_gpu_cmd *cmd, size_t size,
 		return VIRTIO_GPU_RESP_ERR_UNSPEC;
 	}
 }
+
+enum virtio_gpu_ctrl_type
+sanity_check_gpu_cursor(const union virtio_gpu_cmd *cmd, size_t size,
+			bool strict)
+{
+	return sanity_check_gpu_cursor_head(
+		(const union virtio_gpu_cmd_head *)cmd, size, strict);
+}
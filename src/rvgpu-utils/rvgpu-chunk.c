@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <rvgpu-utils/rvgpu-chunk.h>
+
+#define PRIME64_1 0x9e3779b185ebca87ull
+#define PRIME64_2 0xc2b2ae3d27d4eb4full
+#define PRIME64_3 0x165667b19e3779f9ull
+#define PRIME64_4 0x85ebca77c2b2ae63ull
+#define PRIME64_5 0x27d4eb2f165667c5ull
+
+static inline uint64_t rotl64(uint64_t v, unsigned int r)
+{
+	return (v << r) | (v >> (64u - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t v)
+{
+	acc += v * PRIME64_2;
+	return rotl64(acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v)
+{
+	acc ^= round64(0, v);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t chunk_hash(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= 32u) {
+		uint64_t v1 = PRIME64_1 + PRIME64_2, v2 = PRIME64_2, v3 = 0,
+			 v4 = -PRIME64_1;
+
+		do {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) +
+		    rotl64(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = PRIME64_5;
+	}
+
+	h += (uint64_t)len;
+
+	for (; end - p >= 8; p += 8) {
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t)read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+int chunk_cache_init(struct chunk_cache *c, size_t cap, size_t min_size)
+{
+	size_t n = cap / (min_size ? min_size : 1u);
+	uint32_t nbuckets = 16u;
+
+	while (nbuckets < n && nbuckets < (1u << 24))
+		nbuckets *= 2u;
+
+	c->buckets = malloc(nbuckets * sizeof(*c->buckets));
+	if (!c->buckets)
+		return -1;
+	for (uint32_t i = 0; i < nbuckets; i++)
+		LIST_INIT(&c->buckets[i]);
+
+	c->nbuckets = nbuckets;
+	TAILQ_INIT(&c->lru);
+	c->cap = cap;
+	c->used = 0u;
+	return 0;
+}
+
+static void chunk_remove(struct chunk_cache *c, struct chunk *ch)
+{
+	LIST_REMOVE(ch, hash_link);
+	TAILQ_REMOVE(&c->lru, ch, lru_link);
+	c->used -= ch->size;
+	free(ch->data);
+	free(ch);
+}
+
+void chunk_cache_clear(struct chunk_cache *c)
+{
+	struct chunk *ch;
+
+	while ((ch = TAILQ_FIRST(&c->lru)) != NULL)
+		chunk_remove(c, ch);
+}
+
+void chunk_cache_free(struct chunk_cache *c)
+{
+	if (!c->buckets)
+		return;
+
+	chunk_cache_clear(c);
+	free(c->buckets);
+	c->buckets = NULL;
+	c->nbuckets = 0u;
+}
+
+static struct chunk_bucket *chunk_bucket(struct chunk_cache *c,
+					 uint64_t hash)
+{
+	return &c->buckets[(hash ^ (hash >> 32)) & (c->nbuckets - 1u)];
+}
+
+struct chunk *chunk_cache_find(struct chunk_cache *c, uint64_t hash,
+			       uint32_t size)
+{
+	struct chunk *ch;
+
+	LIST_FOREACH(ch, chunk_bucket(c, hash), hash_link) {
+		if (ch->hash == hash && ch->size == size) {
+			TAILQ_REMOVE(&c->lru, ch, lru_link);
+			TAILQ_INSERT_HEAD(&c->lru, ch, lru_link);
+			return ch;
+		}
+	}
+	return NULL;
+}
+
+int chunk_cache_insert(struct chunk_cache *c, uint64_t hash, uint32_t size,
+		       void *data)
+{
+	struct chunk *ch;
+
+	if (size > c->cap) {
+		free(data);
+		return -1;
+	}
+
+	LIST_FOREACH(ch, chunk_bucket(c, hash), hash_link) {
+		if (ch->hash == hash && ch->size == size) {
+			chunk_remove(c, ch);
+			break;
+		}
+	}
+
+	while (c->used + size > c->cap)
+		chunk_remove(c, TAILQ_LAST(&c->lru, chunk_lru));
+
+	ch = malloc(sizeof(*ch));
+	if (!ch) {
+		free(data);
+		return -1;
+	}
+	ch->hash = hash;
+	ch->size = size;
+	ch->data = data;
+	LIST_INSERT_HEAD(chunk_bucket(c, hash), ch, hash_link);
+	TAILQ_INSERT_HEAD(&c->lru, ch, lru_link);
+	c->used += size;
+	return 0;
+}
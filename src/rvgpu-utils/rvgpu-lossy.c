@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <rvgpu-utils/rvgpu-lossy.h>
+
+/* Quantize an 8 bit channel to bits, rounding to the nearest level */
+static inline uint32_t quant(uint8_t c, unsigned int bits)
+{
+	uint32_t max = (1u << bits) - 1u;
+
+	return ((uint32_t)c * max + 127u) / 255u;
+}
+
+/* Expand a quantized channel back to 8 bits by bit replication */
+static inline uint8_t expand(uint32_t v, unsigned int bits)
+{
+	uint32_t c = v << (8u - bits);
+
+	while (bits < 8u) {
+		c |= c >> bits;
+		bits *= 2u;
+	}
+	return (uint8_t)c;
+}
+
+void lossy_pack_row(void *dst, const void *src, uint32_t width,
+		    unsigned int level, unsigned int alpha)
+{
+	const uint8_t *s = (const uint8_t *)src + (alpha == 0u ? 1u : 0u);
+	uint8_t *d = dst;
+
+	switch (level) {
+	case 0:
+		memcpy(dst, src, (size_t)width * LOSSY_PIXEL_SIZE);
+		break;
+	case 1:
+		for (uint32_t i = 0; i < width; i++, s += LOSSY_PIXEL_SIZE) {
+			uint32_t v = quant(s[0], 5u) | quant(s[1], 6u) << 5 |
+				     quant(s[2], 5u) << 11;
+
+			*d++ = (uint8_t)v;
+			*d++ = (uint8_t)(v >> 8);
+		}
+		break;
+	case 2:
+		for (uint32_t i = 0; i < width; i++, s += LOSSY_PIXEL_SIZE)
+			*d++ = (uint8_t)(quant(s[0], 3u) | quant(s[1], 3u) << 3 |
+					 quant(s[2], 2u) << 6);
+		break;
+	}
+}
+
+void lossy_unpack_row(void *dst, const void *src, uint32_t width,
+		      unsigned int level, unsigned int alpha)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	unsigned int c = (alpha == 0u) ? 1u : 0u;
+
+	switch (level) {
+	case 0:
+		memcpy(dst, src, (size_t)width * LOSSY_PIXEL_SIZE);
+		break;
+	case 1:
+		for (uint32_t i = 0; i < width; i++, d += LOSSY_PIXEL_SIZE) {
+			uint32_t v = s[0] | (uint32_t)s[1] << 8;
+
+			s += 2;
+			d[c] = expand(v & 0x1fu, 5u);
+			d[c + 1u] = expand((v >> 5) & 0x3fu, 6u);
+			d[c + 2u] = expand(v >> 11, 5u);
+			d[alpha] = 0xff;
+		}
+		break;
+	case 2:
+		for (uint32_t i = 0; i < width; i++, d += LOSSY_PIXEL_SIZE) {
+			uint32_t v = *s++;
+
+			d[c] = expand(v & 0x7u, 3u);
+			d[c + 1u] = expand((v >> 3) & 0x7u, 3u);
+			d[c + 2u] = expand(v >> 6, 2u);
+			d[alpha] = 0xff;
+		}
+		break;
+	}
+}
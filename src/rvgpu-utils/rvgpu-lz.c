@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: Apache-2.0
+/**
+ * Copyright (c) 2022  Panasonic Automotive Systems, Co., Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <rvgpu-utils/rvgpu-lz.h>
+
+#define LZ_HASH_BITS 12u
+#define LZ_MIN_MATCH 4u
+/* The block ends with at least this many literals */
+#define LZ_LAST_LITERALS 5u
+/* The last match starts at least this many bytes before the end */
+#define LZ_MFLIMIT 12u
+#define LZ_MAX_OFFSET 65535u
+/* Misses before the search starts skipping over incompressible data */
+#define LZ_SKIP_TRIGGER 6u
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32u - LZ_HASH_BITS);
+}
+
+static bool put_len(uint8_t **op, const uint8_t *oend, size_t len)
+{
+	while (len >= 255u) {
+		if (*op >= oend)
+			return false;
+		*(*op)++ = 255u;
+		len -= 255u;
+	}
+	if (*op >= oend)
+		return false;
+	*(*op)++ = (uint8_t)len;
+	return true;
+}
+
+/*
+ * Emit nlit literals followed by a match, or only the literals if mlen is
+ * zero (last sequence). mlen includes the implicit LZ_MIN_MATCH bytes.
+ */
+static bool put_sequence(uint8_t **op, const uint8_t *oend, const uint8_t *lit,
+			 size_t nlit, size_t offset, size_t mlen)
+{
+	uint8_t *token;
+
+	if (*op >= oend)
+		return false;
+	token = (*op)++;
+	*token = (uint8_t)((nlit >= 15u ? 15u : nlit) << 4);
+	if (nlit >= 15u && !put_len(op, oend, nlit - 15u))
+		return false;
+	if ((size_t)(oend - *op) < nlit)
+		return false;
+	memcpy(*op, lit, nlit);
+	*op += nlit;
+
+	if (mlen == 0u)
+		return true;
+
+	mlen -= LZ_MIN_MATCH;
+	if (oend - *op < 2)
+		return false;
+	(*op)[0] = (uint8_t)(offset & 0xffu);
+	(*op)[1] = (uint8_t)(offset >> 8);
+	*op += 2;
+	*token |= (uint8_t)(mlen >= 15u ? 15u : mlen);
+	if (mlen >= 15u && !put_len(op, oend, mlen - 15u))
+		return false;
+	return true;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *in = src;
+	const uint8_t *ip = in, *anchor = in;
+	const uint8_t *end = in + len;
+	uint8_t *op = dst;
+	const uint8_t *oend = op + cap;
+	uint32_t table[1u << LZ_HASH_BITS];
+	unsigned int misses = 0;
+
+	memset(table, 0, sizeof(table));
+
+	if (len > LZ_MFLIMIT) {
+		const uint8_t *mflimit = end - LZ_MFLIMIT;
+		const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = lz_hash(seq);
+			const uint8_t *ref = in + table[h];
+			const uint8_t *mp, *mr;
+
+			table[h] = (uint32_t)(ip - in);
+			if (ref >= ip || (size_t)(ip - ref) > LZ_MAX_OFFSET ||
+			    read32(ref) != seq) {
+				ip += 1u + (misses++ >> LZ_SKIP_TRIGGER);
+				continue;
+			}
+			misses = 0;
+
+			while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			mp = ip + LZ_MIN_MATCH;
+			mr = ref + LZ_MIN_MATCH;
+			while (mp < matchlimit && *mp == *mr) {
+				mp++;
+				mr++;
+			}
+
+			if (!put_sequence(&op, oend, anchor,
+					  (size_t)(ip - anchor),
+					  (size_t)(ip - ref),
+					  (size_t)(mp - ip)))
+				return 0;
+			ip = mp;
+			anchor = ip;
+		}
+	}
+
+	if (!put_sequence(&op, oend, anchor, (size_t)(end - anchor), 0, 0))
+		return 0;
+
+	return (size_t)(op - (uint8_t *)dst);
+}
+
+static bool get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return false;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255u);
+	return true;
+}
+
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + len;
+	uint8_t *out = dst;
+	uint8_t *op = out;
+	uint8_t *oend = out + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t nlit = token >> 4;
+		size_t mlen = token & 15u;
+		size_t offset;
+
+		if (nlit == 15u && !get_len(&ip, iend, &nlit))
+			return -1;
+		if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		if (ip == iend)
+			break; /* last sequence has no match */
+
+		if (iend - ip < 2)
+			return -1;
+		offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if (offset == 0u || offset > (size_t)(op - out))
+			return -1;
+
+		if (mlen == 15u && !get_len(&ip, iend, &mlen))
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+
+		if (offset >= mlen) {
+			memcpy(op, op - offset, mlen);
+			op += mlen;
+		} else {
+			/* Overlapping match repeats the last offset bytes */
+			for (size_t i = 0; i < mlen; i++, op++)
+				*op = *(op - offset);
+		}
+	}
+
+	return (ssize_t)(op - out);
+}
@@ -96,26 +96,30 @@ ssize_t read_all(int fd, void *buf, size_t count)
 	return count - remaining;
 }
 
-void send_str_with_size(int client_fd, const char *str)
+void send_buf_with_size(int client_fd, const void *buf, uint32_t size)
 {
-	uint32_t buffer_size_hb = strlen(str) + 1;
-	uint32_t buffer_size = htonl(buffer_size_hb);
+	uint32_t buffer_size = htonl(size);
 
 	ssize_t sent_bytes =
 		write_all(client_fd, &buffer_size, sizeof(buffer_size));
 	if (sent_bytes != sizeof(buffer_size)) {
-		perror("send_str_with_size size write");
+		perror("send_buf_with_size size write");
 		return;
 	}
 
-	sent_bytes = write_all(client_fd, str, buffer_size_hb);
-	if (sent_bytes != (ssize_t)buffer_size_hb) {
-		perror("send_str_with_size data write");
+	sent_bytes = write_all(client_fd, buf, size);
+	if (sent_bytes != (ssize_t)size) {
+		perror("send_buf_with_size data write");
 	}
 }
 
-// Need to free buffer after use
-char *recv_str_all(int client_fd)
+void send_str_with_size(int client_fd, const char *str)
+{
+	send_buf_with_size(client_fd, str, strlen(str) + 1);
+}
+
+// Need to free buffer after use, it is NUL terminated past size
+char *recv_buf_all(int client_fd, uint32_t *size)
 {
 	uint32_t buffer_size_nb;
 
@@ -138,6 +142,14 @@ char *recv_str_all(int client_fd)
 	}
 
 	buffer[buffer_size] = '\0';
+	if (size != NULL)
+		*size = buffer_size;
 
 	return buffer;
 }
+
+// Need to free buffer after use
+char *recv_str_all(int client_fd)
+{
+	return recv_buf_all(client_fd, NULL);
+}